@@ -11,14 +11,99 @@
 #ifndef ALLOCATOR_H
 #define ALLOCATOR_H
 
+#include <autoconf.h>
 #include <sel4/sel4.h>
 
 /* Minimum/maximum size of untyped objects we will support. */
 #define MIN_UNTYPED_SIZE 4
 #define MAX_UNTYPED_SIZE 32
 
-/* Maximum number of untyped items we will support. */
-#define MAX_UNTYPED_ITEMS 256
+/* Maximum number of children created by a single split of an untyped item,
+ * as a power of two. */
+#define MAX_SPLIT_FANOUT_BITS 4
+
+/* Number of children, as a power of two, created by splits on the way down
+ * to the size an allocation needs. Four children use no more slots per bit
+ * than halving, in half as many retypes. */
+#define INTERMEDIATE_SPLIT_FANOUT_BITS 2
+
+/* Number of free cap slots below which splits halve items instead, which
+ * uses the fewest slots. */
+#define SPLIT_FANOUT_MIN_FREE_SLOTS 256
+
+/* Number of initial untyped items, and of splits of untyped items, an
+ * allocator created without storage of its own can keep track of (see
+ * struct default_allocator). */
+#define DEFAULT_UNTYPED_ITEMS 256
+#define DEFAULT_UNTYPED_SPLITS 256
+
+/* Number of chains in the index of splits by the caps of their children,
+ * and the chain for a split whose first child is 'cap'. The children of a
+ * split span at most two chains' worth of caps. */
+#define SPLIT_HASH_BUCKETS 64
+#define SPLIT_HASH(cap) \
+    (((cap) >> MAX_SPLIT_FANOUT_BITS) % SPLIT_HASH_BUCKETS)
+
+/* Number of different sizes of untyped items. */
+#define NUM_UNTYPED_SIZES ((MAX_UNTYPED_SIZE - MIN_UNTYPED_SIZE) + 1)
+
+/* Number of cap slots an allocator created without storage of its own can
+ * manage (see struct default_allocator). */
+#define MAX_CSLOTS (1 << 14)
+
+/* Maximum number of extra CNodes an allocator will create to grow its supply
+ * of cap slots. */
+#define MAX_CSPACE_EXTENSIONS 16
+
+/* Number of free cap slots below which an allocator that is allowed to grow
+ * its CSpace does so, leaving enough slots to split the untyped item the new
+ * CNode is made from. */
+#define CSPACE_GROWTH_RESERVE (4 << MAX_SPLIT_FANOUT_BITS)
+
+/* Maximum number of outstanding marks (see allocator_mark()), and the number
+ * of allocations allocator_create() lets us keep track of while any are
+ * outstanding. */
+#define MAX_ALLOCATOR_MARKS 16
+#define MAX_JOURNAL_ENTRIES 256
+
+/* Size of the bitmaps used to track 'n' cap slots, and of the storage they
+ * need in all. */
+#define CSLOT_WORD_BITS (sizeof(seL4_Word) * 8)
+#define CSLOT_BITMAP_WORDS(n) (((n) + CSLOT_WORD_BITS - 1) / CSLOT_WORD_BITS)
+#define CSLOT_SUMMARY_WORDS(n) \
+    ((CSLOT_BITMAP_WORDS(n) + CSLOT_WORD_BITS - 1) / CSLOT_WORD_BITS)
+#define CSLOT_STORAGE_WORDS(n) \
+    (2 * CSLOT_BITMAP_WORDS(n) + CSLOT_SUMMARY_WORDS(n))
+
+/* Version of the format written by allocator_serialize(). */
+#define ALLOCATOR_SERIAL_VERSION 2
+
+#ifdef CONFIG_LIB_SEL4_TWINKLE_CACHE_COLOURING
+/* Most cache colours we tell apart, as a power of two. If one way of the
+ * cache spans more pages than that, pages are coloured by the top bits of
+ * the cache set index only. */
+#define MAX_CACHE_COLOUR_BITS 5
+
+/* Pages whose physical addresses agree in the bits from CACHE_COLOUR_SHIFT
+ * up to the size of a cache way have the same colour. */
+#define CACHE_COLOUR_SHIFT \
+    (CONFIG_LIB_SEL4_TWINKLE_CACHE_WAY_BITS - MAX_CACHE_COLOUR_BITS \
+     > seL4_PageBits \
+     ? CONFIG_LIB_SEL4_TWINKLE_CACHE_WAY_BITS - MAX_CACHE_COLOUR_BITS \
+     : seL4_PageBits)
+#define NUM_CACHE_COLOURS \
+    (1UL << (CONFIG_LIB_SEL4_TWINKLE_CACHE_WAY_BITS - CACHE_COLOUR_SHIFT))
+
+/* Bitmap of every colour. */
+#define ALL_CACHE_COLOURS ((1UL << (NUM_CACHE_COLOURS - 1) << 1) - 1)
+
+/* The colour of the page at physical address 'paddr'. */
+#define CACHE_COLOUR(paddr) \
+    (((paddr) >> CACHE_COLOUR_SHIFT) & (NUM_CACHE_COLOURS - 1))
+#endif
+
+/* Physical address of memory whose address we don't know. */
+#define UNKNOWN_PADDR (~(seL4_Word)0)
 
 /* An untyped item. */
 struct untyped_item {
@@ -29,12 +114,185 @@ struct untyped_item {
     unsigned long size_bits;
 };
 
+/*
+ * An untyped item given to an allocator, which it keeps until destroyed.
+ */
+struct init_untyped_item {
+    seL4_CPtr cap;
+    unsigned long size_bits;
+    /* Physical address of the item, or UNKNOWN_PADDR. */
+    seL4_Word paddr;
+    unsigned long is_free;
+    unsigned long is_split;
+    /* Whether the item was borrowed from our parent allocator. */
+    unsigned long is_borrowed;
+    /* Whether the item is waiting to be recycled by an incremental reset. */
+    unsigned long is_stale;
+    /* Next free item of the same size, or -1. */
+    int next_free;
+};
+
+/*
+ * An untyped item that has been split into equally sized children, held in
+ * consecutive cap slots.
+ */
+struct untyped_split {
+    /* The item that was split, or zero if this record is unused. */
+    seL4_CPtr parent;
+
+    /* Where the parent came from: child 'parent_index' of split
+     * 'parent_split', or initial item 'parent_index' if 'parent_split' is
+     * -1. */
+    int parent_split;
+    unsigned long parent_index;
+
+    /* The children, and the physical address of the first one (or
+     * UNKNOWN_PADDR). */
+    seL4_CPtr first;
+    unsigned long size_bits;
+    unsigned long count;
+    seL4_Word paddr;
+
+    /* Bitmaps of children that are free, that have been split, and that
+     * have been split and then deleted to free up their cap slots. */
+    unsigned long free;
+    unsigned long split;
+    unsigned long deleted;
+
+    /* Whether the children are part of a small region (see
+     * allocator_set_placement()). */
+    int in_small_region;
+
+    /* Other splits of the same size with free children (or, for unused
+     * records, the next unused record). */
+    int next;
+    int prev;
+
+    /* The next split on the same chain of the index by cap. */
+    int hash_next;
+};
+
+/*
+ * Policy for choosing which free memory allocations are carved out of; see
+ * allocator_set_placement().
+ */
+struct allocator_placement {
+    unsigned long small_bits;
+    unsigned long small_region_bits;
+    unsigned long reserve_bits;
+};
+
+/* A number of untyped items of a given size. */
+struct untyped_profile {
+    unsigned long size_bits;
+    unsigned long count;
+};
+
 /* A range of caps. */
 struct cap_range {
     unsigned long first;
     unsigned long count;
 };
 
+/*
+ * The location of a cap slot in the form the kernel wants it: slot 'offset'
+ * of the CNode found by resolving 'depth' bits of 'cnode'.
+ */
+struct cslot_path {
+    seL4_CPtr cnode;
+    unsigned long depth;
+    seL4_Word offset;
+};
+
+/*
+ * An allocation made while a mark was outstanding: the untyped item 'first' of
+ * 'size_bits' bits if 'count' is zero, or 'count' cap slots starting at
+ * 'first'. 'first' is zero if it has been freed since.
+ */
+struct journal_entry {
+    seL4_CPtr first;
+    unsigned long size_bits;
+    unsigned long count;
+};
+
+/* Operations recorded in the trace. */
+#define ALLOCATOR_TRACE_ALLOC_UNTYPED    1
+#define ALLOCATOR_TRACE_ALLOC_UNTYPED_AT 2
+#define ALLOCATOR_TRACE_FREE_UNTYPED     3
+#define ALLOCATOR_TRACE_RETYPE           4
+#define ALLOCATOR_TRACE_ALLOC_CSLOTS     5
+#define ALLOCATOR_TRACE_FREE_CSLOTS      6
+#define ALLOCATOR_TRACE_RESET            7
+#define ALLOCATOR_TRACE_RESET_WARM       8
+#define ALLOCATOR_TRACE_MAINTAIN         9
+#define ALLOCATOR_TRACE_RESET_BEGIN     10
+#define ALLOCATOR_TRACE_RESET_CONTINUE  11
+
+/*
+ * A call into the allocator, recorded when CONFIG_LIB_SEL4_TWINKLE_TRACE is
+ * set. 'args' are the call's arguments in order (for retypes: the untyped
+ * item, type, size and number of items), 'result' is the cap or first slot
+ * returned, or zero, and 'syscalls' is the number of kernel invocations the
+ * call made. 'seq' counts entries from one, and is zero while the entry is
+ * being written.
+ */
+struct allocator_trace_entry {
+    unsigned long op;
+    seL4_Word args[4];
+    seL4_Word result;
+    unsigned long syscalls;
+    unsigned long seq;
+};
+
+/*
+ * Counters kept by an allocator when CONFIG_LIB_SEL4_TWINKLE_STATS is set.
+ */
+struct allocator_counters {
+    /* Allocations of each size served from a pool without splitting, and
+     * allocations that needed a split (or failed). */
+    unsigned long pool_hits[NUM_UNTYPED_SIZES];
+    unsigned long pool_misses[NUM_UNTYPED_SIZES];
+
+    /* Kernel invocations. */
+    unsigned long retypes;
+    unsigned long revokes;
+    unsigned long recycles;
+    unsigned long deletes;
+    unsigned long maps;
+
+    /* Untyped items split, and splits merged back together. */
+    unsigned long splits;
+    unsigned long merges;
+
+    /* Number of splits needed by the last allocation, and the most needed by
+     * any allocation. */
+    unsigned long last_split_depth;
+    unsigned long max_split_depth;
+
+    /* Most cap slots ever in use at once. */
+    unsigned long slots_high_water;
+};
+
+/*
+ * A snapshot of an allocator's state, as returned by allocator_get_stats().
+ */
+struct allocator_stats {
+    /* Free untyped items of each size, not counting ones that would have to
+     * be split first. */
+    unsigned long free_items[NUM_UNTYPED_SIZES];
+
+    /* Untyped memory managed by the allocator, and how much of it is free. */
+    seL4_Word bytes_total;
+    seL4_Word bytes_free;
+
+    /* Cap slots managed by the allocator, and how many are in use. */
+    unsigned long slots_total;
+    unsigned long slots_used;
+
+    /* All zero unless CONFIG_LIB_SEL4_TWINKLE_STATS is set. */
+    struct allocator_counters counters;
+};
+
 /*
  * Allocator struct.
  *
@@ -53,35 +311,242 @@ struct allocator {
     /* Number of slots we have used. */
     unsigned long num_slots_used;
 
-    /* Initial memory items. */
+    /* Total number of slots we manage: those in 'cslots', followed by the
+     * slots of each CNode we have added to grow our CSpace. Our bitmaps have
+     * room for 'max_cslots'. */
+    unsigned long num_cslots;
+    unsigned long max_cslots;
+
+    /* Bitmap of free slots (a set bit is a free slot), and a summary with a
+     * bit set for each word of the bitmap with free slots. */
+    seL4_Word *cslot_free;
+    seL4_Word *cslot_free_summary;
+
+    /* Slots that were in use when an incremental reset began, which become
+     * free when it finishes. */
+    seL4_Word *cslot_stale;
+
+    /* Where we install new CNodes when we run short of slots: consecutive
+     * slots of the directory CNode 'cspace_dir', each taking a CNode of
+     * 2^cspace_cnode_bits slots. Growth is disabled if 'cspace_cnode_bits' is
+     * zero. */
+    seL4_CPtr cspace_dir;
+    unsigned long cspace_dir_depth;
+    struct cap_range cspace_dir_slots;
+    unsigned long cspace_cnode_bits;
+
+    /* The untyped items backing the CNodes we have added, the n-th of which
+     * lives in directory slot 'cspace_dir_slots.first + n'. */
+    int num_cspace_extensions;
+    seL4_CPtr cspace_extensions[MAX_CSPACE_EXTENSIONS];
+
+    /* Set while we are creating a new CNode. */
+    int cspace_growing;
+
+    /* Initial memory items, in storage for 'max_init_untyped_items'. */
     unsigned long num_init_untyped_items;
+    unsigned long max_init_untyped_items;
+    struct init_untyped_item *init_untyped_items;
+
+    /* For each size, the first free initial item. */
+    int init_untyped_free[NUM_UNTYPED_SIZES];
+
+    /* Records of untyped memory items we have split, and the first unused
+     * record. */
+    int max_splits;
+    struct untyped_split *splits;
+    int free_split;
+
+    /* For each chain of the index of splits by the caps of their children
+     * (see SPLIT_HASH()), the first split on it. */
+    int split_hash[SPLIT_HASH_BUCKETS];
+
+    /* For each size, the first split that has free children. */
+    int untyped_pools[NUM_UNTYPED_SIZES];
+
+    /* For each size, the first split in a small region that has free
+     * children. */
+    int small_pools[NUM_UNTYPED_SIZES];
+
+    /* Bitmap of sizes we have free items of, either in a pool or as an
+     * initial item, and of sizes we have free items of in small regions; bit
+     * 0 is MIN_UNTYPED_SIZE. */
+    unsigned long untyped_sizes_available;
+    unsigned long small_sizes_available;
+
+    /* How we choose which memory to allocate from. */
+    struct allocator_placement placement;
+
+    /* For each size, the number of free items allocator_maintain() keeps in
+     * our pools. */
+    unsigned long pool_targets[NUM_UNTYPED_SIZES];
+
+#ifdef CONFIG_LIB_SEL4_TWINKLE_CACHE_COLOURING
+    /* Bitmap of the cache colours coloured allocations may use. */
+    unsigned long colours;
+#endif
+
+    /* For lazy child allocators, the allocator we borrow memory from when we
+     * run out, in chunks of at least 'borrow_chunk_bits' bits. We borrow no
+     * more than 'borrow_quota' bytes in total, unless it is zero. */
+    struct allocator *parent;
+    unsigned long borrow_chunk_bits;
+    seL4_Word borrow_quota;
+    seL4_Word borrowed;
+
+    /* Allocations made since the oldest outstanding mark, and where in the
+     * journal each mark starts. */
+    struct journal_entry *journal;
+    int journal_len;
+    int max_journal_entries;
+    int marks[MAX_ALLOCATOR_MARKS];
+    int num_marks;
+
+    /* While an incremental reset is under way (see allocator_reset_begin()),
+     * the next initial item to look at and the number of items still to be
+     * recycled. 'reset_next' is -1 otherwise. */
+    int reset_next;
+    int reset_pending;
+
+#ifdef CONFIG_LIB_SEL4_TWINKLE_STATS
+    struct allocator_counters counters;
+#endif
+
+#ifdef CONFIG_LIB_SEL4_TWINKLE_TRACE
+    /* The most recent calls made, the number of entries ever written, and
+     * the kernel invocations made so far. We only record the outermost call
+     * when calls nest; 'trace_depth' is how deep we are, and
+     * 'trace_start' the number of invocations made when it was entered. */
+    struct allocator_trace_entry trace[CONFIG_LIB_SEL4_TWINKLE_TRACE_ENTRIES];
+    unsigned long trace_head;
+    unsigned long trace_syscalls;
+    unsigned long trace_start;
+    int trace_depth;
+#endif
+
+#ifdef CONFIG_KERNEL_STABLE
+    /* Size of the arenas kernel objects are carved out of, or zero if bump
+     * allocation is disabled. */
+    unsigned long bump_arena_bits;
+#endif
+
+    /* The arena we are currently carving kernel objects out of, either
+     * because bump allocation is enabled or because we ran out of split
+     * records. */
     struct {
         seL4_CPtr cap;
         unsigned long size_bits;
-        unsigned long is_free;
-    } init_untyped_items[MAX_UNTYPED_ITEMS];
+        seL4_Word watermark;
+    } bump_arena;
+};
+
+/*
+ * Storage for an allocator's records, supplied by whoever creates it (see
+ * allocator_create_with_storage()). It must stay valid until the allocator
+ * is destroyed.
+ */
+struct allocator_storage {
+    /* Room for 'max_items' initial untyped items. */
+    struct init_untyped_item *items;
+    unsigned long max_items;
+
+    /* Room for 'max_splits' splits of untyped items. */
+    struct untyped_split *splits;
+    int max_splits;
 
-    /* Untyped memory items we have created. */
-    struct cap_range untyped_items[(MAX_UNTYPED_SIZE - MIN_UNTYPED_SIZE) + 1];
+    /* Room for the bitmaps of up to 'max_cslots' cap slots, which is
+     * CSLOT_STORAGE_WORDS(max_cslots) words. This must cover the range of
+     * slots we are given, and any CNodes we may add to it. */
+    seL4_Word *cslot_words;
+    unsigned long max_cslots;
+
+    /* Room for 'max_journal_entries' allocations made while a mark is
+     * outstanding. */
+    struct journal_entry *journal;
+    int max_journal_entries;
 };
 
-void
-allocator_create(struct allocator *allocator,
+/*
+ * An allocator together with storage for DEFAULT_UNTYPED_ITEMS initial items,
+ * DEFAULT_UNTYPED_SPLITS splits, MAX_CSLOTS cap slots and MAX_JOURNAL_ENTRIES
+ * journal entries, for
+ * allocator_create() and friends. Allocators given storage of their own need
+ * only a struct allocator.
+ */
+struct default_allocator {
+    struct allocator allocator;
+    struct init_untyped_item items[DEFAULT_UNTYPED_ITEMS];
+    struct untyped_split splits[DEFAULT_UNTYPED_SPLITS];
+    seL4_Word cslot_words[CSLOT_STORAGE_WORDS(MAX_CSLOTS)];
+    struct journal_entry journal[MAX_JOURNAL_ENTRIES];
+};
+
+int
+allocator_create(struct default_allocator *allocator,
                  seL4_CPtr root_cnode, unsigned long root_cnode_depth,
                  unsigned long root_cnode_offset,
                  unsigned long first_slot, unsigned long num_slots,
                  struct untyped_item *items, int num_items);
 
-void
-allocator_create_child(struct allocator *parent, struct allocator *child,
+int
+allocator_create_with_storage(struct allocator *allocator,
+                              seL4_CPtr root_cnode, unsigned long root_cnode_depth,
+                              unsigned long root_cnode_offset,
+                              unsigned long first_slot, unsigned long num_slots,
+                              struct untyped_item *items, int num_items,
+                              const struct allocator_storage *storage);
+
+int
+allocator_create_child(struct allocator *parent,
+                       struct default_allocator *child,
                        seL4_CPtr root_cnode, unsigned long root_cnode_depth,
                        unsigned long root_cnode_offset,
                        unsigned long first_slot, unsigned long num_slots);
 
+int
+allocator_create_child_with_storage(struct allocator *parent,
+                                    struct allocator *child,
+                                    seL4_CPtr root_cnode,
+                                    unsigned long root_cnode_depth,
+                                    unsigned long root_cnode_offset,
+                                    unsigned long first_slot,
+                                    unsigned long num_slots,
+                                    const struct allocator_storage *storage);
+
+int
+allocator_create_lazy_child(struct allocator *parent,
+                            struct default_allocator *child,
+                            seL4_CPtr root_cnode, unsigned long root_cnode_depth,
+                            unsigned long root_cnode_offset,
+                            unsigned long first_slot, unsigned long num_slots,
+                            unsigned long chunk_bits, seL4_Word quota);
+
+int
+allocator_create_lazy_child_with_storage(struct allocator *parent,
+                                         struct allocator *child,
+                                         seL4_CPtr root_cnode,
+                                         unsigned long root_cnode_depth,
+                                         unsigned long root_cnode_offset,
+                                         unsigned long first_slot,
+                                         unsigned long num_slots,
+                                         unsigned long chunk_bits,
+                                         seL4_Word quota,
+                                         const struct allocator_storage *storage);
+
+int
+allocator_set_storage(struct allocator *allocator,
+                      struct init_untyped_item *items, unsigned long max_items,
+                      struct untyped_split *splits, int max_splits);
+
 void
 allocator_add_root_untyped_item(struct allocator *allocator,
                                 seL4_CPtr item, unsigned long size_bits);
 
+void
+allocator_add_root_untyped_item_paddr(struct allocator *allocator,
+                                      seL4_CPtr item, unsigned long size_bits,
+                                      seL4_Word paddr);
+
 seL4_CPtr
 allocator_alloc_cslot(struct allocator *allocator);
 
@@ -91,21 +556,118 @@ allocator_free_cslot(struct allocator *allocator, seL4_CPtr slot);
 seL4_CPtr
 allocator_alloc_cslots(struct allocator *allocator, int num_slots);
 
+void
+allocator_free_cslots(struct allocator *allocator, seL4_CPtr slot,
+                      int num_slots);
+
+void
+allocator_cslot_path(struct allocator *allocator, seL4_CPtr slot,
+                     struct cslot_path *path);
+
+void
+allocator_enable_cspace_growth(struct allocator *allocator,
+                               seL4_CPtr dir_cnode, unsigned long dir_depth,
+                               unsigned long first_dir_slot,
+                               unsigned long num_dir_slots,
+                               unsigned long cnode_bits);
+
+void
+allocator_set_placement(struct allocator *allocator,
+                        struct allocator_placement *placement);
+
 seL4_CPtr
 allocator_alloc_untyped(struct allocator *allocator, unsigned long size_bits);
 
+seL4_CPtr
+allocator_alloc_untyped_at(struct allocator *allocator, seL4_Word paddr,
+                           unsigned long size_bits);
+
+void
+allocator_free_untyped(struct allocator *allocator, seL4_CPtr cap,
+                       unsigned long size_bits);
+
+seL4_Word
+allocator_untyped_paddr(struct allocator *allocator, seL4_CPtr cap);
+
 int
 allocator_retype_untyped_memory(struct allocator *allocator,
                                 seL4_CPtr untyped_item, seL4_Word item_type, seL4_Word item_size,
                                 int num_items, struct cap_range *result);
 
+#ifdef CONFIG_KERNEL_STABLE
+void
+allocator_enable_bump_allocation(struct allocator *allocator,
+                                 unsigned long arena_bits);
+#endif
+
+int
+allocator_mark(struct allocator *allocator);
+
+void
+allocator_release(struct allocator *allocator, int mark);
+
 void
 allocator_reset(struct allocator *allocator);
 
+void
+allocator_reset_begin(struct allocator *allocator);
+
+int
+allocator_reset_continue(struct allocator *allocator, int budget);
+
+void
+allocator_reset_warm(struct allocator *allocator);
+
+void
+allocator_set_pool_targets(struct allocator *allocator,
+                           const struct untyped_profile *targets,
+                           int num_sizes);
+
+unsigned long
+allocator_maintain(struct allocator *allocator, int budget);
+
+#ifdef CONFIG_LIB_SEL4_TWINKLE_CACHE_COLOURING
+void
+allocator_set_colours(struct allocator *allocator, unsigned long colours);
+
+seL4_CPtr
+allocator_alloc_coloured_untyped(struct allocator *allocator,
+                                 unsigned long size_bits);
+#endif
+
+int
+allocator_presplit(struct allocator *allocator,
+                   const struct untyped_profile *profile, int num_sizes);
+
+long
+allocator_serialize(struct allocator *allocator, void *buffer,
+                    unsigned long size);
+
+int
+allocator_restore(struct allocator *allocator, const void *buffer,
+                  unsigned long size);
+
 void
 allocator_destroy(struct allocator *allocator);
 
 void
 allocator_self_test(struct allocator *allocator);
 
+void
+allocator_get_stats(struct allocator *allocator, struct allocator_stats *stats);
+
+void
+allocator_print_stats(struct allocator *allocator);
+
+#ifdef CONFIG_LIB_SEL4_TWINKLE_TRACE
+int
+allocator_trace_read(struct allocator *allocator,
+                     struct allocator_trace_entry *entries, int max_entries);
+
+int
+allocator_trace_replay(struct allocator *allocator,
+                       const struct allocator_trace_entry *entries,
+                       int num_entries, struct allocator_trace_entry *results);
+#endif
+
 #endif /* ALLOCATOR_H */
@@ -19,5 +19,12 @@
 struct allocator *
 create_first_stage_allocator(void);
 
+struct allocator *
+create_first_stage_allocator_presplit(const struct untyped_profile *profile,
+                                      int num_sizes);
+
+struct allocator *
+create_first_stage_allocator_restore(const void *buffer, unsigned long size);
+
 #endif /* BOOTSTRAP_H */
 
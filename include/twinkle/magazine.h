@@ -0,0 +1,91 @@
+/*
+ * Copyright 2014, NICTA
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(NICTA_BSD)
+ */
+
+#ifndef MAGAZINE_H
+#define MAGAZINE_H
+
+#include <sel4/sel4.h>
+
+#include "allocator.h"
+
+/* Largest untyped items a magazine caches; bigger ones come straight from
+ * the shared allocator. */
+#define MAGAZINE_MAX_UNTYPED_SIZE 16
+
+/* Number of items of each kind a magazine holds. */
+#define MAGAZINE_SIZE 16
+
+/* Lock protecting an allocator shared between threads. */
+struct allocator_lock {
+    /* Only ever set with __atomic_test_and_set(), which works on a byte. */
+    unsigned char held;
+};
+
+/*
+ * A per-thread (or per-core) cache of untyped items and free cap slots in
+ * front of a shared allocator.
+ *
+ * A magazine may only be used by one thread at a time, so the common case of
+ * allocating from (or freeing to) the magazine takes no locks and uses no
+ * atomic operations. The shared allocator is only locked to refill the
+ * magazine, or drain it when it is full.
+ *
+ * Resetting the shared allocator destroys whatever its magazines hold, so
+ * every magazine must be drained with magazine_drain() first. The same goes
+ * for allocator_mark() and allocator_release(): items a magazine took from
+ * inside a scope are freed when the scope is released, and items freed into
+ * a magazine are never struck off the journal, so every magazine must be
+ * drained before a mark is made and before it is released.
+ */
+struct allocator_magazine {
+    /* The shared allocator, and the lock protecting it. */
+    struct allocator *allocator;
+    struct allocator_lock *lock;
+
+    /* Cached untyped items of each size. */
+    int num_untyped[MAGAZINE_MAX_UNTYPED_SIZE - MIN_UNTYPED_SIZE + 1];
+    seL4_CPtr untyped[MAGAZINE_MAX_UNTYPED_SIZE - MIN_UNTYPED_SIZE + 1][MAGAZINE_SIZE];
+
+    /* Cached free cap slots. */
+    int num_cslots;
+    seL4_CPtr cslots[MAGAZINE_SIZE];
+};
+
+void
+allocator_lock_init(struct allocator_lock *lock);
+
+void
+allocator_lock_acquire(struct allocator_lock *lock);
+
+void
+allocator_lock_release(struct allocator_lock *lock);
+
+void
+magazine_init(struct allocator_magazine *magazine,
+              struct allocator *allocator, struct allocator_lock *lock);
+
+seL4_CPtr
+magazine_alloc_untyped(struct allocator_magazine *magazine,
+                       unsigned long size_bits);
+
+void
+magazine_free_untyped(struct allocator_magazine *magazine, seL4_CPtr cap,
+                      unsigned long size_bits);
+
+seL4_CPtr
+magazine_alloc_cslot(struct allocator_magazine *magazine);
+
+void
+magazine_free_cslot(struct allocator_magazine *magazine, seL4_CPtr slot);
+
+void
+magazine_drain(struct allocator_magazine *magazine);
+
+#endif /* MAGAZINE_H */
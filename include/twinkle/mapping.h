@@ -0,0 +1,26 @@
+/*
+ * Copyright 2014, NICTA
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(NICTA_BSD)
+ */
+
+#ifndef MAPPING_H
+#define MAPPING_H
+
+#include <autoconf.h>
+#include <sel4/sel4.h>
+
+#include "allocator.h"
+
+#if defined(CONFIG_ARCH_ARM) || defined(CONFIG_ARCH_IA32)
+int
+allocator_alloc_mapped_region(struct allocator *allocator, seL4_CPtr vspace,
+                              seL4_Word vaddr, seL4_Word bytes,
+                              seL4_CapRights rights);
+#endif
+
+#endif /* MAPPING_H */
@@ -15,9 +15,38 @@
 
 #include "allocator.h"
 
+int
+allocator_retype_kobject_at(struct allocator *allocator,
+                            seL4_Word item_type, seL4_Word item_size,
+                            seL4_CPtr dest, seL4_CPtr *untyped);
+
 seL4_CPtr
 allocator_alloc_kobject(struct allocator *allocator,
                         seL4_Word item_type, seL4_Word item_size);
 
+#ifdef CONFIG_LIB_SEL4_TWINKLE_CACHE_COLOURING
+seL4_CPtr
+allocator_alloc_coloured_kobject(struct allocator *allocator,
+                                 seL4_Word item_type, seL4_Word item_size);
+#endif
+
+int
+allocator_alloc_kobjects(struct allocator *allocator,
+                         seL4_Word item_type, seL4_Word item_size,
+                         int num_items, struct cap_range *result);
+
+#ifdef CONFIG_LIB_SEL4_TWINKLE_CACHE_COLOURING
+int
+allocator_alloc_coloured_kobjects(struct allocator *allocator,
+                                  seL4_Word item_type, seL4_Word item_size,
+                                  int num_items, struct cap_range *result);
+#endif
+
+int
+allocator_alloc_contiguous_kobjects(struct allocator *allocator,
+                                    seL4_Word item_type, seL4_Word item_size,
+                                    int num_items, unsigned long align_bits,
+                                    struct cap_range *result, seL4_CPtr *untyped);
+
 #endif /* OBJECT_ALLOCATOR_H */
 
@@ -0,0 +1,73 @@
+/*
+ * Copyright 2014, NICTA
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(NICTA_BSD)
+ */
+
+#ifndef OBJECT_CACHE_H
+#define OBJECT_CACHE_H
+
+#include <sel4/sel4.h>
+
+#include "allocator.h"
+
+/* Maximum number of objects an object cache holds. */
+#define OBJECT_CACHE_SIZE 32
+
+/*
+ * A cache of ready-made kernel objects of a single type.
+ */
+struct object_cache {
+    /* Allocator we create objects with. */
+    struct allocator *allocator;
+
+    /* Type of object we hold. */
+    seL4_Word item_type;
+    seL4_Word item_size;
+
+    /* When we have fewer than 'low_watermark' objects, we need to be
+     * refilled; a refill creates 'batch' objects at once. */
+    int low_watermark;
+    int batch;
+
+    /* Objects ready to be handed out. */
+    int num_objects;
+    seL4_CPtr objects[OBJECT_CACHE_SIZE];
+};
+
+/*
+ * An entry in a profile of object caches to set up at startup.
+ */
+struct object_cache_profile {
+    seL4_Word item_type;
+    seL4_Word item_size;
+    int low_watermark;
+    int batch;
+};
+
+void
+object_cache_init(struct object_cache *cache, struct allocator *allocator,
+                  seL4_Word item_type, seL4_Word item_size,
+                  int low_watermark, int batch);
+
+int
+object_cache_prewarm(struct object_cache *caches, struct allocator *allocator,
+                     const struct object_cache_profile *profile, int num_caches);
+
+int
+object_cache_needs_refill(struct object_cache *cache);
+
+int
+object_cache_refill(struct object_cache *cache);
+
+seL4_CPtr
+object_cache_alloc(struct object_cache *cache);
+
+void
+object_cache_free(struct object_cache *cache, seL4_CPtr object);
+
+#endif /* OBJECT_CACHE_H */
@@ -11,17 +11,23 @@
 /*
  * Simple kernel resource object manager.
  *
- * This implements an allocator that is capable of two types of operations:
+ * This implements an allocator that is capable of three types of operations:
  *
  *     (i) Allocate a new kernel object of a given type;
  *
- *     (ii) Reset the allocator, destroying all items previously created.
+ *     (ii) Free an untyped item previously allocated, destroying any kernel
+ *          objects created from it;
  *
- * In particular, there is no method to free() individual kernel objects.
+ *     (iii) Reset the allocator, destroying all items previously created.
+ *
+ * Untyped items are obtained by splitting bigger items. Every split is
+ * recorded, and once all the children of a split have been freed again they
+ * are merged back into their parent.
  *
  * An new allocator is created by providing a CNode to perform allocations
  * into, a single contiguous range of free cap slots in that CNode, and an
- * array of untyped memory items to use.
+ * array of untyped memory items to use. If allowed to, the allocator adds
+ * further CNodes made from its own memory when it runs short of slots.
  */
 
 #ifndef UNUSED_NDEBUG
@@ -33,13 +39,51 @@
 #endif
 
 #include <stdio.h>
+#include <string.h>
 #include <assert.h>
 
 #include <sel4/sel4.h>
 
 #include <twinkle/allocator.h>
 
-static seL4_CPtr range_alloc(struct cap_range *range, int count);
+#include "journal.h"
+#include "kernel.h"
+#include "stats.h"
+#include "trace.h"
+
+static void cslot_reset(struct allocator *allocator);
+static void reclaim_untyped(struct allocator *allocator, int revoke);
+static void cslot_free_run(struct allocator *allocator, unsigned long first,
+                           unsigned long count);
+static void reset_splits(struct allocator *allocator);
+static int reclaim_split_slots(struct allocator *allocator);
+static void init_item_push(struct allocator *allocator, int i);
+
+/*
+ * Where an untyped item came from: child 'index' of split 'split', or if
+ * 'split' is -1, initial memory item 'index'.
+ */
+struct untyped_origin {
+    int split;
+    unsigned long index;
+};
+
+/*
+ * Describe the storage built into 'allocator' in 'storage'.
+ */
+static void
+default_storage(struct default_allocator *allocator,
+                struct allocator_storage *storage)
+{
+    storage->items = allocator->items;
+    storage->max_items = DEFAULT_UNTYPED_ITEMS;
+    storage->splits = allocator->splits;
+    storage->max_splits = DEFAULT_UNTYPED_SPLITS;
+    storage->cslot_words = allocator->cslot_words;
+    storage->max_cslots = MAX_CSLOTS;
+    storage->journal = allocator->journal;
+    storage->max_journal_entries = MAX_JOURNAL_ENTRIES;
+}
 
 /*
  * Initialise an allocator object at 'allocator'.
@@ -53,39 +97,118 @@ static seL4_CPtr range_alloc(struct cap_range *range, int count);
  * our allocations.
  *
  * 'items' and 'num_items' specify untyped memory items that we will allocate
- * from.
+ * from. We can keep track of up to DEFAULT_UNTYPED_ITEMS items, and
+ * DEFAULT_UNTYPED_SPLITS splits of them; items beyond that are ignored.
+ * Allocators that need more, or less, should be created with
+ * allocator_create_with_storage().
+ *
+ * Returns 0 on success, or -1 if there are more than MAX_CSLOTS slots.
  */
-void
-allocator_create(struct allocator *allocator,
+int
+allocator_create(struct default_allocator *allocator,
                  seL4_CPtr root_cnode, unsigned long root_cnode_depth,
                  unsigned long root_cnode_offset,
                  unsigned long first_slot, unsigned long num_slots,
                  struct untyped_item *items, int num_items)
 {
+    struct allocator_storage storage;
+
+    default_storage(allocator, &storage);
+    return allocator_create_with_storage(&allocator->allocator, root_cnode,
+                                         root_cnode_depth, root_cnode_offset,
+                                         first_slot, num_slots, items,
+                                         num_items, &storage);
+}
+
+/*
+ * As allocator_create(), but keep track of initial items, splits and cap
+ * slots, and journal allocations, in the arrays given by 'storage', however
+ * big they are.
+ *
+ * Returns 0 on success, or -1 if there are more slots than 'storage' has
+ * room for.
+ */
+int
+allocator_create_with_storage(struct allocator *allocator,
+                              seL4_CPtr root_cnode, unsigned long root_cnode_depth,
+                              unsigned long root_cnode_offset,
+                              unsigned long first_slot, unsigned long num_slots,
+                              struct untyped_item *items, int num_items,
+                              const struct allocator_storage *storage)
+{
+    unsigned long bitmap_words;
     int i;
 
-    /* Check parameters. */
-    assert(num_items < MAX_UNTYPED_ITEMS);
+    assert(storage->items && storage->splits && storage->cslot_words
+           && storage->journal);
+    assert(storage->max_splits > 0);
+
+    /* We must be able to keep track of every slot we are given. */
+    if (num_slots > storage->max_cslots) {
+        return -1;
+    }
 
     /* Setup CNode information. */
+    bitmap_words = CSLOT_BITMAP_WORDS(storage->max_cslots);
     allocator->root_cnode = root_cnode;
     allocator->root_cnode_depth = root_cnode_depth;
     allocator->root_cnode_offset = root_cnode_offset;
     allocator->cslots.first = first_slot;
     allocator->cslots.count = num_slots;
-    allocator->num_slots_used = 0;
+    allocator->num_cslots = num_slots;
+    allocator->max_cslots = storage->max_cslots;
+    allocator->cslot_free = storage->cslot_words;
+    allocator->cslot_free_summary = storage->cslot_words + bitmap_words;
+    allocator->cslot_stale = allocator->cslot_free_summary
+                             + CSLOT_SUMMARY_WORDS(storage->max_cslots);
+    allocator->cspace_cnode_bits = 0;
+    allocator->num_cspace_extensions = 0;
+    allocator->cspace_growing = 0;
+    allocator->journal = storage->journal;
+    allocator->max_journal_entries = storage->max_journal_entries;
+    journal_clear(allocator);
+    cslot_reset(allocator);
+    memset(allocator->cslot_stale, 0, bitmap_words * sizeof(seL4_Word));
+    allocator->reset_next = -1;
+    allocator->reset_pending = 0;
     allocator->num_init_untyped_items = 0;
+    allocator->max_init_untyped_items = storage->max_items;
+    allocator->init_untyped_items = storage->items;
+    allocator->max_splits = storage->max_splits;
+    allocator->splits = storage->splits;
+    allocator->untyped_sizes_available = 0;
+    allocator->small_sizes_available = 0;
+    memset(&allocator->placement, 0, sizeof(allocator->placement));
+    memset(allocator->pool_targets, 0, sizeof(allocator->pool_targets));
+#ifdef CONFIG_LIB_SEL4_TWINKLE_CACHE_COLOURING
+    allocator->colours = ALL_CACHE_COLOURS;
+#endif
+    allocator->parent = NULL;
+    allocator->borrow_chunk_bits = 0;
+    allocator->borrow_quota = 0;
+    allocator->borrowed = 0;
+#ifdef CONFIG_LIB_SEL4_TWINKLE_STATS
+    memset(&allocator->counters, 0, sizeof(allocator->counters));
+#endif
+    TRACE_CLEAR(allocator);
+    for (i = 0; i < NUM_UNTYPED_SIZES; i++) {
+        allocator->init_untyped_free[i] = -1;
+    }
+#ifdef CONFIG_KERNEL_STABLE
+    allocator->bump_arena_bits = 0;
+#endif
+    allocator->bump_arena.cap = 0;
 
     /* Setup all of our pools as empty. */
-    for (i = MIN_UNTYPED_SIZE; i <= MAX_UNTYPED_SIZE; i++) {
-        allocator->untyped_items[i - MIN_UNTYPED_SIZE].first = 0;
-        allocator->untyped_items[i - MIN_UNTYPED_SIZE].count = 0;
-    }
+    reset_splits(allocator);
 
-    /* Copy untyped items. */
-    for (i = 0; i < num_items; i++)
+    /* Copy untyped items, as many as we can keep track of. */
+    for (i = 0; i < num_items
+            && i < allocator->max_init_untyped_items; i++)
         allocator_add_root_untyped_item(allocator,
                                         items[i].cap, items[i].size_bits);
+
+    return 0;
 }
 
 /*
@@ -96,29 +219,243 @@ allocator_create(struct allocator *allocator,
  * will be revoked, but resources created by our parent will remain. If our
  * parent is destroyed or reset, all resources created by the child allocator
  * will also be revoked.
+ *
+ * The child takes as many items as DEFAULT_UNTYPED_ITEMS; use
+ * allocator_create_child_with_storage() to take more.
+ *
+ * Returns 0 on success, or -1 if there are more than MAX_CSLOTS slots.
  */
-void
-allocator_create_child(struct allocator *parent, struct allocator *child,
+int
+allocator_create_child(struct allocator *parent,
+                       struct default_allocator *child,
                        seL4_CPtr root_cnode, unsigned long root_cnode_depth,
                        unsigned long root_cnode_offset,
                        unsigned long first_slot, unsigned long num_slots)
+{
+    struct allocator_storage storage;
+
+    default_storage(child, &storage);
+    return allocator_create_child_with_storage(parent, &child->allocator,
+                                               root_cnode, root_cnode_depth,
+                                               root_cnode_offset, first_slot,
+                                               num_slots, &storage);
+}
+
+/*
+ * As allocator_create_child(), with storage for the child as for
+ * allocator_create_with_storage().
+ */
+int
+allocator_create_child_with_storage(struct allocator *parent,
+                                    struct allocator *child,
+                                    seL4_CPtr root_cnode,
+                                    unsigned long root_cnode_depth,
+                                    unsigned long root_cnode_offset,
+                                    unsigned long first_slot,
+                                    unsigned long num_slots,
+                                    const struct allocator_storage *storage)
 {
     int i;
 
     /* Setup allocator. */
-    allocator_create(child, root_cnode, root_cnode_depth,
-                     root_cnode_offset, first_slot, num_slots, NULL, 0);
+    if (allocator_create_with_storage(child, root_cnode, root_cnode_depth,
+                                      root_cnode_offset, first_slot,
+                                      num_slots, NULL, 0, storage)) {
+        return -1;
+    }
 
-    /* Steal resources from our parent. */
+    /* Steal resources from our parent, as much as we can keep track of. */
     for (i = MAX_UNTYPED_SIZE; i >= MIN_UNTYPED_SIZE; i--) {
-        while (1) {
+        while (child->num_init_untyped_items
+                < child->max_init_untyped_items) {
             seL4_CPtr r = allocator_alloc_untyped(parent, i);
             if (!r) {
                 break;
             }
-            allocator_add_root_untyped_item(child, r, i);
+            allocator_add_root_untyped_item_paddr(child, r, i,
+                                                  allocator_untyped_paddr(parent, r));
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Create a new allocator that borrows memory from an existing allocator as it
+ * needs it, rather than stealing everything up front.
+ *
+ * Whenever the child runs out of memory, it borrows a chunk of at least
+ * 'chunk_bits' bits from its parent, up to a total of 'quota' bytes (or
+ * without limit if 'quota' is zero). Borrowed memory is returned to the
+ * parent when the child is destroyed.
+ *
+ * As with allocator_create_child(), resetting or destroying the parent
+ * revokes everything created by the child.
+ *
+ * Returns 0 on success, or -1 if there are more than MAX_CSLOTS slots.
+ */
+int
+allocator_create_lazy_child(struct allocator *parent,
+                            struct default_allocator *child,
+                            seL4_CPtr root_cnode, unsigned long root_cnode_depth,
+                            unsigned long root_cnode_offset,
+                            unsigned long first_slot, unsigned long num_slots,
+                            unsigned long chunk_bits, seL4_Word quota)
+{
+    struct allocator_storage storage;
+
+    default_storage(child, &storage);
+    return allocator_create_lazy_child_with_storage(parent, &child->allocator,
+                                                    root_cnode,
+                                                    root_cnode_depth,
+                                                    root_cnode_offset,
+                                                    first_slot, num_slots,
+                                                    chunk_bits, quota,
+                                                    &storage);
+}
+
+/*
+ * As allocator_create_lazy_child(), with storage for the child as for
+ * allocator_create_with_storage(). A child that borrows big chunks needs
+ * room for few items.
+ */
+int
+allocator_create_lazy_child_with_storage(struct allocator *parent,
+                                         struct allocator *child,
+                                         seL4_CPtr root_cnode,
+                                         unsigned long root_cnode_depth,
+                                         unsigned long root_cnode_offset,
+                                         unsigned long first_slot,
+                                         unsigned long num_slots,
+                                         unsigned long chunk_bits,
+                                         seL4_Word quota,
+                                         const struct allocator_storage *storage)
+{
+    assert(chunk_bits >= MIN_UNTYPED_SIZE);
+    assert(chunk_bits <= MAX_UNTYPED_SIZE);
+
+    if (allocator_create_with_storage(child, root_cnode, root_cnode_depth,
+                                      root_cnode_offset, first_slot,
+                                      num_slots, NULL, 0, storage)) {
+        return -1;
+    }
+
+    child->parent = parent;
+    child->borrow_chunk_bits = chunk_bits;
+    child->borrow_quota = quota;
+    return 0;
+}
+
+/*
+ * Keep track of initial items in 'items', which has room for 'max_items' of
+ * them, and of splits in 'splits', which has room for 'max_splits', instead
+ * of the storage we were created with. Either may be NULL to keep what we
+ * have.
+ *
+ * This may be called at any time; anything we are already keeping track of
+ * is moved across. The storage must remain valid until the allocator is
+ * destroyed.
+ *
+ * Returns 0 on success, or -1 if the new storage is too small to hold what
+ * we are keeping track of.
+ */
+int
+allocator_set_storage(struct allocator *allocator,
+                      struct init_untyped_item *items, unsigned long max_items,
+                      struct untyped_split *splits, int max_splits)
+{
+    int n;
+    int i;
+
+    if (items && max_items < allocator->num_init_untyped_items) {
+        return -1;
+    }
+
+    /* Splits refer to each other by index, so every record in use must
+     * stay where it is. */
+    if (splits) {
+        if (max_splits < 1) {
+            return -1;
+        }
+        for (i = max_splits; i < allocator->max_splits; i++) {
+            if (allocator->splits[i].parent) {
+                return -1;
+            }
+        }
+    }
+
+    if (items) {
+        memmove(items, allocator->init_untyped_items,
+                allocator->num_init_untyped_items * sizeof(*items));
+        allocator->init_untyped_items = items;
+        allocator->max_init_untyped_items = max_items;
+    }
+
+    if (splits) {
+        n = allocator->max_splits < max_splits
+            ? allocator->max_splits : max_splits;
+        memmove(splits, allocator->splits, n * sizeof(*splits));
+        allocator->splits = splits;
+        allocator->max_splits = max_splits;
+
+        /* Rebuild the list of unused records. */
+        allocator->free_split = -1;
+        for (i = max_splits - 1; i >= 0; i--) {
+            if (i >= n || !splits[i].parent) {
+                splits[i].parent = 0;
+                splits[i].next = allocator->free_split;
+                allocator->free_split = i;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Borrow memory from our parent allocator for an allocation of 'size_bits'
+ * bits.
+ *
+ * Returns non-zero if we got some.
+ */
+static int
+borrow_from_parent(struct allocator *allocator, unsigned long size_bits)
+{
+    unsigned long chunk_bits;
+    seL4_CPtr chunk;
+    int n;
+
+    if (!allocator->parent
+            || allocator->num_init_untyped_items
+                >= allocator->max_init_untyped_items) {
+        return 0;
+    }
+
+    /* Prefer a whole chunk, but settle for just what we need. */
+    chunk_bits = allocator->borrow_chunk_bits;
+    if (chunk_bits < size_bits) {
+        chunk_bits = size_bits;
+    }
+    while (1) {
+        if (!allocator->borrow_quota
+                || allocator->borrowed + (1UL << chunk_bits) <= allocator->borrow_quota) {
+            chunk = allocator_alloc_untyped(allocator->parent, chunk_bits);
+            if (chunk) {
+                break;
+            }
+        }
+        if (chunk_bits == size_bits) {
+            return 0;
         }
+        chunk_bits = size_bits;
     }
+
+    n = allocator->num_init_untyped_items;
+    allocator_add_root_untyped_item_paddr(allocator, chunk, chunk_bits,
+                                          allocator_untyped_paddr(allocator->parent, chunk));
+    allocator->init_untyped_items[n].is_borrowed = 1;
+    allocator->borrowed += 1UL << chunk_bits;
+    return 1;
 }
 
 /*
@@ -130,266 +467,2084 @@ allocator_create_child(struct allocator *parent, struct allocator *child,
 void
 allocator_add_root_untyped_item(struct allocator *allocator,
                                 seL4_CPtr cap, unsigned long size_bits)
+{
+    allocator_add_root_untyped_item_paddr(allocator, cap, size_bits,
+                                          UNKNOWN_PADDR);
+}
+
+/*
+ * Permanently add additional untyped memory, starting at physical address
+ * 'paddr', to the allocator.
+ */
+void
+allocator_add_root_untyped_item_paddr(struct allocator *allocator,
+                                      seL4_CPtr cap, unsigned long size_bits,
+                                      seL4_Word paddr)
 {
     int n;
 
     assert(cap != 0);
     assert(size_bits >= MIN_UNTYPED_SIZE);
     assert(size_bits <= MAX_UNTYPED_SIZE);
-    assert(allocator->num_init_untyped_items < MAX_UNTYPED_ITEMS);
+    assert(allocator->num_init_untyped_items
+           < allocator->max_init_untyped_items);
 
     n = allocator->num_init_untyped_items;
     allocator->init_untyped_items[n].cap = cap;
     allocator->init_untyped_items[n].size_bits = size_bits;
-    allocator->init_untyped_items[n].is_free = 1;
+    allocator->init_untyped_items[n].paddr = paddr;
+    allocator->init_untyped_items[n].is_split = 0;
+    allocator->init_untyped_items[n].is_borrowed = 0;
+    allocator->init_untyped_items[n].is_stale = 0;
     allocator->num_init_untyped_items++;
+    init_item_push(allocator, n);
 }
 
 /*
- * Allocate an empty cslot.
+ * Mark 'count' slots starting at index 'first' (relative to the start of our
+ * slot range) as free or used, keeping the summary bitmap up to date.
  */
-seL4_CPtr
-allocator_alloc_cslot(struct allocator *allocator)
+static void
+cslot_mark(struct allocator *allocator, unsigned long first,
+           unsigned long count, int is_free)
 {
-    seL4_CPtr result;
+    unsigned long end = first + count;
+    unsigned long word, bits;
+    seL4_Word mask;
 
-    /* Determine whether we have any free slots. */
-    if (!(allocator->cslots.count - allocator->num_slots_used)) {
-        return 0;
-    }
+    while (first < end) {
+        word = first / CSLOT_WORD_BITS;
+        bits = end - first;
+        if (bits > CSLOT_WORD_BITS - first % CSLOT_WORD_BITS) {
+            bits = CSLOT_WORD_BITS - first % CSLOT_WORD_BITS;
+        }
+        mask = (bits == CSLOT_WORD_BITS) ? ~(seL4_Word)0
+               : (((seL4_Word)1 << bits) - 1) << (first % CSLOT_WORD_BITS);
 
-    /* Pick the first one. */
-    result = allocator->cslots.first
-             + allocator->num_slots_used + allocator->root_cnode_offset;
+        if (is_free) {
+            assert(!(allocator->cslot_free[word] & mask));
+            allocator->cslot_free[word] |= mask;
+            allocator->cslot_stale[word] &= ~mask;
+            allocator->num_slots_used -= bits;
+        } else {
+            assert((allocator->cslot_free[word] & mask) == mask);
+            allocator->cslot_free[word] &= ~mask;
+            allocator->num_slots_used += bits;
+            STATS_MAX(allocator, slots_high_water, allocator->num_slots_used);
+        }
 
-    /* Record this slot as used. */
-    allocator->num_slots_used += 1;
+        if (allocator->cslot_free[word]) {
+            allocator->cslot_free_summary[word / CSLOT_WORD_BITS] |=
+                (seL4_Word)1 << (word % CSLOT_WORD_BITS);
+        } else {
+            allocator->cslot_free_summary[word / CSLOT_WORD_BITS] &=
+                ~((seL4_Word)1 << (word % CSLOT_WORD_BITS));
+        }
 
-    return result;
+        first += bits;
+    }
 }
 
 /*
- * Free an empty cslot.
- * We can only free a slot if it was the last to be allocated
+ * Find the first free slot at or after index 'from', or -1 if there is none.
  */
-void
-allocator_free_cslot(struct allocator *allocator, seL4_CPtr slot)
+static long
+cslot_find_free(struct allocator *allocator, unsigned long from)
 {
-    seL4_CPtr next_slot = allocator->cslots.first
-                          + allocator->num_slots_used
-                          + allocator->root_cnode_offset;
-    if (next_slot == slot + 1) {
-        allocator->num_slots_used--;
+    unsigned long word = from / CSLOT_WORD_BITS;
+    unsigned long summary;
+    seL4_Word bits;
+
+    if (word >= CSLOT_BITMAP_WORDS(allocator->max_cslots)) {
+        return -1;
+    }
+
+    /* Look in the rest of the word 'from' lives in. */
+    bits = allocator->cslot_free[word] & (~(seL4_Word)0 << (from % CSLOT_WORD_BITS));
+    if (bits) {
+        return word * CSLOT_WORD_BITS + __builtin_ctzl(bits);
+    }
+
+    /* Use the summary to find the next word with anything free. */
+    word++;
+    for (summary = word / CSLOT_WORD_BITS;
+            summary < CSLOT_SUMMARY_WORDS(allocator->max_cslots); summary++) {
+        bits = allocator->cslot_free_summary[summary];
+        if (summary == word / CSLOT_WORD_BITS && word % CSLOT_WORD_BITS) {
+            bits &= ~(seL4_Word)0 << (word % CSLOT_WORD_BITS);
+        }
+        if (bits) {
+            word = summary * CSLOT_WORD_BITS + __builtin_ctzl(bits);
+            return word * CSLOT_WORD_BITS + __builtin_ctzl(allocator->cslot_free[word]);
+        }
     }
+
+    return -1;
 }
 
+/*
+ * Return the index just past the end of the CNode that slot index 'index'
+ * lives in. Runs of slots handed out together never cross this boundary.
+ */
+static unsigned long
+cslot_window_end(struct allocator *allocator, unsigned long index)
+{
+    unsigned long bits = allocator->cspace_cnode_bits;
+
+    if (index < allocator->cslots.count) {
+        return allocator->cslots.count;
+    }
+    index -= allocator->cslots.count;
+    return allocator->cslots.count + (((index >> bits) + 1) << bits);
+}
 
 /*
- * Allocate empty cslots, those cslots are contiguous.
- *
- * Return the first cslot.
+ * Convert slot index 'index' into a cap pointer.
  */
-seL4_CPtr
-allocator_alloc_cslots(struct allocator *allocator, int num_slots)
+static seL4_CPtr
+cslot_cptr(struct allocator *allocator, unsigned long index)
 {
-    seL4_CPtr result;
+    unsigned long bits = allocator->cspace_cnode_bits;
 
-    /* Check if we have enough slots left. */
-    if ((allocator->cslots.count - allocator->num_slots_used) < num_slots) {
-        return 0;
+    if (index < allocator->cslots.count) {
+        return allocator->cslots.first + index + allocator->root_cnode_offset;
     }
+    index -= allocator->cslots.count;
+    return ((allocator->cspace_dir_slots.first + (index >> bits)) << bits)
+           | (index & ((1UL << bits) - 1));
+}
 
-    /* Pick the first one. */
-    result = allocator->cslots.first + allocator->num_slots_used + allocator->root_cnode_offset;
+/*
+ * Convert the cap pointer 'slot' into a slot index.
+ */
+static unsigned long
+cslot_index(struct allocator *allocator, seL4_CPtr slot)
+{
+    unsigned long bits = allocator->cspace_cnode_bits;
+    unsigned long n;
 
-    /* Record this slot as used. */
-    allocator->num_slots_used += num_slots;
+    if (slot >= allocator->cslots.first + allocator->root_cnode_offset
+            && slot < allocator->cslots.first + allocator->root_cnode_offset
+            + allocator->cslots.count) {
+        return slot - allocator->cslots.first - allocator->root_cnode_offset;
+    }
 
-    return result;
+    /* It must be in one of the CNodes we added. */
+    assert(bits);
+    n = (slot >> bits) - allocator->cspace_dir_slots.first;
+    assert(n < allocator->num_cspace_extensions);
+    return allocator->cslots.count + (n << bits) + (slot & ((1UL << bits) - 1));
 }
 
 /*
- * Retype an untyped item.
+ * Work out where the cap slot 'slot' is, in the form the kernel's CNode
+ * invocations want it.
  */
-int
-allocator_retype_untyped_memory(struct allocator *allocator,
-                                seL4_CPtr untyped_item, seL4_Word item_type, seL4_Word item_size,
-                                int num_items, struct cap_range *result)
+void
+allocator_cslot_path(struct allocator *allocator, seL4_CPtr slot,
+                     struct cslot_path *path)
 {
-    int max_objects;
-    int error;
-    UNUSED_NDEBUG(error);
+    unsigned long bits = allocator->cspace_cnode_bits;
+    unsigned long n;
 
-    /* Determine the maximum number of items we have space in our CNode for. */
-    max_objects = allocator->cslots.count - allocator->num_slots_used;
-    if (num_items > max_objects) {
-        result->count = 0;
-        result->first = 0;
-        return 0;
+    if (bits && slot >= allocator->cslots.first + allocator->root_cnode_offset
+            + allocator->cslots.count) {
+        n = (slot >> bits) - allocator->cspace_dir_slots.first;
+        if (n < allocator->num_cspace_extensions) {
+            path->cnode = slot & ~((1UL << bits) - 1);
+            path->depth = seL4_WordBits - bits;
+            path->offset = slot & ((1UL << bits) - 1);
+            return;
+        }
     }
 
-    /* Do the allocation. We expect at least one item will be created. */
-#ifdef CONFIG_KERNEL_STABLE
-    error = seL4_Untyped_RetypeAtOffset(
-                untyped_item,
-                item_type, 0, item_size,
-                seL4_CapInitThreadCNode,
-                allocator->root_cnode, allocator->root_cnode_depth, allocator->cslots.first + allocator->num_slots_used,
-                num_items);
-#else
-    error = seL4_Untyped_Retype(
-                untyped_item,
-                item_type, item_size,
-                seL4_CapInitThreadCNode,
-                allocator->root_cnode, allocator->root_cnode_depth, allocator->cslots.first + allocator->num_slots_used,
-                num_items);
-#endif
-    assert(!error);
-
-    /* Save the allocation. */
-    result->count = num_items;
-    result->first = allocator->cslots.first
-                    + allocator->num_slots_used + allocator->root_cnode_offset;
+    path->cnode = allocator->root_cnode;
+    path->depth = allocator->root_cnode_depth;
+    path->offset = slot - allocator->root_cnode_offset;
+}
 
-    /* Record these slots as used. */
-    allocator->num_slots_used += num_items;
+/*
+ * Allow the allocator to create new CNodes of 2^cnode_bits slots out of its
+ * own memory when it runs short of cap slots.
+ *
+ * New CNodes are installed in consecutive slots of 'dir_cnode' (found by
+ * resolving 'dir_depth' bits), starting at 'first_dir_slot'. 'dir_cnode' must
+ * be the root of a two-level CSpace that resolves the top
+ * seL4_WordBits - cnode_bits bits of a cap pointer, so that slot i of the CNode
+ * in directory slot d is addressed as (d << cnode_bits) | i.
+ *
+ * Must be called before the allocator has grown.
+ */
+void
+allocator_enable_cspace_growth(struct allocator *allocator,
+                               seL4_CPtr dir_cnode, unsigned long dir_depth,
+                               unsigned long first_dir_slot,
+                               unsigned long num_dir_slots,
+                               unsigned long cnode_bits)
+{
+    assert(allocator->num_cspace_extensions == 0);
+    assert(cnode_bits + seL4_SlotBits >= MIN_UNTYPED_SIZE);
+    assert(cnode_bits + seL4_SlotBits <= MAX_UNTYPED_SIZE);
+    assert(cnode_bits < seL4_WordBits);
 
-    return num_items;
+    allocator->cspace_dir = dir_cnode;
+    allocator->cspace_dir_depth = dir_depth;
+    allocator->cspace_dir_slots.first = first_dir_slot;
+    allocator->cspace_dir_slots.count = num_dir_slots;
+    allocator->cspace_cnode_bits = cnode_bits;
 }
 
 /*
- * Allocate untyped item of size 'size_bits' bits.
+ * Grow our supply of cap slots by creating a new CNode out of our own memory,
+ * and installing it in the next free slot of our directory CNode.
+ *
+ * Returns non-zero on success.
  */
-seL4_CPtr
-allocator_alloc_untyped(struct allocator *allocator, unsigned long size_bits)
+static int
+grow_cspace(struct allocator *allocator)
 {
-    seL4_CPtr result;
-    seL4_CPtr big_untyped_item;
-    int i;
-    int created_objects;
-    struct cap_range *pool;
+    unsigned long bits = allocator->cspace_cnode_bits;
+    int n = allocator->num_cspace_extensions;
+    struct cslot_path dest;
+    seL4_CPtr untyped;
+    int error;
 
-    /* If it is too small or too big, not much we can do. */
-    if (size_bits < MIN_UNTYPED_SIZE) {
+    /* The untyped item for the CNode may itself need splitting, which must
+     * make do with the slots we have left. */
+    if (!bits || allocator->cspace_growing || allocator->reset_next >= 0
+            || n >= MAX_CSPACE_EXTENSIONS
+            || n >= allocator->cspace_dir_slots.count
+            || allocator->num_cslots + (1UL << bits) > allocator->max_cslots) {
         return 0;
     }
-    if (size_bits > MAX_UNTYPED_SIZE) {
+    allocator->cspace_growing = 1;
+    untyped = allocator_alloc_untyped(allocator, bits + seL4_SlotBits);
+    allocator->cspace_growing = 0;
+    if (!untyped) {
         return 0;
     }
 
-    /* Grab our pool. */
-    pool = &allocator->untyped_items[size_bits - MIN_UNTYPED_SIZE];
-
-    /* Do we have something of the correct size in one of our pools? */
-    result = range_alloc(pool, 1);
-    if (result) {
-        return result;
-    }
-
-    /* Do we have something of the correct size in initial memory regions? */
-    for (i = 0; i < allocator->num_init_untyped_items; i++) {
-        if (allocator->init_untyped_items[i].is_free &&
-                allocator->init_untyped_items[i].size_bits == size_bits) {
-            allocator->init_untyped_items[i].is_free = 0;
-            return allocator->init_untyped_items[i].cap;
-        }
-    }
-
-    /* Otherwise, try splitting something of a bigger size. */
-    big_untyped_item = allocator_alloc_untyped(allocator, size_bits + 1);
-    if (!big_untyped_item) {
-        return 0;
-    }
-    created_objects = allocator_retype_untyped_memory(allocator,
-                                                      big_untyped_item, seL4_UntypedObject, size_bits, 2, pool);
-    if (!created_objects) {
+    dest.cnode = allocator->cspace_dir;
+    dest.depth = allocator->cspace_dir_depth;
+    dest.offset = allocator->cspace_dir_slots.first + n;
+    error = kernel_untyped_retype(allocator, untyped, seL4_CapTableObject,
+                                  bits, 0, &dest, 1);
+    if (error) {
+        allocator_free_untyped(allocator, untyped, bits + seL4_SlotBits);
         return 0;
     }
 
-    /* Allocate out of our split. */
-    result = range_alloc(pool, 1);
-    assert(result);
-    return result;
+    /* Add the new slots to the end of our bitmaps. */
+    allocator->cspace_extensions[n] = untyped;
+    allocator->num_cspace_extensions++;
+    allocator->num_cslots += 1UL << bits;
+    allocator->num_slots_used += 1UL << bits;
+    cslot_free_run(allocator, allocator->num_cslots - (1UL << bits), 1UL << bits);
+    return 1;
 }
 
 /*
- * Reset the allocator back to its initial state.
+ * Return non-zero if 'cap' is the untyped item behind one of the CNodes we
+ * created to grow our CSpace.
  */
-void
-allocator_reset(struct allocator *allocator)
+static int
+is_cspace_extension(struct allocator *allocator, seL4_CPtr cap)
 {
     int i;
-    int error;
-    UNUSED_NDEBUG(error);
-    /* Recycle all of our untyped memory back into its original form. */
-    for (i = 0; i < allocator->num_init_untyped_items; i++) {
-        /* If it hasn't been used, ignore it. */
-        if (allocator->init_untyped_items[i].is_free) {
-            continue;
+
+    for (i = 0; i < allocator->num_cspace_extensions; i++) {
+        if (allocator->cspace_extensions[i] == cap) {
+            return 1;
         }
+    }
+    return 0;
+}
 
-        /* Otherwise, tear down any child objects created from it. */
-        error = seL4_CNode_Recycle(
-                    seL4_CapInitThreadCNode,
-                    allocator->init_untyped_items[i].cap,
-                    seL4_WordBits);
-        assert(!error);
-        allocator->init_untyped_items[i].is_free = 1;
+/*
+ * Find 'count' contiguous free slots within a single CNode, returning the index
+ * of the first one, or -1 if we have no run of free slots that is long enough.
+ */
+static long
+cslot_find_run(struct allocator *allocator, unsigned long count)
+{
+    long first;
+    unsigned long end;
+    unsigned long i;
+
+    first = cslot_find_free(allocator, 0);
+    while (first >= 0) {
+        /* See how far the run of free slots starting here goes. */
+        end = cslot_window_end(allocator, first);
+        for (i = first + 1; i < first + count && i < end; i++) {
+            if (!(allocator->cslot_free[i / CSLOT_WORD_BITS]
+                    & ((seL4_Word)1 << (i % CSLOT_WORD_BITS)))) {
+                break;
+            }
+        }
+        if (i == first + count) {
+            return first;
+        }
+
+        /* Too short; carry on after the slot that stopped us, or in the next
+         * CNode. */
+        first = cslot_find_free(allocator, i == end ? end : i + 1);
     }
 
-    /* All of our free CNodes should be free again. */
-    allocator->num_slots_used = 0;
+    return -1;
+}
+
+/*
+ * Allocate 'count' contiguous slots, returning the index of the first one,
+ * or -1 if we have no run of free slots that is long enough.
+ */
+static long
+cslot_alloc_run(struct allocator *allocator, unsigned long count)
+{
+    long first;
 
-    /* Reset all of our pools to empty. */
-    for (i = MIN_UNTYPED_SIZE; i <= MAX_UNTYPED_SIZE; i++) {
-        allocator->untyped_items[i - MIN_UNTYPED_SIZE].first = 0;
-        allocator->untyped_items[i - MIN_UNTYPED_SIZE].count = 0;
+    first = cslot_find_run(allocator, count);
+    if (first >= 0) {
+        cslot_mark(allocator, first, count, 0);
     }
+    return first;
 }
 
 /*
- * Destroy an allocator, releasing any resources held by it.
+ * If we are allowed to, add another CNode when fewer than
+ * 'count' + CSPACE_GROWTH_RESERVE slots are free.
+ *
+ * This must only be called where nothing is half done, as creating the CNode
+ * allocates memory of its own.
  */
-void
-allocator_destroy(struct allocator *allocator)
+static void
+cslot_top_up(struct allocator *allocator, unsigned long count)
 {
-    allocator_reset(allocator);
+    if (allocator->num_cslots - allocator->num_slots_used
+            < count + CSPACE_GROWTH_RESERVE) {
+        grow_cspace(allocator);
+    }
 }
 
 /*
- * Allocate an object of the given type.
+ * Return 'count' slots starting at index 'first' to the free set.
  */
+static void
+cslot_free_run(struct allocator *allocator, unsigned long first,
+               unsigned long count)
+{
+    assert(first + count <= allocator->num_cslots);
+    cslot_mark(allocator, first, count, 1);
+}
 
 /*
- * Perform a simple test of the allocator. This test will reset the
- * allocator's state.
+ * Mark every slot we manage as free.
  */
-void
-allocator_self_test(struct allocator *allocator)
+static void
+cslot_reset(struct allocator *allocator)
 {
-    seL4_CPtr x, y;
-    x = allocator_alloc_untyped(allocator, MIN_UNTYPED_SIZE);
-    allocator_reset(allocator);
-    y = allocator_alloc_untyped(allocator, MIN_UNTYPED_SIZE);
-    allocator_reset(allocator);
-    UNUSED_NDEBUG(x);
-    UNUSED_NDEBUG(y);
-    assert(x == y);
+    unsigned long i;
+
+    for (i = 0; i < CSLOT_BITMAP_WORDS(allocator->max_cslots); i++) {
+        allocator->cslot_free[i] = 0;
+    }
+    for (i = 0; i < CSLOT_SUMMARY_WORDS(allocator->max_cslots); i++) {
+        allocator->cslot_free_summary[i] = 0;
+    }
+    allocator->num_slots_used = allocator->num_cslots;
+    cslot_free_run(allocator, 0, allocator->num_cslots);
 }
 
 /*
- * Allocate 'count' items out of the given range.
+ * Return the bits of word 'word' of the slot bitmap for slots below index
+ * 'count'.
  */
-static seL4_CPtr
-range_alloc(struct cap_range *range, int count)
+static seL4_Word
+cslot_word_mask(unsigned long word, unsigned long count)
 {
-    /* If there are not enough items in the range, abort. */
-    if (range->count < count) {
+    if (count <= word * CSLOT_WORD_BITS) {
         return 0;
     }
+    if (count - word * CSLOT_WORD_BITS >= CSLOT_WORD_BITS) {
+        return ~(seL4_Word)0;
+    }
+    return ((seL4_Word)1 << (count - word * CSLOT_WORD_BITS)) - 1;
+}
+
+/*
+ * Set 'word' of the slot bitmap to 'bits', keeping the summary bitmap and
+ * count of used slots up to date.
+ */
+static void
+cslot_set_word(struct allocator *allocator, unsigned long word, seL4_Word bits)
+{
+    allocator->num_slots_used += __builtin_popcountl(allocator->cslot_free[word]);
+    allocator->num_slots_used -= __builtin_popcountl(bits);
+    allocator->cslot_free[word] = bits;
+    if (bits) {
+        allocator->cslot_free_summary[word / CSLOT_WORD_BITS] |=
+            (seL4_Word)1 << (word % CSLOT_WORD_BITS);
+    } else {
+        allocator->cslot_free_summary[word / CSLOT_WORD_BITS] &=
+            ~((seL4_Word)1 << (word % CSLOT_WORD_BITS));
+    }
+}
 
-    /* Allocate from the range. */
-    assert(range->first);
-    range->count -= count;
-    return range->first + range->count;
+/*
+ * Note the slots in use as an incremental reset begins, to be freed when it
+ * finishes. The CNodes we added will be destroyed by the reset, so none of
+ * their slots may be handed out until then.
+ */
+static void
+cslot_mark_stale(struct allocator *allocator)
+{
+    seL4_Word mask;
+    unsigned long i;
+
+    for (i = 0; i * CSLOT_WORD_BITS < allocator->num_cslots; i++) {
+        mask = cslot_word_mask(i, allocator->cslots.count);
+        cslot_set_word(allocator, i, allocator->cslot_free[i] & mask);
+        allocator->cslot_stale[i] |= ~allocator->cslot_free[i] & mask;
+    }
+}
+
+/*
+ * Free the slots that were in use when an incremental reset began, and forget
+ * the CNodes we added, which the reset has destroyed.
+ */
+static void
+cslot_release_stale(struct allocator *allocator)
+{
+    seL4_Word mask;
+    unsigned long i;
+
+    for (i = 0; i * CSLOT_WORD_BITS < allocator->num_cslots; i++) {
+        mask = cslot_word_mask(i, allocator->cslots.count);
+        cslot_set_word(allocator, i,
+                       (allocator->cslot_free[i] | allocator->cslot_stale[i])
+                       & mask);
+        allocator->cslot_stale[i] = 0;
+    }
+    allocator->num_slots_used -= allocator->num_cslots - allocator->cslots.count;
+    allocator->num_cspace_extensions = 0;
+    allocator->num_cslots = allocator->cslots.count;
+}
+
+/*
+ * Allocate an empty cslot.
+ */
+seL4_CPtr
+allocator_alloc_cslot(struct allocator *allocator)
+{
+    return allocator_alloc_cslots(allocator, 1);
+}
+
+/*
+ * Free an empty cslot.
+ */
+void
+allocator_free_cslot(struct allocator *allocator, seL4_CPtr slot)
+{
+    allocator_free_cslots(allocator, slot, 1);
+}
+
+/*
+ * Allocate empty cslots, those cslots are contiguous.
+ *
+ * Return the first cslot.
+ */
+seL4_CPtr
+allocator_alloc_cslots(struct allocator *allocator, int num_slots)
+{
+    seL4_CPtr slot = 0;
+    long first = -1;
+
+    assert(num_slots > 0);
+    TRACE_BEGIN(allocator);
+
+    if (journal_has_room(allocator)) {
+        cslot_top_up(allocator, num_slots);
+        first = cslot_alloc_run(allocator, num_slots);
+        if (first < 0 && grow_cspace(allocator)) {
+            first = cslot_alloc_run(allocator, num_slots);
+        }
+        if (first < 0 && reclaim_split_slots(allocator)) {
+            first = cslot_alloc_run(allocator, num_slots);
+        }
+    }
+    if (first >= 0) {
+        slot = cslot_cptr(allocator, first);
+        journal_add_slots(allocator, slot, num_slots);
+    }
+
+    TRACE_END(allocator, ALLOCATOR_TRACE_ALLOC_CSLOTS, num_slots, 0, 0, 0,
+              slot);
+    return slot;
+}
+
+/*
+ * Free 'num_slots' contiguous empty cslots, starting at 'slot'.
+ */
+void
+allocator_free_cslots(struct allocator *allocator, seL4_CPtr slot,
+                      int num_slots)
+{
+    unsigned long first;
+
+    TRACE_BEGIN(allocator);
+    journal_forget_slots(allocator, slot, num_slots);
+
+    /* While a reset is under way, the CNodes we added are on their way out,
+     * so their slots are left as they are until it finishes. */
+    first = cslot_index(allocator, slot);
+    if (allocator->reset_next < 0 || first < allocator->cslots.count) {
+        cslot_free_run(allocator, first, num_slots);
+    }
+    TRACE_END(allocator, ALLOCATOR_TRACE_FREE_CSLOTS, slot, num_slots,
+              0, 0, 0);
+}
+
+/*
+ * Mark 'num_slots' contiguous free cslots, starting at 'slot', as used.
+ */
+static void
+cslot_reserve(struct allocator *allocator, seL4_CPtr slot,
+              int num_slots)
+{
+    cslot_mark(allocator, cslot_index(allocator, slot), num_slots, 0);
+}
+
+/*
+ * Retype 'num_items' objects out of an untyped item into consecutive slots,
+ * without journalling the slots.
+ *
+ * Returns the number of objects created.
+ */
+static int
+retype_untyped(struct allocator *allocator, seL4_CPtr untyped_item,
+               seL4_Word item_type, seL4_Word item_size, int num_items,
+               struct cap_range *result)
+{
+    struct cslot_path dest;
+    long first;
+    int error;
+    UNUSED_NDEBUG(error);
+
+    result->count = 0;
+    result->first = 0;
+
+    /* Find space in our CNode for the new items. */
+    first = cslot_alloc_run(allocator, num_items);
+    if (first < 0 && reclaim_split_slots(allocator)) {
+        first = cslot_alloc_run(allocator, num_items);
+    }
+    if (first < 0) {
+        return 0;
+    }
+
+    /* Do the allocation. We expect at least one item will be created. */
+    allocator_cslot_path(allocator, cslot_cptr(allocator, first), &dest);
+    error = kernel_untyped_retype(allocator, untyped_item, item_type, item_size,
+                                  0, &dest, num_items);
+    assert(!error);
+
+    /* Save the allocation. */
+    result->count = num_items;
+    result->first = cslot_cptr(allocator, first);
+    return num_items;
+}
+
+/*
+ * Retype an untyped item.
+ */
+int
+allocator_retype_untyped_memory(struct allocator *allocator,
+                                seL4_CPtr untyped_item, seL4_Word item_type, seL4_Word item_size,
+                                int num_items, struct cap_range *result)
+{
+    int created = 0;
+
+    TRACE_BEGIN(allocator);
+    result->count = 0;
+    result->first = 0;
+    if (journal_has_room(allocator)) {
+        created = retype_untyped(allocator, untyped_item, item_type,
+                                 item_size, num_items, result);
+    }
+    if (created) {
+        journal_add_slots(allocator, result->first, result->count);
+    }
+    TRACE_END(allocator, ALLOCATOR_TRACE_RETYPE, untyped_item,
+              item_type, item_size, num_items, result->first);
+    return created;
+}
+
+/*
+ * Recompute whether we have any free items of 'size_bits' bits, both in small
+ * regions and elsewhere.
+ */
+static void
+update_size_available(struct allocator *allocator, unsigned long size_bits)
+{
+    unsigned long bit = 1UL << (size_bits - MIN_UNTYPED_SIZE);
+
+    if (allocator->untyped_pools[size_bits - MIN_UNTYPED_SIZE] >= 0
+            || allocator->init_untyped_free[size_bits - MIN_UNTYPED_SIZE] >= 0) {
+        allocator->untyped_sizes_available |= bit;
+    } else {
+        allocator->untyped_sizes_available &= ~bit;
+    }
+
+    if (allocator->small_pools[size_bits - MIN_UNTYPED_SIZE] >= 0) {
+        allocator->small_sizes_available |= bit;
+    } else {
+        allocator->small_sizes_available &= ~bit;
+    }
+}
+
+/*
+ * Mark initial item 'i' as free, adding it to the free list for its size.
+ */
+static void
+init_item_push(struct allocator *allocator, int i)
+{
+    unsigned long size_bits = allocator->init_untyped_items[i].size_bits;
+    int *head = &allocator->init_untyped_free[size_bits - MIN_UNTYPED_SIZE];
+
+    allocator->init_untyped_items[i].is_free = 1;
+    allocator->init_untyped_items[i].next_free = *head;
+    *head = i;
+    update_size_available(allocator, size_bits);
+}
+
+/*
+ * Take the first free initial item of 'size_bits' bits, returning its index
+ * or -1 if there is none.
+ */
+static int
+init_item_pop(struct allocator *allocator, unsigned long size_bits)
+{
+    int *head = &allocator->init_untyped_free[size_bits - MIN_UNTYPED_SIZE];
+    int i = *head;
+
+    if (i < 0) {
+        return -1;
+    }
+
+    allocator->init_untyped_items[i].is_free = 0;
+    *head = allocator->init_untyped_items[i].next_free;
+    update_size_available(allocator, size_bits);
+    return i;
+}
+
+/*
+ * Return the head of the pool split 's' belongs in when it has free children.
+ */
+static int *
+pool_head(struct allocator *allocator, int s)
+{
+    struct untyped_split *split = &allocator->splits[s];
+
+    if (split->in_small_region) {
+        return &allocator->small_pools[split->size_bits - MIN_UNTYPED_SIZE];
+    }
+    return &allocator->untyped_pools[split->size_bits - MIN_UNTYPED_SIZE];
+}
+
+/*
+ * Take initial item 'i', which must be free, off the free list for its size.
+ */
+static void
+init_item_remove(struct allocator *allocator, int i)
+{
+    unsigned long size_bits = allocator->init_untyped_items[i].size_bits;
+    int *link = &allocator->init_untyped_free[size_bits - MIN_UNTYPED_SIZE];
+
+    assert(allocator->init_untyped_items[i].is_free);
+    while (*link != i) {
+        assert(*link >= 0);
+        link = &allocator->init_untyped_items[*link].next_free;
+    }
+    *link = allocator->init_untyped_items[i].next_free;
+    allocator->init_untyped_items[i].is_free = 0;
+    update_size_available(allocator, size_bits);
+}
+
+/*
+ * Add split 's' to the front of the pool for its size.
+ */
+static void
+pool_push(struct allocator *allocator, int s)
+{
+    struct untyped_split *split = &allocator->splits[s];
+    int *pool = pool_head(allocator, s);
+
+    split->prev = -1;
+    split->next = *pool;
+    if (*pool >= 0) {
+        allocator->splits[*pool].prev = s;
+    }
+    *pool = s;
+    update_size_available(allocator, split->size_bits);
+}
+
+/*
+ * Remove split 's' from the pool for its size.
+ */
+static void
+pool_remove(struct allocator *allocator, int s)
+{
+    struct untyped_split *split = &allocator->splits[s];
+
+    if (split->prev >= 0) {
+        allocator->splits[split->prev].next = split->next;
+    } else {
+        *pool_head(allocator, s) = split->next;
+    }
+    if (split->next >= 0) {
+        allocator->splits[split->next].prev = split->prev;
+    }
+    update_size_available(allocator, split->size_bits);
+}
+
+/*
+ * Take child 'i' of split 's', which must be free.
+ */
+static void
+take_child(struct allocator *allocator, int s, int i)
+{
+    struct untyped_split *split = &allocator->splits[s];
+
+    assert(split->free & (1UL << i));
+    split->free &= ~(1UL << i);
+    if (!split->free) {
+        pool_remove(allocator, s);
+    }
+}
+
+/*
+ * Add split 's' to the index of splits by cap.
+ */
+static void
+split_hash_add(struct allocator *allocator, int s)
+{
+    int *chain = &allocator->split_hash[SPLIT_HASH(allocator->splits[s].first)];
+
+    allocator->splits[s].hash_next = *chain;
+    *chain = s;
+}
+
+/*
+ * Remove split 's' from the index of splits by cap.
+ */
+static void
+split_hash_remove(struct allocator *allocator, int s)
+{
+    int *link = &allocator->split_hash[SPLIT_HASH(allocator->splits[s].first)];
+
+    while (*link != s) {
+        assert(*link >= 0);
+        link = &allocator->splits[*link].hash_next;
+    }
+    *link = allocator->splits[s].hash_next;
+}
+
+/*
+ * Mark all of our split records as unused, and all pools as empty.
+ */
+static void
+reset_splits(struct allocator *allocator)
+{
+    int i;
+
+    for (i = 0; i < allocator->max_splits; i++) {
+        allocator->splits[i].parent = 0;
+        allocator->splits[i].next = i + 1;
+    }
+    allocator->splits[allocator->max_splits - 1].next = -1;
+    allocator->free_split = 0;
+    for (i = 0; i < SPLIT_HASH_BUCKETS; i++) {
+        allocator->split_hash[i] = -1;
+    }
+
+    for (i = 0; i < NUM_UNTYPED_SIZES; i++) {
+        allocator->untyped_pools[i] = -1;
+        allocator->small_pools[i] = -1;
+        if (allocator->init_untyped_free[i] < 0) {
+            allocator->untyped_sizes_available &= ~(1UL << i);
+        }
+    }
+    allocator->small_sizes_available = 0;
+}
+
+/*
+ * Take a free untyped item of exactly 'size_bits' bits out of our pools or
+ * initial memory regions, without splitting anything; or if 'small_region'
+ * is set, out of the pools of our small regions. Where it came from is
+ * recorded in 'origin'.
+ */
+static seL4_CPtr
+take_untyped(struct allocator *allocator, unsigned long size_bits,
+             int small_region, struct untyped_origin *origin)
+{
+    struct untyped_split *split;
+    int s;
+    int i;
+
+    /* Do we have something of the correct size in one of our pools? */
+    if (small_region) {
+        s = allocator->small_pools[size_bits - MIN_UNTYPED_SIZE];
+    } else {
+        s = allocator->untyped_pools[size_bits - MIN_UNTYPED_SIZE];
+    }
+    if (s >= 0) {
+        split = &allocator->splits[s];
+        i = __builtin_ctzl(split->free);
+        take_child(allocator, s, i);
+        origin->split = s;
+        origin->index = i;
+        return split->first + i;
+    }
+    if (small_region) {
+        return 0;
+    }
+
+    /* Do we have something of the correct size in initial memory regions? */
+    i = init_item_pop(allocator, size_bits);
+    if (i >= 0) {
+        origin->split = -1;
+        origin->index = i;
+        return allocator->init_untyped_items[i].cap;
+    }
+
+    return 0;
+}
+
+static void release_untyped(struct allocator *allocator,
+                            struct untyped_origin *origin, int merge);
+
+/*
+ * Record whether the untyped item at 'origin' has been split.
+ */
+static void
+mark_split(struct allocator *allocator, struct untyped_origin *origin,
+           int is_split)
+{
+    if (origin->split < 0) {
+        allocator->init_untyped_items[origin->index].is_split = is_split;
+    } else if (is_split) {
+        allocator->splits[origin->split].split |= 1UL << origin->index;
+    } else {
+        allocator->splits[origin->split].split &= ~(1UL << origin->index);
+    }
+}
+
+/*
+ * Return the physical address of the untyped item at 'origin', or
+ * UNKNOWN_PADDR.
+ */
+static seL4_Word
+origin_paddr(struct allocator *allocator, struct untyped_origin *origin)
+{
+    struct untyped_split *split;
+
+    if (origin->split < 0) {
+        return allocator->init_untyped_items[origin->index].paddr;
+    }
+    split = &allocator->splits[origin->split];
+    if (split->paddr == UNKNOWN_PADDR) {
+        return UNKNOWN_PADDR;
+    }
+    return split->paddr + ((seL4_Word)origin->index << split->size_bits);
+}
+
+/*
+ * Return the cap to the untyped item at 'origin'.
+ */
+static seL4_CPtr
+origin_cap(struct allocator *allocator, struct untyped_origin *origin)
+{
+    if (origin->split < 0) {
+        return allocator->init_untyped_items[origin->index].cap;
+    }
+    return allocator->splits[origin->split].first + origin->index;
+}
+
+/*
+ * Return non-zero if the untyped item at 'origin' has been split.
+ */
+static int
+origin_is_split(struct allocator *allocator, struct untyped_origin *origin)
+{
+    if (origin->split < 0) {
+        return allocator->init_untyped_items[origin->index].is_split;
+    }
+    return (allocator->splits[origin->split].split >> origin->index) & 1;
+}
+
+/*
+ * Work out where the untyped item 'cap' came from.
+ *
+ * Returns non-zero if it is one of ours.
+ */
+static int
+find_origin(struct allocator *allocator, seL4_CPtr cap,
+            struct untyped_origin *origin)
+{
+    struct untyped_split *split;
+    seL4_CPtr first;
+    int i, n;
+
+    /* The first child of the split is less than 2^MAX_SPLIT_FANOUT_BITS caps
+     * before 'cap', so it is on the chain for 'cap' or the one before. */
+    for (n = 0; n < 2; n++) {
+        first = cap - ((seL4_CPtr)n << MAX_SPLIT_FANOUT_BITS);
+        for (i = allocator->split_hash[SPLIT_HASH(first)]; i >= 0;
+                i = split->hash_next) {
+            split = &allocator->splits[i];
+            if (cap >= split->first && cap < split->first + split->count
+                    && !(split->split & (1UL << (cap - split->first)))) {
+                origin->split = i;
+                origin->index = cap - split->first;
+                return 1;
+            }
+        }
+    }
+    for (i = 0; i < allocator->num_init_untyped_items; i++) {
+        if (allocator->init_untyped_items[i].cap == cap) {
+            origin->split = -1;
+            origin->index = i;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Return the physical address of the untyped item 'cap', previously returned
+ * by allocator_alloc_untyped(), or UNKNOWN_PADDR if we don't know it.
+ */
+seL4_Word
+allocator_untyped_paddr(struct allocator *allocator, seL4_CPtr cap)
+{
+    struct untyped_origin origin;
+
+    if (!find_origin(allocator, cap, &origin)) {
+        return UNKNOWN_PADDR;
+    }
+    return origin_paddr(allocator, &origin);
+}
+
+/*
+ * Return non-zero if the cap of the item 'split' was split from has been
+ * deleted.
+ */
+static int
+parent_deleted(struct allocator *allocator, struct untyped_split *split)
+{
+    return split->parent_split >= 0
+           && (allocator->splits[split->parent_split].deleted
+               & (1UL << split->parent_index));
+}
+
+/*
+ * Return the split of child 'index' of split 's', or -1 if there is none.
+ */
+static int
+find_child_split(struct allocator *allocator, int s, unsigned long index)
+{
+    int i;
+
+    for (i = 0; i < allocator->max_splits; i++) {
+        if (allocator->splits[i].parent
+                && allocator->splits[i].parent_split == s
+                && allocator->splits[i].parent_index == index) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Return non-zero if nothing under split 's' is in use: each child is either
+ * free, or had its cap deleted and has nothing under it in use.
+ */
+static int
+subtree_free(struct allocator *allocator, int s)
+{
+    struct untyped_split *split = &allocator->splits[s];
+    unsigned long i;
+    int child;
+
+    for (i = 0; i < split->count; i++) {
+        if (split->free & (1UL << i)) {
+            continue;
+        }
+        if (!(split->deleted & (1UL << i))) {
+            return 0;
+        }
+        child = find_child_split(allocator, s, i);
+        if (child < 0 || !subtree_free(allocator, child)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Forget split 's', nothing under which is in use, once the caps of its
+ * children and everything under them have been destroyed.
+ */
+static void
+drop_split(struct allocator *allocator, int s)
+{
+    struct untyped_split *split = &allocator->splits[s];
+    unsigned long i;
+
+    for (i = 0; i < split->count; i++) {
+        if (split->deleted & (1UL << i)) {
+            drop_split(allocator, find_child_split(allocator, s, i));
+        } else {
+            cslot_free_run(allocator,
+                           cslot_index(allocator, split->first + i), 1);
+        }
+    }
+
+    if (split->free) {
+        pool_remove(allocator, s);
+    }
+    split_hash_remove(allocator, s);
+    split->parent = 0;
+    split->next = allocator->free_split;
+    allocator->free_split = s;
+}
+
+/*
+ * Merge split 's', nothing under which is in use, back into the untyped item
+ * it was split from.
+ */
+static void
+merge_split(struct allocator *allocator, int s)
+{
+    struct untyped_split *split = &allocator->splits[s];
+    struct untyped_origin parent;
+    int error;
+    UNUSED_NDEBUG(error);
+
+    assert(subtree_free(allocator, s));
+    assert(!parent_deleted(allocator, split));
+    STATS_INC(allocator, merges);
+
+    /* Deleting the children, and anything split from them, also frees up
+     * the cap slots they were in. */
+    error = kernel_revoke(allocator, split->parent);
+    assert(!error);
+
+    parent.split = split->parent_split;
+    parent.index = split->parent_index;
+    mark_split(allocator, &parent, 0);
+    drop_split(allocator, s);
+
+    /* The parent is whole again; this may allow it to be merged too. */
+    release_untyped(allocator, &parent, 1);
+}
+
+/*
+ * Return an untyped item (with nothing derived from it) to the pool it came
+ * from.
+ *
+ * If this leaves every child of its split free, the split is merged back into
+ * its parent; unless 'merge' is set, we only do this while another split of
+ * the same size still has free items, so that alternately allocating and
+ * freeing an item does not repeatedly split and merge its parents.
+ */
+static void
+release_untyped(struct allocator *allocator, struct untyped_origin *origin,
+                int merge)
+{
+    struct untyped_split *split;
+    int *pool;
+    int s;
+
+    if (origin->split < 0) {
+        init_item_push(allocator, origin->index);
+        return;
+    }
+
+    split = &allocator->splits[origin->split];
+    assert(!(split->free & (1UL << origin->index)));
+    if (!split->free) {
+        pool_push(allocator, origin->split);
+    }
+    split->free |= 1UL << origin->index;
+
+    if (!subtree_free(allocator, origin->split)) {
+        return;
+    }
+
+    /* If the cap of the item we were split from has been deleted, we can
+     * only get the memory back by revoking the nearest item above us that
+     * still has its cap, once nothing under that is in use either. */
+    s = origin->split;
+    if (parent_deleted(allocator, split)) {
+        while (parent_deleted(allocator, &allocator->splits[s])) {
+            s = allocator->splits[s].parent_split;
+            if (!subtree_free(allocator, s)) {
+                return;
+            }
+        }
+        merge_split(allocator, s);
+        return;
+    }
+
+    pool = pool_head(allocator, s);
+    if (merge || *pool != s || split->next >= 0) {
+        merge_split(allocator, s);
+    }
+}
+
+/*
+ * Merge every split whose children are all free back into its parent.
+ *
+ * Returns non-zero if anything was merged.
+ */
+static int
+merge_free_splits(struct allocator *allocator)
+{
+    struct untyped_split *split;
+    int merged = 0;
+    int i;
+
+    for (i = 0; i < allocator->max_splits; i++) {
+        split = &allocator->splits[i];
+        if (split->parent && !parent_deleted(allocator, split)
+                && subtree_free(allocator, i)) {
+            merge_split(allocator, i);
+            merged = 1;
+        }
+    }
+
+    return merged;
+}
+
+/*
+ * Delete the caps of split items whose children are all in use, giving back
+ * the cap slots they were in; when we run short of slots, these are the
+ * least useful ones we hold. Once everything split from such an item is free
+ * again, it is merged by revoking the nearest item above it that still has
+ * its cap, as that also destroys everything derived from the deleted one.
+ *
+ * Initial items are kept, as resetting the allocator needs them.
+ *
+ * Returns the number of slots freed.
+ */
+static int
+reclaim_split_slots(struct allocator *allocator)
+{
+    struct untyped_split *split;
+    int freed = 0;
+    int error;
+    int i;
+    UNUSED_NDEBUG(error);
+
+    for (i = 0; i < allocator->max_splits; i++) {
+        split = &allocator->splits[i];
+        if (!split->parent || split->parent_split < 0
+                || parent_deleted(allocator, split) || split->free) {
+            continue;
+        }
+        error = kernel_delete(allocator, split->parent);
+        assert(!error);
+        cslot_free_run(allocator, cslot_index(allocator, split->parent), 1);
+        allocator->splits[split->parent_split].deleted |=
+            1UL << split->parent_index;
+        freed++;
+    }
+
+    return freed;
+}
+
+/*
+ * Split the untyped item 'donor' of 'donor_bits' bits into 2^fanout_bits
+ * children, and add them to the pool for their size; the pool of small
+ * regions if 'small_region' is set.
+ *
+ * Returns non-zero on success.
+ */
+static int
+split_untyped(struct allocator *allocator, seL4_CPtr donor,
+              struct untyped_origin *origin, unsigned long donor_bits,
+              unsigned long fanout_bits, int small_region)
+{
+    struct untyped_split *split;
+    struct cap_range children;
+    int s;
+
+    /* Find somewhere to record the split, merging free splits back
+     * together to make room if we have to. */
+    if (allocator->free_split < 0) {
+        merge_free_splits(allocator);
+    }
+    s = allocator->free_split;
+    if (s < 0) {
+        return 0;
+    }
+
+    if (!retype_untyped(allocator, donor, seL4_UntypedObject,
+                        donor_bits - fanout_bits, 1 << fanout_bits, &children)) {
+        return 0;
+    }
+
+    split = &allocator->splits[s];
+    allocator->free_split = split->next;
+    split->parent = donor;
+    split->parent_split = origin->split;
+    split->parent_index = origin->index;
+    split->paddr = origin_paddr(allocator, origin);
+    split->first = children.first;
+    split->size_bits = donor_bits - fanout_bits;
+    split->count = children.count;
+    split->free = (1UL << children.count) - 1;
+    split->split = 0;
+    split->in_small_region = small_region;
+    split->deleted = 0;
+    pool_push(allocator, s);
+    split_hash_add(allocator, s);
+    mark_split(allocator, origin, 1);
+    STATS_INC(allocator, splits);
+
+    return 1;
+}
+
+/*
+ * Set the policy used to decide which free memory allocations are carved out
+ * of. This is best done straight after the allocator is created.
+ *
+ * By default, allocations split the smallest free item that is big enough.
+ * In addition:
+ *
+ *     - Allocations of fewer than 'small_bits' bits are kept together in
+ *       small regions of 'small_region_bits' bits. Other allocations only
+ *       use memory in small regions when nothing else is left, and small
+ *       allocations only start a new region when the others are full.
+ *
+ *     - Items of at least 'reserve_bits' bits are kept whole for allocations
+ *       at least that big, and only split for smaller allocations when
+ *       nothing else is left.
+ *
+ * A 'small_bits' or 'reserve_bits' of zero disables the respective behaviour.
+ */
+void
+allocator_set_placement(struct allocator *allocator,
+                        struct allocator_placement *placement)
+{
+    assert(!placement->small_bits
+           || placement->small_region_bits >= placement->small_bits);
+    assert(placement->small_region_bits <= MAX_UNTYPED_SIZE);
+    assert(placement->reserve_bits <= MAX_UNTYPED_SIZE);
+
+    allocator->placement = *placement;
+}
+
+/*
+ * Choose the size of the free item, of at least 'min_bits' bits, that an
+ * allocation of 'size_bits' bits should be carved out of, following our
+ * placement policy. '*small_region' is set if the item should come out of a
+ * small region. Unless 'last_resort' is set, memory set aside by the policy
+ * is left alone.
+ *
+ * Returns zero if there is no suitable item.
+ */
+static unsigned long
+find_donor(struct allocator *allocator, unsigned long size_bits,
+           unsigned long min_bits, int last_resort, int *small_region)
+{
+    struct allocator_placement *placement = &allocator->placement;
+    unsigned long wanted = ~0UL << (min_bits - MIN_UNTYPED_SIZE);
+    unsigned long available;
+
+    /* Small allocations go in our small regions if they have room. */
+    *small_region = 1;
+    if (size_bits < placement->small_bits) {
+        available = allocator->small_sizes_available & wanted;
+        if (available) {
+            return __builtin_ctzl(available) + MIN_UNTYPED_SIZE;
+        }
+    }
+
+    /* Otherwise, take the smallest item that is big enough. */
+    *small_region = 0;
+    available = allocator->untyped_sizes_available & wanted;
+    if (!last_resort && size_bits < placement->reserve_bits) {
+        available &= (1UL << (placement->reserve_bits - MIN_UNTYPED_SIZE)) - 1;
+    }
+    if (available) {
+        return __builtin_ctzl(available) + MIN_UNTYPED_SIZE;
+    }
+
+    /* Failing that, anything will do. */
+    if (last_resort) {
+        *small_region = 1;
+        available = allocator->small_sizes_available & wanted;
+        if (available) {
+            return __builtin_ctzl(available) + MIN_UNTYPED_SIZE;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Split the item 'donor' of 'donor_bits' bits, which we have taken from
+ * 'origin', down to an item of 'size_bits' bits, which we take. 'origin' is
+ * updated to say where that came from, and '*depth' set to the number of
+ * splits needed. 'small_region' is set if the donor is part of a small
+ * region.
+ *
+ * Returns zero, after giving the donor back, if we could not split it.
+ */
+static seL4_CPtr
+split_down(struct allocator *allocator, seL4_CPtr donor,
+           struct untyped_origin *origin, unsigned long donor_bits,
+           unsigned long size_bits, int small_region, unsigned long *depth)
+{
+    unsigned long fanout_bits;
+    int small;
+    int split;
+
+    *depth = 0;
+
+    /*
+     * Rather than halving the donor one level at a time, the last split fans
+     * out into up to 2^MAX_SPLIT_FANOUT_BITS children of the size we want,
+     * which are likely to be wanted again. Splits on the way down only fan
+     * out into 2^INTERMEDIATE_SPLIT_FANOUT_BITS, as their spare children
+     * are less likely to be used and each costs a cap slot. We keep
+     * splitting one of the children and leave the rest in the pool of their
+     * size.
+     *
+     * Taking 16 bytes from a 256 MiB item this way costs 11 retypes and 56
+     * cap slots, where halving costs 24 retypes and 48 slots. When we have
+     * fewer than SPLIT_FANOUT_MIN_FREE_SLOTS slots free, we halve instead.
+     *
+     * Small allocations that have to start a new small region first split
+     * off a whole region, and everything carved out of that stays in the
+     * pools of small regions.
+     */
+    small = size_bits < allocator->placement.small_bits;
+    while (donor_bits > size_bits) {
+        fanout_bits = donor_bits - size_bits;
+        if (small && !small_region
+                && donor_bits > allocator->placement.small_region_bits) {
+            fanout_bits = donor_bits - allocator->placement.small_region_bits;
+        }
+        if (fanout_bits > MAX_SPLIT_FANOUT_BITS) {
+            fanout_bits = INTERMEDIATE_SPLIT_FANOUT_BITS;
+        }
+        if (allocator->num_cslots - allocator->num_slots_used
+                < SPLIT_FANOUT_MIN_FREE_SLOTS) {
+            fanout_bits = 1;
+        }
+        if (small && donor_bits <= allocator->placement.small_region_bits) {
+            small_region = 1;
+        }
+
+        /* Fall back to a narrower split if we are short on cap slots. */
+        while (1) {
+            split = split_untyped(allocator, donor, origin, donor_bits,
+                                  fanout_bits, small_region);
+            if (split || fanout_bits == 1) {
+                break;
+            }
+            fanout_bits--;
+        }
+        if (!split) {
+            release_untyped(allocator, origin, 0);
+            return 0;
+        }
+
+        /* The new split is at the front of its pool. */
+        donor_bits -= fanout_bits;
+        donor = take_untyped(allocator, donor_bits, small_region, origin);
+        assert(donor);
+        (*depth)++;
+    }
+
+    return donor;
+}
+
+/*
+ * Allocate untyped item of size 'size_bits' bits.
+ */
+static seL4_CPtr
+alloc_untyped(struct allocator *allocator, unsigned long size_bits)
+{
+    struct untyped_origin origin;
+    seL4_CPtr donor;
+    unsigned long donor_bits;
+    unsigned long depth;
+    int small_region;
+
+    /* If it is too small or too big, not much we can do. */
+    if (size_bits < MIN_UNTYPED_SIZE) {
+        return 0;
+    }
+    if (size_bits > MAX_UNTYPED_SIZE) {
+        return 0;
+    }
+
+    /* Make sure we have the slots to split things with. */
+    cslot_top_up(allocator, 0);
+
+    /* Find an item at least as big as what we want, using our bitmaps of
+     * sizes we have free items of. If nothing is suitable, see whether
+     * merging free items back together helps, and failing that borrow more
+     * memory from our parent, before touching memory our placement policy
+     * has set aside. */
+    do {
+        donor_bits = find_donor(allocator, size_bits, size_bits, 0,
+                                &small_region);
+    } while (!donor_bits && (merge_free_splits(allocator)
+                             || borrow_from_parent(allocator, size_bits)));
+    if (!donor_bits) {
+        donor_bits = find_donor(allocator, size_bits, size_bits, 1,
+                                &small_region);
+    }
+    if (!donor_bits) {
+        STATS_INC(allocator, pool_misses[size_bits - MIN_UNTYPED_SIZE]);
+        return 0;
+    }
+    donor = take_untyped(allocator, donor_bits, small_region, &origin);
+    assert(donor);
+
+    if (donor_bits == size_bits) {
+        STATS_INC(allocator, pool_hits[size_bits - MIN_UNTYPED_SIZE]);
+    } else {
+        STATS_INC(allocator, pool_misses[size_bits - MIN_UNTYPED_SIZE]);
+    }
+
+    donor = split_down(allocator, donor, &origin, donor_bits, size_bits,
+                       small_region, &depth);
+    STATS_SET(allocator, last_split_depth, depth);
+    STATS_MAX(allocator, max_split_depth, depth);
+    return donor;
+}
+
+seL4_CPtr
+allocator_alloc_untyped(struct allocator *allocator, unsigned long size_bits)
+{
+    seL4_CPtr cap = 0;
+
+    TRACE_BEGIN(allocator);
+    if (journal_has_room(allocator)) {
+        cap = alloc_untyped(allocator, size_bits);
+    }
+    if (cap) {
+        journal_add_untyped(allocator, cap, size_bits);
+    }
+    TRACE_END(allocator, ALLOCATOR_TRACE_ALLOC_UNTYPED, size_bits, 0, 0, 0,
+              cap);
+
+    return cap;
+}
+
+/*
+ * Allocate the untyped item of 'size_bits' bits at physical address 'paddr',
+ * which must be aligned to its size, splitting whatever free memory covers it.
+ *
+ * Returns zero if we don't have that memory, or it is already in use.
+ */
+static seL4_CPtr
+alloc_untyped_at(struct allocator *allocator, seL4_Word paddr,
+                 unsigned long size_bits)
+{
+    struct untyped_split *split;
+    struct untyped_origin origin;
+    seL4_CPtr cap;
+    unsigned long bits;
+    unsigned long fanout_bits;
+    seL4_Word base;
+    int root;
+    int i;
+
+    if (size_bits < MIN_UNTYPED_SIZE || size_bits > MAX_UNTYPED_SIZE
+            || (paddr & ((1UL << size_bits) - 1))) {
+        return 0;
+    }
+    cslot_top_up(allocator, 0);
+
+    /* Find the initial item covering the memory. */
+    for (i = 0; i < allocator->num_init_untyped_items; i++) {
+        base = allocator->init_untyped_items[i].paddr;
+        bits = allocator->init_untyped_items[i].size_bits;
+        if (base != UNKNOWN_PADDR && bits >= size_bits
+                && paddr >= base && paddr - base < (1UL << bits)) {
+            break;
+        }
+    }
+    if (i == allocator->num_init_untyped_items) {
+        return 0;
+    }
+    root = i;
+    origin.split = -1;
+    origin.index = root;
+
+    /* Walk down the splits covering the memory, to the smallest item. */
+    while (origin_is_split(allocator, &origin)) {
+        i = find_child_split(allocator, origin.split, origin.index);
+        if (i < 0) {
+            return 0;
+        }
+        split = &allocator->splits[i];
+        if (split->size_bits < size_bits) {
+            /* Too finely split; see whether merging free items back
+             * together helps. This may merge things above where we are, so
+             * start again from the top. */
+            if (!merge_free_splits(allocator)) {
+                return 0;
+            }
+            origin.split = -1;
+            origin.index = root;
+            continue;
+        }
+        origin.split = i;
+        origin.index = (paddr - split->paddr) >> split->size_bits;
+    }
+    cap = origin_cap(allocator, &origin);
+
+    /* Take the item, if it is free, and split it down to what we want. */
+    if (origin.split < 0) {
+        if (!allocator->init_untyped_items[origin.index].is_free) {
+            return 0;
+        }
+        init_item_remove(allocator, origin.index);
+        bits = allocator->init_untyped_items[origin.index].size_bits;
+    } else {
+        split = &allocator->splits[origin.split];
+        if (!(split->free & (1UL << origin.index))) {
+            return 0;
+        }
+        take_child(allocator, origin.split, origin.index);
+        bits = split->size_bits;
+    }
+    while (bits > size_bits) {
+        fanout_bits = bits - size_bits;
+        if (fanout_bits > MAX_SPLIT_FANOUT_BITS) {
+            fanout_bits = MAX_SPLIT_FANOUT_BITS;
+        }
+        if (!split_untyped(allocator, cap, &origin, bits, fanout_bits, 0)) {
+            release_untyped(allocator, &origin, 0);
+            return 0;
+        }
+
+        /* The new split is at the front of its pool. */
+        bits -= fanout_bits;
+        origin.split = allocator->untyped_pools[bits - MIN_UNTYPED_SIZE];
+        split = &allocator->splits[origin.split];
+        origin.index = (paddr - split->paddr) >> bits;
+        take_child(allocator, origin.split, origin.index);
+        cap = split->first + origin.index;
+    }
+
+    return cap;
+}
+
+seL4_CPtr
+allocator_alloc_untyped_at(struct allocator *allocator, seL4_Word paddr,
+                           unsigned long size_bits)
+{
+    seL4_CPtr cap = 0;
+
+    TRACE_BEGIN(allocator);
+    if (journal_has_room(allocator)) {
+        cap = alloc_untyped_at(allocator, paddr, size_bits);
+    }
+    if (cap) {
+        journal_add_untyped(allocator, cap, size_bits);
+    }
+    TRACE_END(allocator, ALLOCATOR_TRACE_ALLOC_UNTYPED_AT, paddr, size_bits,
+              0, 0, cap);
+
+    return cap;
+}
+
+/*
+ * Free an untyped item of 'size_bits' bits previously returned by
+ * allocator_alloc_untyped(), destroying any objects created from it.
+ */
+void
+allocator_free_untyped(struct allocator *allocator, seL4_CPtr cap,
+                       unsigned long size_bits)
+{
+    struct untyped_origin origin;
+    int found;
+    int error;
+    UNUSED_NDEBUG(error);
+
+    /* Work out where the item came from. Items that have been split
+     * themselves can't be freed, and anything else isn't ours. */
+    found = find_origin(allocator, cap, &origin);
+    assert(found);
+    if (!found) {
+        return;
+    }
+
+    TRACE_BEGIN(allocator);
+    if (origin.split < 0) {
+        assert(!allocator->init_untyped_items[origin.index].is_free);
+        assert(!allocator->init_untyped_items[origin.index].is_split);
+    } else {
+        assert(allocator->splits[origin.split].size_bits == size_bits);
+        assert(!(allocator->splits[origin.split].free & (1UL << origin.index)));
+        assert(!(allocator->splits[origin.split].split & (1UL << origin.index)));
+    }
+
+    /* Destroy anything created from the item. */
+    error = kernel_revoke(allocator, cap);
+    assert(!error);
+
+    journal_forget_untyped(allocator, cap);
+    release_untyped(allocator, &origin, 0);
+    TRACE_END(allocator, ALLOCATOR_TRACE_FREE_UNTYPED, cap, size_bits,
+              0, 0, 0);
+}
+
+#ifdef CONFIG_KERNEL_STABLE
+/*
+ * Carve kernel objects out of arenas of 'arena_bits' bits at increasing
+ * offsets, rather than giving every object an untyped item of its own. Objects
+ * allocated this way cost one retype and one cap slot each, but the memory
+ * behind them only comes back when the allocator is reset.
+ *
+ * An 'arena_bits' of zero disables bump allocation again.
+ */
+void
+allocator_enable_bump_allocation(struct allocator *allocator,
+                                 unsigned long arena_bits)
+{
+    assert(arena_bits == 0 || arena_bits >= MIN_UNTYPED_SIZE);
+    assert(arena_bits <= MAX_UNTYPED_SIZE);
+
+    allocator->bump_arena_bits = arena_bits;
+    allocator->bump_arena.cap = 0;
+}
+#endif
+
+/*
+ * Reset the allocator back to its initial state.
+ *
+ * Any magazines in front of the allocator must have been drained first.
+ */
+void
+allocator_reset(struct allocator *allocator)
+{
+    TRACE_BEGIN(allocator);
+    allocator_reset_begin(allocator);
+    allocator_reset_continue(allocator, allocator->num_init_untyped_items);
+    TRACE_END(allocator, ALLOCATOR_TRACE_RESET, 0, 0, 0, 0, 0);
+}
+
+/*
+ * Start resetting the allocator back to its initial state, without destroying
+ * anything yet; allocator_reset_continue() does that a bit at a time.
+ *
+ * Everything allocated so far must be treated as gone from here on. Memory
+ * that was never used is available straight away, and each initial item
+ * becomes available again as it is recycled, so the allocator can be used as
+ * normal while the reset is under way. Cap slots that were in use only come
+ * back once it finishes, and the CSpace is not grown in the meantime.
+ *
+ * Beginning again while a reset is under way adds whatever was allocated
+ * since to the work still to do. As with allocator_reset(), magazines in
+ * front of the allocator must have been drained first.
+ */
+void
+allocator_reset_begin(struct allocator *allocator)
+{
+    struct init_untyped_item *item;
+    int i;
+
+    TRACE_BEGIN(allocator);
+
+    /* Nothing we split is of any use any more, so empty our pools. */
+    reset_splits(allocator);
+
+    /* Everything we have used needs recycling. */
+    for (i = 0; i < allocator->num_init_untyped_items; i++) {
+        item = &allocator->init_untyped_items[i];
+        item->is_split = 0;
+        if (!item->is_free && !item->is_stale) {
+            item->is_stale = 1;
+            allocator->reset_pending++;
+        }
+    }
+    allocator->reset_next = 0;
+
+    cslot_mark_stale(allocator);
+
+    /* Our bump arena is going along with everything else. */
+    allocator->bump_arena.cap = 0;
+
+    /* Nothing is left to release. */
+    journal_clear(allocator);
+    TRACE_END(allocator, ALLOCATOR_TRACE_RESET_BEGIN, 0, 0, 0, 0, 0);
+}
+
+/*
+ * Carry on with a reset started by allocator_reset_begin(), recycling up to
+ * 'budget' initial items. Once every item has been recycled, the cap slots
+ * that were in use are freed and the reset is finished.
+ *
+ * Returns the number of items still to be recycled, or zero once the reset is
+ * finished (or if there is none under way).
+ */
+int
+allocator_reset_continue(struct allocator *allocator, int budget)
+{
+    struct init_untyped_item *item;
+    int recycled = 0;
+    int error;
+    int i;
+    UNUSED_NDEBUG(error);
+
+    TRACE_BEGIN(allocator);
+
+    if (allocator->reset_next >= 0) {
+        for (i = allocator->reset_next; i < allocator->num_init_untyped_items
+                && allocator->reset_pending && recycled < budget; i++) {
+            item = &allocator->init_untyped_items[i];
+            if (!item->is_stale) {
+                continue;
+            }
+
+            /* Tear down any child objects created from it. */
+            error = kernel_recycle(allocator, item->cap);
+            assert(!error);
+            item->is_stale = 0;
+            allocator->reset_pending--;
+            recycled++;
+            init_item_push(allocator, i);
+        }
+        allocator->reset_next = i;
+
+        if (!allocator->reset_pending) {
+            cslot_release_stale(allocator);
+            allocator->reset_next = -1;
+        }
+    }
+
+    TRACE_END(allocator, ALLOCATOR_TRACE_RESET_CONTINUE, budget, 0, 0, 0,
+              allocator->reset_pending);
+    return allocator->reset_pending;
+}
+
+/*
+ * Reset the allocator, destroying all kernel objects previously created, but
+ * keeping untyped items that have been split as they are.
+ *
+ * Every item we handed out is returned to its pool, so a subsequent wave of
+ * allocations with the same profile is served without splitting anything.
+ * Only the cap slots holding split items remain in use. As with
+ * allocator_reset(), magazines in front of the allocator must have been
+ * drained first.
+ */
+void
+allocator_reset_warm(struct allocator *allocator)
+{
+    struct untyped_split *split;
+    int i, j;
+
+    TRACE_BEGIN(allocator);
+
+    /* Finish any reset that is under way first; that leaves nothing split
+     * to keep. */
+    if (allocator->reset_next >= 0) {
+        allocator_reset_continue(allocator, allocator->num_init_untyped_items);
+    }
+
+    /* Destroy everything created from items we handed out, and give the
+     * items back to their pools. */
+    reclaim_untyped(allocator, 1);
+
+    /* Only the slots holding our split items are still in use, including
+     * those in CNodes we added. */
+    cslot_reset(allocator);
+    for (i = 0; i < allocator->max_splits; i++) {
+        split = &allocator->splits[i];
+        if (!split->parent) {
+            continue;
+        }
+        if (!split->deleted) {
+            cslot_reserve(allocator, split->first, split->count);
+            continue;
+        }
+        for (j = 0; j < split->count; j++) {
+            if (!(split->deleted & (1UL << j))) {
+                cslot_reserve(allocator, split->first + j, 1);
+            }
+        }
+    }
+
+    /* Our bump arena has been handed back along with everything else. */
+    allocator->bump_arena.cap = 0;
+
+    journal_clear(allocator);
+    TRACE_END(allocator, ALLOCATOR_TRACE_RESET_WARM, 0, 0, 0, 0, 0);
+}
+
+/*
+ * Split our memory up ahead of time, so that there are at least
+ * 'profile[i].count' free items of 'profile[i].size_bits' bits in our pools
+ * for each of the 'num_sizes' entries of 'profile'. Allocations of those
+ * sizes are then served without splitting anything.
+ *
+ * This must be done before anything is allocated.
+ *
+ * Returns non-zero if we had the memory for all of it.
+ */
+int
+allocator_presplit(struct allocator *allocator,
+                   const struct untyped_profile *profile, int num_sizes)
+{
+    unsigned long j;
+    int ok = 1;
+    int i;
+
+    /* Carve out everything, then hand it straight back. Nothing has been
+     * created from the items, so there is nothing to revoke. */
+    for (i = 0; i < num_sizes && ok; i++) {
+        for (j = 0; j < profile[i].count; j++) {
+            if (!allocator_alloc_untyped(allocator, profile[i].size_bits)) {
+                ok = 0;
+                break;
+            }
+        }
+    }
+    reclaim_untyped(allocator, 0);
+    journal_clear(allocator);
+
+    return ok;
+}
+
+/*
+ * Set the number of free items of each size allocator_maintain() should keep
+ * in our pools: 'targets[i].count' items of 'targets[i].size_bits' bits for
+ * each of the 'num_sizes' entries of 'targets'. Other sizes have no target.
+ */
+void
+allocator_set_pool_targets(struct allocator *allocator,
+                           const struct untyped_profile *targets,
+                           int num_sizes)
+{
+    int i;
+
+    memset(allocator->pool_targets, 0, sizeof(allocator->pool_targets));
+    for (i = 0; i < num_sizes; i++) {
+        assert(targets[i].size_bits >= MIN_UNTYPED_SIZE);
+        assert(targets[i].size_bits <= MAX_UNTYPED_SIZE);
+        allocator->pool_targets[targets[i].size_bits - MIN_UNTYPED_SIZE] =
+            targets[i].count;
+    }
+}
+
+/*
+ * Count our free items of 'size_bits' bits.
+ */
+static unsigned long
+count_free_items(struct allocator *allocator, unsigned long size_bits)
+{
+    unsigned long count = 0;
+    int i;
+
+    for (i = 0; i < allocator->max_splits; i++) {
+        if (allocator->splits[i].parent
+                && allocator->splits[i].size_bits == size_bits) {
+            count += __builtin_popcountl(allocator->splits[i].free);
+        }
+    }
+    for (i = 0; i < allocator->num_init_untyped_items; i++) {
+        if (allocator->init_untyped_items[i].is_free
+                && allocator->init_untyped_items[i].size_bits == size_bits) {
+            count++;
+        }
+    }
+
+    return count;
+}
+
+/*
+ * Split memory up ahead of demand, to bring our pools up to the levels set
+ * by allocator_set_pool_targets(), so that allocations don't have to split
+ * things themselves. This is meant to be called when there is nothing better
+ * to do, such as from an idle loop.
+ *
+ * To keep each call short, we stop once we have made 'budget' splits (which
+ * may be overshot by finishing the item we are working on). Smaller sizes
+ * are refilled first.
+ *
+ * Returns the number of items still missing from our pools, which is zero
+ * once every pool is at its target.
+ */
+unsigned long
+allocator_maintain(struct allocator *allocator, int budget)
+{
+    struct untyped_origin origin;
+    struct untyped_split *split;
+    unsigned long size_bits;
+    unsigned long donor_bits;
+    unsigned long depth;
+    unsigned long have;
+    unsigned long missing = 0;
+    seL4_CPtr cap;
+    int small_region;
+    int spent = 0;
+
+    TRACE_BEGIN(allocator);
+    cslot_top_up(allocator, 0);
+
+    for (size_bits = MIN_UNTYPED_SIZE; size_bits <= MAX_UNTYPED_SIZE;
+            size_bits++) {
+        if (!allocator->pool_targets[size_bits - MIN_UNTYPED_SIZE]) {
+            continue;
+        }
+        have = count_free_items(allocator, size_bits);
+        while (have < allocator->pool_targets[size_bits - MIN_UNTYPED_SIZE]
+                && spent < budget && size_bits < MAX_UNTYPED_SIZE) {
+            /* Split something bigger down to this size, and put what we
+             * get back without merging anything. */
+            donor_bits = find_donor(allocator, size_bits, size_bits + 1, 0,
+                                    &small_region);
+            if (!donor_bits) {
+                break;
+            }
+            cap = take_untyped(allocator, donor_bits, small_region, &origin);
+            assert(cap);
+            cap = split_down(allocator, cap, &origin, donor_bits, size_bits,
+                             small_region, &depth);
+            if (!cap) {
+                break;
+            }
+            split = &allocator->splits[origin.split];
+            if (!split->free) {
+                pool_push(allocator, origin.split);
+            }
+            split->free |= 1UL << origin.index;
+
+            spent += depth;
+            have = count_free_items(allocator, size_bits);
+        }
+        if (have < allocator->pool_targets[size_bits - MIN_UNTYPED_SIZE]) {
+            missing += allocator->pool_targets[size_bits - MIN_UNTYPED_SIZE]
+                       - have;
+        }
+    }
+
+    TRACE_END(allocator, ALLOCATOR_TRACE_MAINTAIN, budget, 0, 0, 0, missing);
+    return missing;
+}
+
+/*
+ * Give every untyped item we have handed out back to its pool, without
+ * merging anything. If 'revoke' is set, first destroy everything created from
+ * the items.
+ *
+ * CNodes we have added to our CSpace are kept.
+ */
+static void
+reclaim_untyped(struct allocator *allocator, int revoke)
+{
+    struct untyped_split *split;
+    unsigned long handed_out;
+    int error;
+    int i, j;
+    UNUSED_NDEBUG(error);
+
+    for (i = 0; i < allocator->max_splits; i++) {
+        split = &allocator->splits[i];
+        if (!split->parent) {
+            continue;
+        }
+        handed_out = ((1UL << split->count) - 1) & ~split->free & ~split->split;
+        for (j = 0; j < split->count; j++) {
+            /* Keep the CNodes we have added to our CSpace. */
+            if ((handed_out & (1UL << j))
+                    && is_cspace_extension(allocator, split->first + j)) {
+                handed_out &= ~(1UL << j);
+            }
+        }
+        if (!handed_out) {
+            continue;
+        }
+        for (j = 0; revoke && j < split->count; j++) {
+            if (handed_out & (1UL << j)) {
+                error = kernel_revoke(allocator, split->first + j);
+                assert(!error);
+            }
+        }
+        if (!split->free) {
+            pool_push(allocator, i);
+        }
+        split->free |= handed_out;
+    }
+    for (i = 0; i < allocator->num_init_untyped_items; i++) {
+        if (allocator->init_untyped_items[i].is_free
+                || allocator->init_untyped_items[i].is_split
+                || is_cspace_extension(allocator,
+                                       allocator->init_untyped_items[i].cap)) {
+            continue;
+        }
+        if (revoke) {
+            error = kernel_revoke(allocator,
+                                  allocator->init_untyped_items[i].cap);
+            assert(!error);
+        }
+        init_item_push(allocator, i);
+    }
+}
+
+/*
+ * Destroy an allocator, releasing any resources held by it.
+ */
+void
+allocator_destroy(struct allocator *allocator)
+{
+    int i;
+
+    allocator_reset(allocator);
+
+    /* Give back anything we borrowed. */
+    for (i = 0; i < allocator->num_init_untyped_items; i++) {
+        if (allocator->init_untyped_items[i].is_borrowed) {
+            allocator_free_untyped(allocator->parent,
+                                   allocator->init_untyped_items[i].cap,
+                                   allocator->init_untyped_items[i].size_bits);
+        }
+    }
+    allocator->num_init_untyped_items = 0;
+    allocator->borrowed = 0;
+    allocator->untyped_sizes_available = 0;
+    for (i = 0; i < NUM_UNTYPED_SIZES; i++) {
+        allocator->init_untyped_free[i] = -1;
+    }
+}
+
+/*
+ * Allocate an object of the given type.
+ */
+
+/*
+ * Perform a simple test of the allocator. This test will reset the
+ * allocator's state.
+ */
+void
+allocator_self_test(struct allocator *allocator)
+{
+    seL4_CPtr x, y;
+    x = allocator_alloc_untyped(allocator, MIN_UNTYPED_SIZE);
+    allocator_reset(allocator);
+    y = allocator_alloc_untyped(allocator, MIN_UNTYPED_SIZE);
+    allocator_reset(allocator);
+    UNUSED_NDEBUG(x);
+    UNUSED_NDEBUG(y);
+    assert(x == y);
 }
@@ -0,0 +1,172 @@
+/*
+ * Copyright 2014, NICTA
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(NICTA_BSD)
+ */
+
+/*
+ * Cache colouring.
+ *
+ * Each page of memory has a colour, given by the bits of its physical
+ * address that pick which sets of the shared cache it is cached in. Each
+ * allocator may be restricted to a set of colours; giving the allocators of
+ * different clients disjoint sets keeps them from evicting each other's data
+ * from the cache.
+ *
+ * Coloured memory is found by looking at the physical address of each free
+ * item we have, and is then taken with allocator_alloc_untyped_at(), which
+ * splits whatever item it lies in.
+ */
+
+#include <autoconf.h>
+
+#ifdef CONFIG_LIB_SEL4_TWINKLE_CACHE_COLOURING
+
+#include <assert.h>
+
+#include <sel4/sel4.h>
+
+#include <twinkle/allocator.h>
+
+/*
+ * Return the bitmap of colours used by the 'size_bits' bits of memory at
+ * 'paddr', which is aligned to its size.
+ */
+static unsigned long
+colours_of(seL4_Word paddr, unsigned long size_bits)
+{
+    unsigned long n;
+
+    if (size_bits <= CACHE_COLOUR_SHIFT) {
+        return 1UL << CACHE_COLOUR(paddr);
+    }
+    if (size_bits - CACHE_COLOUR_SHIFT >= MAX_CACHE_COLOUR_BITS) {
+        return ALL_CACHE_COLOURS;
+    }
+    n = 1UL << (size_bits - CACHE_COLOUR_SHIFT);
+    if (n >= NUM_CACHE_COLOURS) {
+        return ALL_CACHE_COLOURS;
+    }
+    return ((1UL << n) - 1) << CACHE_COLOUR(paddr);
+}
+
+/*
+ * Find where in the free item of 'item_bits' bits at 'base' an item of
+ * 'size_bits' bits using only 'colours' could go.
+ *
+ * Returns non-zero if there is somewhere, and sets 'paddr' to it.
+ */
+static int
+find_in_item(seL4_Word base, unsigned long item_bits, unsigned long size_bits,
+             unsigned long colours, seL4_Word *paddr)
+{
+    unsigned long step_bits;
+    unsigned long steps;
+    unsigned long i;
+
+    /* The colours repeat every NUM_CACHE_COLOURS pages, so there is no need
+     * to look further than that. */
+    step_bits = size_bits > CACHE_COLOUR_SHIFT ? size_bits : CACHE_COLOUR_SHIFT;
+    if (step_bits > item_bits) {
+        step_bits = item_bits;
+    }
+    steps = NUM_CACHE_COLOURS;
+    if (item_bits - step_bits < MAX_CACHE_COLOUR_BITS
+            && (1UL << (item_bits - step_bits)) < steps) {
+        steps = 1UL << (item_bits - step_bits);
+    }
+
+    for (i = 0; i < steps; i++) {
+        *paddr = base + (i << step_bits);
+        if (!(colours_of(*paddr, size_bits) & ~colours)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Restrict the memory allocator_alloc_coloured_untyped() hands out to pages
+ * whose colours are set in the bitmap 'colours'. By default, any colour may
+ * be used.
+ */
+void
+allocator_set_colours(struct allocator *allocator, unsigned long colours)
+{
+    assert(colours & ALL_CACHE_COLOURS);
+    allocator->colours = colours & ALL_CACHE_COLOURS;
+}
+
+/*
+ * Allocate an untyped item of 'size_bits' bits whose pages all have colours
+ * allowed by allocator_set_colours(). We prefer to split the smallest free
+ * item that has such memory in it.
+ *
+ * Only memory whose physical address we know can be used, and lazy child
+ * allocators don't borrow from their parents for coloured allocations.
+ *
+ * Returns zero if we have no memory of those colours.
+ */
+seL4_CPtr
+allocator_alloc_coloured_untyped(struct allocator *allocator,
+                                 unsigned long size_bits)
+{
+    struct init_untyped_item *item;
+    struct untyped_split *split;
+    unsigned long best_bits = MAX_UNTYPED_SIZE + 1;
+    seL4_Word best = 0;
+    seL4_Word paddr;
+    unsigned long free;
+    int i, j;
+
+    if (size_bits < MIN_UNTYPED_SIZE || size_bits > MAX_UNTYPED_SIZE) {
+        return 0;
+    }
+
+    /* Children of splits. */
+    for (i = 0; i < allocator->max_splits && best_bits > size_bits; i++) {
+        split = &allocator->splits[i];
+        if (!split->parent || !split->free || split->paddr == UNKNOWN_PADDR
+                || split->size_bits < size_bits
+                || split->size_bits >= best_bits) {
+            continue;
+        }
+        for (free = split->free; free; free &= free - 1) {
+            j = __builtin_ctzl(free);
+            if (find_in_item(split->paddr + ((seL4_Word)j << split->size_bits),
+                             split->size_bits, size_bits, allocator->colours,
+                             &paddr)) {
+                best = paddr;
+                best_bits = split->size_bits;
+                break;
+            }
+        }
+    }
+
+    /* Initial items. */
+    for (i = 0; i < allocator->num_init_untyped_items
+            && best_bits > size_bits; i++) {
+        item = &allocator->init_untyped_items[i];
+        if (!item->is_free || item->paddr == UNKNOWN_PADDR
+                || item->size_bits < size_bits
+                || item->size_bits >= best_bits) {
+            continue;
+        }
+        if (find_in_item(item->paddr, item->size_bits, size_bits,
+                         allocator->colours, &paddr)) {
+            best = paddr;
+            best_bits = item->size_bits;
+        }
+    }
+
+    if (best_bits > MAX_UNTYPED_SIZE) {
+        return 0;
+    }
+    return allocator_alloc_untyped_at(allocator, best, size_bits);
+}
+
+#endif /* CONFIG_LIB_SEL4_TWINKLE_CACHE_COLOURING */
@@ -19,9 +19,18 @@
  *        found in (1) and the cap slots found in the root CNode.
  */
 
+#ifndef UNUSED_NDEBUG
+# ifdef NDEBUG
+#  define UNUSED_NDEBUG(x)  ((void)x)
+# else
+#  define UNUSED_NDEBUG(x)
+# endif
+#endif
+
 #include <stdio.h>
 #include <assert.h>
 
+#include <autoconf.h>
 #include <sel4/sel4.h>
 #include <sel4/bootinfo.h>
 #include <sel4/messages.h>
@@ -30,9 +39,25 @@
 #include <twinkle/object_allocator.h>
 #include <twinkle/bootstrap.h>
 
+/* The first-stage allocator, however it was created. Each way of creating it
+ * starts it again from scratch, using the same storage. */
+static struct allocator first_stage_allocator;
+
+/* Enough initial items for every untyped item bootinfo can describe. */
+#define BOOT_UNTYPED_ITEMS \
+    (sizeof(((seL4_BootInfo *)0)->untypedSizeBitsList) \
+     / sizeof(((seL4_BootInfo *)0)->untypedSizeBitsList[0]))
+
+/* Enough cap slots for every free slot of the root CNode. */
+#define BOOT_CSLOTS (1UL << CONFIG_ROOT_CNODE_SIZE_BITS)
+
 /*
  * Fill the given allocator with resources from the given
  * bootinfo structure.
+ *
+ * Each item goes straight onto the free list for its size. Items of sizes we
+ * can't manage, or beyond the number of items we can keep track of, are
+ * ignored.
  */
 static void
 fill_allocator_with_resources(struct allocator *allocator,
@@ -41,25 +66,47 @@ fill_allocator_with_resources(struct allocator *allocator,
     int i;
 
     for (i = 0; i < bootinfo->untyped.end - bootinfo->untyped.start; i++) {
-        allocator_add_root_untyped_item(
+        if (bootinfo->untypedSizeBitsList[i] < MIN_UNTYPED_SIZE
+                || bootinfo->untypedSizeBitsList[i] > MAX_UNTYPED_SIZE) {
+            continue;
+        }
+        if (allocator->num_init_untyped_items
+                == allocator->max_init_untyped_items) {
+            break;
+        }
+        allocator_add_root_untyped_item_paddr(
             allocator,
             bootinfo->untyped.start + i,
-            bootinfo->untypedSizeBitsList[i]
+            bootinfo->untypedSizeBitsList[i],
+            bootinfo->untypedPaddrList[i]
         );
     }
 }
 
 /*
- * Create an object allocator managing the root CNode's free slots
+ * Create an object allocator managing the root CNode's free slots, without
+ * any memory.
  */
 static void
-create_bootstrap_allocator(struct allocator *allocator)
+create_empty_allocator(struct allocator *allocator, seL4_BootInfo *bootinfo)
 {
-    /* Fetch seL4 bootinfo. */
-    seL4_BootInfo *bootinfo = seL4_GetBootInfo();
+    static struct init_untyped_item items[BOOT_UNTYPED_ITEMS];
+    static struct untyped_split splits[CONFIG_LIB_SEL4_TWINKLE_BOOT_SPLITS];
+    static seL4_Word cslot_words[CSLOT_STORAGE_WORDS(BOOT_CSLOTS)];
+    static struct journal_entry journal[MAX_JOURNAL_ENTRIES];
+    struct allocator_storage storage;
+    int error;
+    UNUSED_NDEBUG(error);
 
-    /* Create the allocator. */
-    allocator_create(
+    storage.items = items;
+    storage.max_items = BOOT_UNTYPED_ITEMS;
+    storage.splits = splits;
+    storage.max_splits = CONFIG_LIB_SEL4_TWINKLE_BOOT_SPLITS;
+    storage.cslot_words = cslot_words;
+    storage.max_cslots = BOOT_CSLOTS;
+    storage.journal = journal;
+    storage.max_journal_entries = MAX_JOURNAL_ENTRIES;
+    error = allocator_create_with_storage(
         allocator,
         seL4_CapInitThreadCNode,
         seL4_WordBits,
@@ -67,16 +114,38 @@ create_bootstrap_allocator(struct allocator *allocator)
         bootinfo->empty.start,
         bootinfo->empty.end - bootinfo->empty.start,
         NULL,
-        0
+        0,
+        &storage
     );
+    assert(!error);
+}
+
+/*
+ * Create an object allocator managing the root CNode's free slots, and split
+ * its memory up according to 'profile' (if not NULL).
+ */
+static void
+create_bootstrap_allocator(struct allocator *allocator,
+                           const struct untyped_profile *profile,
+                           int num_sizes)
+{
+    /* Fetch seL4 bootinfo. */
+    seL4_BootInfo *bootinfo = seL4_GetBootInfo();
+
+    /* Create the allocator. */
+    create_empty_allocator(allocator, bootinfo);
 
     /* Give the allocator all of our free memory. */
     fill_allocator_with_resources(allocator, bootinfo);
 
-#ifdef CONFIG_DEBUG_BUILD
+#ifdef CONFIG_LIB_SEL4_TWINKLE_SELF_TEST
     /* Test out everything. */
     allocator_self_test(allocator);
 #endif
+
+    if (profile) {
+        allocator_presplit(allocator, profile, num_sizes);
+    }
 }
 
 /*
@@ -84,10 +153,34 @@ create_bootstrap_allocator(struct allocator *allocator)
  */
 struct allocator *
 create_first_stage_allocator(void) {
-    static struct allocator allocator;
+    return create_first_stage_allocator_presplit(NULL, 0);
+}
+
+/*
+ * Create first-stage allocator, with its memory split up ahead of time so
+ * that the allocations described by 'profile' need no splitting (see
+ * allocator_presplit()).
+ */
+struct allocator *
+create_first_stage_allocator_presplit(const struct untyped_profile *profile,
+                                      int num_sizes) {
+    create_bootstrap_allocator(&first_stage_allocator, profile, num_sizes);
+
+    return &first_stage_allocator;
+}
 
-    create_bootstrap_allocator(&allocator);
-    allocator_self_test(&allocator);
+/*
+ * Create first-stage allocator from state saved with allocator_serialize()
+ * by an earlier run, for restarting without the CSpace being torn down. If
+ * the state can't be restored, the allocator is set up from bootinfo as
+ * usual.
+ */
+struct allocator *
+create_first_stage_allocator_restore(const void *buffer, unsigned long size) {
+    create_empty_allocator(&first_stage_allocator, seL4_GetBootInfo());
+    if (allocator_restore(&first_stage_allocator, buffer, size)) {
+        create_bootstrap_allocator(&first_stage_allocator, NULL, 0);
+    }
 
-    return &allocator;
+    return &first_stage_allocator;
 }
@@ -0,0 +1,326 @@
+/*
+ * Copyright 2014, NICTA
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(NICTA_BSD)
+ */
+
+/*
+ * Scoped allocation.
+ *
+ * allocator_mark() starts a scope, and allocator_release() frees everything
+ * allocated in it: untyped items (destroying the objects created from them)
+ * and cap slots (deleting whatever caps are left in them). Scopes nest like
+ * a stack.
+ *
+ * While any mark is outstanding, every untyped item and cap slot handed out
+ * is recorded in a journal, and struck off again if it is freed. Memory the
+ * allocator uses for itself, such as split items and CNodes added to grow
+ * its CSpace, is never journalled.
+ *
+ * The journal lives in storage given when the allocator is created. When it
+ * fills up we compact it, dropping entries for things freed since and
+ * merging runs of cap slots handed out in the same scope, before refusing
+ * further allocations.
+ */
+
+#ifndef UNUSED_NDEBUG
+# ifdef NDEBUG
+#  define UNUSED_NDEBUG(x)  ((void)x)
+# else
+#  define UNUSED_NDEBUG(x)
+# endif
+#endif
+
+#include <assert.h>
+#include <string.h>
+
+#include <sel4/sel4.h>
+
+#include <twinkle/allocator.h>
+
+#include "journal.h"
+#include "kernel.h"
+
+/*
+ * Squeeze the journal up, dropping entries that have been freed and merging
+ * entries for adjacent cap slots in the same scope. Slots are only ever
+ * merged into an earlier entry, so they are still deleted after the objects
+ * in them are destroyed.
+ */
+static void
+journal_compact(struct allocator *allocator)
+{
+    struct journal_entry *entry, *slots;
+    int i, len, m;
+
+    len = 0;
+    slots = NULL;
+    m = 0;
+    for (i = 0; i < allocator->journal_len; i++) {
+        /* Entries never move back past the start of their scope. */
+        for (; m < allocator->num_marks && allocator->marks[m] == i; m++) {
+            allocator->marks[m] = len;
+            slots = NULL;
+        }
+
+        entry = &allocator->journal[i];
+        if (!entry->first) {
+            continue;
+        }
+        if (entry->count && slots
+                && entry->first == slots->first + slots->count) {
+            slots->count += entry->count;
+            continue;
+        }
+        if (entry->count && slots
+                && entry->first + entry->count == slots->first) {
+            slots->first = entry->first;
+            slots->count += entry->count;
+            continue;
+        }
+
+        allocator->journal[len] = *entry;
+        if (entry->count) {
+            slots = &allocator->journal[len];
+        }
+        len++;
+    }
+    for (; m < allocator->num_marks; m++) {
+        allocator->marks[m] = len;
+    }
+    allocator->journal_len = len;
+}
+
+/*
+ * Return non-zero if we have room to journal another allocation.
+ */
+int
+journal_has_room(struct allocator *allocator)
+{
+    if (!allocator->num_marks
+            || allocator->journal_len < allocator->max_journal_entries) {
+        return 1;
+    }
+    journal_compact(allocator);
+    return allocator->journal_len < allocator->max_journal_entries;
+}
+
+/*
+ * Append an entry to the journal.
+ */
+static void
+journal_append(struct allocator *allocator, seL4_CPtr first,
+               unsigned long size_bits, unsigned long count)
+{
+    struct journal_entry *entry;
+
+    if (!allocator->num_marks || allocator->cspace_growing) {
+        return;
+    }
+    assert(allocator->journal_len < allocator->max_journal_entries);
+
+    entry = &allocator->journal[allocator->journal_len++];
+    entry->first = first;
+    entry->size_bits = size_bits;
+    entry->count = count;
+}
+
+/*
+ * Record that the untyped item 'cap' of 'size_bits' bits has been handed out.
+ */
+void
+journal_add_untyped(struct allocator *allocator, seL4_CPtr cap,
+                    unsigned long size_bits)
+{
+    journal_append(allocator, cap, size_bits, 0);
+}
+
+/*
+ * Record that 'count' cap slots starting at 'first' have been handed out.
+ */
+void
+journal_add_slots(struct allocator *allocator, seL4_CPtr first,
+                  unsigned long count)
+{
+    journal_append(allocator, first, 0, count);
+}
+
+/*
+ * Strike the untyped item 'cap' off the journal, as it has been freed.
+ */
+void
+journal_forget_untyped(struct allocator *allocator, seL4_CPtr cap)
+{
+    int i;
+
+    for (i = allocator->journal_len - 1; i >= 0; i--) {
+        if (!allocator->journal[i].count && allocator->journal[i].first == cap) {
+            allocator->journal[i].first = 0;
+            return;
+        }
+    }
+}
+
+/*
+ * Strike 'count' cap slots starting at 'first' off the journal, as they have
+ * been freed.
+ */
+void
+journal_forget_slots(struct allocator *allocator, seL4_CPtr first,
+                     unsigned long count)
+{
+    struct journal_entry *entry;
+    unsigned long left, right;
+    int i, m;
+
+    /* We may need room to split an entry in two. */
+    if (allocator->num_marks
+            && allocator->journal_len == allocator->max_journal_entries) {
+        journal_compact(allocator);
+    }
+
+    for (i = allocator->journal_len - 1; i >= 0; i--) {
+        entry = &allocator->journal[i];
+        if (entry->count && entry->first && first >= entry->first
+                && first < entry->first + entry->count) {
+            break;
+        }
+    }
+    if (i < 0) {
+        /* Handed out before the oldest mark. */
+        return;
+    }
+    assert(first + count <= entry->first + entry->count);
+
+    /* Keep whatever is left on either side of the slots freed. */
+    left = first - entry->first;
+    right = entry->first + entry->count - (first + count);
+    if (!left && !right) {
+        entry->first = 0;
+    } else if (!left) {
+        entry->first = first + count;
+        entry->count = right;
+    } else {
+        entry->count = left;
+        if (right) {
+            /* The right-hand side needs an entry of its own, in the same
+             * scope. If the journal is full, it stays allocated until the
+             * allocator is reset. */
+            if (allocator->journal_len == allocator->max_journal_entries) {
+                return;
+            }
+            memmove(&allocator->journal[i + 2], &allocator->journal[i + 1],
+                    (allocator->journal_len - i - 1) * sizeof(*entry));
+            allocator->journal_len++;
+            allocator->journal[i + 1].first = first + count;
+            allocator->journal[i + 1].size_bits = 0;
+            allocator->journal[i + 1].count = right;
+            for (m = 0; m < allocator->num_marks; m++) {
+                if (allocator->marks[m] > i) {
+                    allocator->marks[m]++;
+                }
+            }
+        }
+    }
+}
+
+/*
+ * Forget all marks, and everything journalled.
+ */
+void
+journal_clear(struct allocator *allocator)
+{
+    allocator->num_marks = 0;
+    allocator->journal_len = 0;
+}
+
+/*
+ * Start a new scope of allocations.
+ *
+ * Magazines in front of the allocator (see magazine.h) hide what they cache
+ * from the journal, so they must be drained with magazine_drain() before a
+ * mark is made, and again before it is released.
+ *
+ * Returns a token to pass to allocator_release(), or -1 if marks are nested
+ * too deeply.
+ */
+int
+allocator_mark(struct allocator *allocator)
+{
+    if (allocator->num_marks == MAX_ALLOCATOR_MARKS) {
+        return -1;
+    }
+
+    allocator->marks[allocator->num_marks] = allocator->journal_len;
+    return allocator->num_marks++;
+}
+
+/*
+ * End the scope started by 'mark', the innermost one, without freeing
+ * anything; what was allocated in it now belongs to the enclosing scope, if
+ * there is one.
+ */
+void
+journal_commit(struct allocator *allocator, int mark)
+{
+    assert(mark == allocator->num_marks - 1);
+
+    allocator->num_marks = mark;
+    if (!allocator->num_marks) {
+        allocator->journal_len = 0;
+    }
+}
+
+/*
+ * Free every untyped item and cap slot handed out since 'mark' was returned
+ * by allocator_mark() and not freed since, destroying the objects created
+ * from them. Any marks made after 'mark' are released too.
+ *
+ * Untyped items split to serve the scope are merged back lazily as usual, so
+ * a scope that is used over and over again keeps its pools warm.
+ *
+ * Any magazines in front of the allocator must have been drained first, or
+ * they may be left holding items we have just freed.
+ */
+void
+allocator_release(struct allocator *allocator, int mark)
+{
+    struct journal_entry *entry;
+    unsigned long j;
+    int end;
+    int i;
+    int error;
+    UNUSED_NDEBUG(error);
+
+    assert(mark >= 0 && mark < allocator->num_marks);
+
+    /* Cut the journal short first, so freeing things doesn't touch it. */
+    end = allocator->journal_len;
+    allocator->journal_len = allocator->marks[mark];
+    allocator->num_marks = mark;
+
+    /* Free things in the opposite order to how they were allocated, so that
+     * objects are destroyed before the slots holding them are deleted. */
+    for (i = end - 1; i >= allocator->journal_len; i--) {
+        entry = &allocator->journal[i];
+        if (!entry->first) {
+            continue;
+        }
+        if (!entry->count) {
+            if (allocator->bump_arena.cap == entry->first) {
+                allocator->bump_arena.cap = 0;
+            }
+            allocator_free_untyped(allocator, entry->first, entry->size_bits);
+        } else {
+            for (j = 0; j < entry->count; j++) {
+                error = kernel_delete(allocator, entry->first + j);
+                assert(!error);
+            }
+            allocator_free_cslots(allocator, entry->first, entry->count);
+        }
+    }
+}
@@ -0,0 +1,48 @@
+/*
+ * Copyright 2014, NICTA
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(NICTA_BSD)
+ */
+
+/*
+ * Journal of allocations made while a mark is outstanding, so that
+ * allocator_release() knows what to free. Everything here does nothing when
+ * there are no marks.
+ */
+
+#ifndef TWINKLE_JOURNAL_H
+#define TWINKLE_JOURNAL_H
+
+#include <sel4/sel4.h>
+
+#include <twinkle/allocator.h>
+
+int
+journal_has_room(struct allocator *allocator);
+
+void
+journal_add_untyped(struct allocator *allocator, seL4_CPtr cap,
+                    unsigned long size_bits);
+
+void
+journal_add_slots(struct allocator *allocator, seL4_CPtr first,
+                  unsigned long count);
+
+void
+journal_forget_untyped(struct allocator *allocator, seL4_CPtr cap);
+
+void
+journal_forget_slots(struct allocator *allocator, seL4_CPtr first,
+                     unsigned long count);
+
+void
+journal_clear(struct allocator *allocator);
+
+void
+journal_commit(struct allocator *allocator, int mark);
+
+#endif /* TWINKLE_JOURNAL_H */
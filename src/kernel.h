@@ -0,0 +1,147 @@
+/*
+ * Copyright 2014, NICTA
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(NICTA_BSD)
+ */
+
+/*
+ * Kernel invocations made by the allocator.
+ *
+ * Every seL4 system call made by twinkle goes through one of these wrappers,
+ * so this is the only place that needs to know about differences between
+ * kernel versions, and the only interface a simulated kernel needs to
+ * provide.
+ */
+
+#ifndef TWINKLE_KERNEL_H
+#define TWINKLE_KERNEL_H
+
+#include <assert.h>
+
+#include <autoconf.h>
+#include <sel4/sel4.h>
+
+#include <twinkle/allocator.h>
+
+#include "stats.h"
+#include "trace.h"
+
+/*
+ * Retype 'num_items' objects out of 'untyped' into consecutive slots of a
+ * CNode, starting at the slot described by 'dest'.
+ *
+ * On the stable kernel, objects are placed 'offset' bytes into the untyped
+ * item. Other kernels always place them at the untyped item's own watermark,
+ * so 'offset' must be zero.
+ */
+static inline int
+kernel_untyped_retype(struct allocator *allocator, seL4_CPtr untyped,
+                      seL4_Word item_type, seL4_Word item_size,
+                      seL4_Word offset, struct cslot_path *dest, int num_items)
+{
+    STATS_INC(allocator, retypes);
+    TRACE_SYSCALL(allocator);
+#ifdef CONFIG_KERNEL_STABLE
+    return seL4_Untyped_RetypeAtOffset(untyped,
+                                       item_type, offset, item_size,
+                                       seL4_CapInitThreadCNode,
+                                       dest->cnode, dest->depth,
+                                       dest->offset, num_items);
+#else
+    assert(offset == 0);
+    return seL4_Untyped_Retype(untyped,
+                               item_type, item_size,
+                               seL4_CapInitThreadCNode,
+                               dest->cnode, dest->depth,
+                               dest->offset, num_items);
+#endif
+}
+
+/*
+ * Delete every cap derived from 'cap'.
+ */
+static inline int
+kernel_revoke(struct allocator *allocator, seL4_CPtr cap)
+{
+    STATS_INC(allocator, revokes);
+    TRACE_SYSCALL(allocator);
+    return seL4_CNode_Revoke(seL4_CapInitThreadCNode, cap, seL4_WordBits);
+}
+
+/*
+ * Delete the cap in slot 'cap'.
+ */
+static inline int
+kernel_delete(struct allocator *allocator, seL4_CPtr cap)
+{
+    STATS_INC(allocator, deletes);
+    TRACE_SYSCALL(allocator);
+    return seL4_CNode_Delete(seL4_CapInitThreadCNode, cap, seL4_WordBits);
+}
+
+/*
+ * Delete every cap derived from 'cap', and return the object it refers to to
+ * its initial state.
+ */
+static inline int
+kernel_recycle(struct allocator *allocator, seL4_CPtr cap)
+{
+    STATS_INC(allocator, recycles);
+    TRACE_SYSCALL(allocator);
+    return seL4_CNode_Recycle(seL4_CapInitThreadCNode, cap, seL4_WordBits);
+}
+
+#if defined(CONFIG_ARCH_ARM)
+/*
+ * Map the frame 'page' into the address space 'vspace' at 'vaddr'.
+ */
+static inline int
+kernel_page_map(struct allocator *allocator, seL4_CPtr page, seL4_CPtr vspace,
+                seL4_Word vaddr, seL4_CapRights rights)
+{
+    STATS_INC(allocator, maps);
+    TRACE_SYSCALL(allocator);
+    return seL4_ARM_Page_Map(page, vspace, vaddr, rights,
+                             seL4_ARM_Default_VMAttributes);
+}
+
+/*
+ * Map the page table 'table' into the address space 'vspace', covering
+ * 'vaddr'.
+ */
+static inline int
+kernel_page_table_map(struct allocator *allocator, seL4_CPtr table,
+                      seL4_CPtr vspace, seL4_Word vaddr)
+{
+    STATS_INC(allocator, maps);
+    TRACE_SYSCALL(allocator);
+    return seL4_ARM_PageTable_Map(table, vspace, vaddr,
+                                  seL4_ARM_Default_VMAttributes);
+}
+#elif defined(CONFIG_ARCH_IA32)
+static inline int
+kernel_page_map(struct allocator *allocator, seL4_CPtr page, seL4_CPtr vspace,
+                seL4_Word vaddr, seL4_CapRights rights)
+{
+    STATS_INC(allocator, maps);
+    TRACE_SYSCALL(allocator);
+    return seL4_IA32_Page_Map(page, vspace, vaddr, rights,
+                              seL4_IA32_Default_VMAttributes);
+}
+
+static inline int
+kernel_page_table_map(struct allocator *allocator, seL4_CPtr table,
+                      seL4_CPtr vspace, seL4_Word vaddr)
+{
+    STATS_INC(allocator, maps);
+    TRACE_SYSCALL(allocator);
+    return seL4_IA32_PageTable_Map(table, vspace, vaddr,
+                                   seL4_IA32_Default_VMAttributes);
+}
+#endif
+
+#endif /* TWINKLE_KERNEL_H */
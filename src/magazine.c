@@ -0,0 +1,203 @@
+/*
+ * Copyright 2014, NICTA
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(NICTA_BSD)
+ */
+
+/*
+ * Per-thread allocator front-ends.
+ *
+ * The allocator itself is not thread-safe. To share one between threads,
+ * each thread (or core) is given a magazine: a small cache of untyped items
+ * and cap slots that it allocates from without any synchronisation. When a
+ * magazine runs dry it takes the shared allocator's lock and refills half of
+ * itself in one go; when it overflows, it gives half back the same way.
+ */
+
+#include <assert.h>
+
+#include <sel4/sel4.h>
+
+#include <twinkle/allocator.h>
+#include <twinkle/magazine.h>
+
+/* Number of items moved between a magazine and its allocator at once. */
+#define MAGAZINE_BATCH (MAGAZINE_SIZE / 2)
+
+/*
+ * Initialise a lock.
+ */
+void
+allocator_lock_init(struct allocator_lock *lock)
+{
+    __atomic_clear(&lock->held, __ATOMIC_RELEASE);
+}
+
+/*
+ * Acquire a lock, yielding to other threads while it is held.
+ */
+void
+allocator_lock_acquire(struct allocator_lock *lock)
+{
+    while (__atomic_test_and_set(&lock->held, __ATOMIC_ACQUIRE)) {
+        seL4_Yield();
+    }
+}
+
+/*
+ * Release a lock.
+ */
+void
+allocator_lock_release(struct allocator_lock *lock)
+{
+    __atomic_clear(&lock->held, __ATOMIC_RELEASE);
+}
+
+/*
+ * Initialise an empty magazine in front of the shared allocator
+ * 'allocator', which is protected by 'lock'.
+ */
+void
+magazine_init(struct allocator_magazine *magazine,
+              struct allocator *allocator, struct allocator_lock *lock)
+{
+    int i;
+
+    magazine->allocator = allocator;
+    magazine->lock = lock;
+    for (i = 0; i <= MAGAZINE_MAX_UNTYPED_SIZE - MIN_UNTYPED_SIZE; i++) {
+        magazine->num_untyped[i] = 0;
+    }
+    magazine->num_cslots = 0;
+}
+
+/*
+ * Allocate an untyped item of 'size_bits' bits.
+ */
+seL4_CPtr
+magazine_alloc_untyped(struct allocator_magazine *magazine,
+                       unsigned long size_bits)
+{
+    seL4_CPtr result;
+    seL4_CPtr *cache;
+    int *count;
+
+    /* We don't cache big items; go straight to the shared allocator. */
+    if (size_bits < MIN_UNTYPED_SIZE || size_bits > MAGAZINE_MAX_UNTYPED_SIZE) {
+        allocator_lock_acquire(magazine->lock);
+        result = allocator_alloc_untyped(magazine->allocator, size_bits);
+        allocator_lock_release(magazine->lock);
+        return result;
+    }
+
+    cache = magazine->untyped[size_bits - MIN_UNTYPED_SIZE];
+    count = &magazine->num_untyped[size_bits - MIN_UNTYPED_SIZE];
+
+    /* Refill if we have run dry. */
+    if (!*count) {
+        allocator_lock_acquire(magazine->lock);
+        while (*count < MAGAZINE_BATCH) {
+            result = allocator_alloc_untyped(magazine->allocator, size_bits);
+            if (!result) {
+                break;
+            }
+            cache[(*count)++] = result;
+        }
+        allocator_lock_release(magazine->lock);
+        if (!*count) {
+            return 0;
+        }
+    }
+
+    return cache[--(*count)];
+}
+
+/*
+ * Free an untyped item of 'size_bits' bits, destroying any objects created
+ * from it.
+ *
+ * Items go straight back to the shared allocator, which revokes them and may
+ * merge them with their neighbours.
+ */
+void
+magazine_free_untyped(struct allocator_magazine *magazine, seL4_CPtr cap,
+                      unsigned long size_bits)
+{
+    allocator_lock_acquire(magazine->lock);
+    allocator_free_untyped(magazine->allocator, cap, size_bits);
+    allocator_lock_release(magazine->lock);
+}
+
+/*
+ * Allocate an empty cslot.
+ */
+seL4_CPtr
+magazine_alloc_cslot(struct allocator_magazine *magazine)
+{
+    seL4_CPtr slot;
+
+    /* Refill if we have run dry. */
+    if (!magazine->num_cslots) {
+        allocator_lock_acquire(magazine->lock);
+        while (magazine->num_cslots < MAGAZINE_BATCH) {
+            slot = allocator_alloc_cslot(magazine->allocator);
+            if (!slot) {
+                break;
+            }
+            magazine->cslots[magazine->num_cslots++] = slot;
+        }
+        allocator_lock_release(magazine->lock);
+        if (!magazine->num_cslots) {
+            return 0;
+        }
+    }
+
+    return magazine->cslots[--magazine->num_cslots];
+}
+
+/*
+ * Free an empty cslot.
+ */
+void
+magazine_free_cslot(struct allocator_magazine *magazine, seL4_CPtr slot)
+{
+    /* If we are full, give half of our slots back. */
+    if (magazine->num_cslots == MAGAZINE_SIZE) {
+        allocator_lock_acquire(magazine->lock);
+        while (magazine->num_cslots > MAGAZINE_BATCH) {
+            allocator_free_cslot(magazine->allocator,
+                                 magazine->cslots[--magazine->num_cslots]);
+        }
+        allocator_lock_release(magazine->lock);
+    }
+
+    magazine->cslots[magazine->num_cslots++] = slot;
+}
+
+/*
+ * Return everything cached in the magazine to the shared allocator. This must
+ * be done before the shared allocator is reset.
+ */
+void
+magazine_drain(struct allocator_magazine *magazine)
+{
+    int i;
+
+    allocator_lock_acquire(magazine->lock);
+    for (i = 0; i <= MAGAZINE_MAX_UNTYPED_SIZE - MIN_UNTYPED_SIZE; i++) {
+        while (magazine->num_untyped[i]) {
+            allocator_free_untyped(magazine->allocator,
+                                   magazine->untyped[i][--magazine->num_untyped[i]],
+                                   i + MIN_UNTYPED_SIZE);
+        }
+    }
+    while (magazine->num_cslots) {
+        allocator_free_cslot(magazine->allocator,
+                             magazine->cslots[--magazine->num_cslots]);
+    }
+    allocator_lock_release(magazine->lock);
+}
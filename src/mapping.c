@@ -0,0 +1,223 @@
+/*
+ * Copyright 2014, NICTA
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(NICTA_BSD)
+ */
+
+/*
+ * Mapped memory.
+ *
+ * Backs a range of virtual memory with new frames, using the biggest pages
+ * that the range's alignment and our free memory allow, so that large
+ * buffers take fewer frames, mappings and TLB entries. Frames of each size
+ * are allocated in batches, and page tables are created as they are needed.
+ */
+
+#include <autoconf.h>
+
+#if defined(CONFIG_ARCH_ARM) || defined(CONFIG_ARCH_IA32)
+
+#include <assert.h>
+
+#include <sel4/sel4.h>
+
+#include <twinkle/allocator.h>
+#include <twinkle/object_allocator.h>
+#include <twinkle/mapping.h>
+
+#include "journal.h"
+#include "kernel.h"
+
+/* Most frames allocated at once. */
+#define MAPPING_BATCH 64
+
+/* A size of page we can map. */
+struct page_size {
+    seL4_Word type;
+    unsigned long size_bits;
+    /* Whether the page goes in a page table, rather than straight into the
+     * page directory. */
+    int needs_table;
+};
+
+/* Page sizes, biggest first, and the page tables small pages go in, each of
+ * which covers 2^PAGE_TABLE_SPAN_BITS bytes. */
+#if defined(CONFIG_ARCH_ARM)
+static const struct page_size page_sizes[] = {
+    {seL4_ARM_SuperSectionObject, seL4_SuperSectionBits, 0},
+    {seL4_ARM_SectionObject, seL4_SectionBits, 0},
+    {seL4_ARM_LargePageObject, seL4_LargePageBits, 1},
+    {seL4_ARM_SmallPageObject, seL4_PageBits, 1},
+};
+#define PAGE_TABLE_TYPE seL4_ARM_PageTableObject
+#define PAGE_TABLE_SPAN_BITS seL4_SectionBits
+#else
+static const struct page_size page_sizes[] = {
+    {seL4_IA32_4M, seL4_LargePageBits, 0},
+    {seL4_IA32_4K, seL4_PageBits, 1},
+};
+#define PAGE_TABLE_TYPE seL4_IA32_PageTableObject
+#define PAGE_TABLE_SPAN_BITS seL4_LargePageBits
+#endif
+
+#define NUM_PAGE_SIZES (sizeof(page_sizes) / sizeof(page_sizes[0]))
+
+/*
+ * Allocate up to 'num_pages' frames of size 'page' into consecutive cap
+ * slots, setting 'frames' to them.
+ *
+ * Returns the number of frames allocated.
+ */
+static int
+alloc_frames(struct allocator *allocator, const struct page_size *page,
+             int num_pages, struct cap_range *frames)
+{
+#ifdef CONFIG_LIB_SEL4_TWINKLE_CACHE_COLOURING
+    /* Frames of the colours we may use come in runs as long as the colours
+     * allow. */
+    if (allocator->colours != ALL_CACHE_COLOURS) {
+        return allocator_alloc_coloured_kobjects(allocator, page->type, 0,
+                                                 num_pages, frames);
+    }
+#endif
+
+    return allocator_alloc_kobjects(allocator, page->type, 0, num_pages,
+                                    frames);
+}
+
+/*
+ * Map the frame 'page' into 'vspace' at 'vaddr', first creating a page table
+ * for it if it needs one and there isn't one there already.
+ *
+ * Returns 0 on success. On failure, a page table we created is left for our
+ * caller to free along with the rest of the region.
+ */
+static int
+map_page(struct allocator *allocator, seL4_CPtr vspace, seL4_CPtr page,
+         seL4_Word vaddr, seL4_CapRights rights, int needs_table)
+{
+    seL4_CPtr table;
+    int error;
+
+    error = kernel_page_map(allocator, page, vspace, vaddr, rights);
+    if (error != seL4_FailedLookup || !needs_table) {
+        return error;
+    }
+
+    table = allocator_alloc_kobject(allocator, PAGE_TABLE_TYPE, 0);
+    if (!table) {
+        return -1;
+    }
+    error = kernel_page_table_map(allocator, table, vspace,
+                                  vaddr & ~((1UL << PAGE_TABLE_SPAN_BITS) - 1));
+    if (error) {
+        return error;
+    }
+
+    return kernel_page_map(allocator, page, vspace, vaddr, rights);
+}
+
+/*
+ * Allocate frames for the 'bytes' bytes of virtual memory at 'vaddr' in the
+ * address space 'vspace', and map them there with the given rights. Both
+ * 'vaddr' and 'bytes' must be multiples of the smallest page size.
+ *
+ * Each part of the range gets the biggest page that is aligned and fits in
+ * it, falling back to smaller pages if we don't have the memory for big
+ * ones. Page tables are allocated from the same allocator as needed. With
+ * cache colouring, the frames only use the allocator's colours (see
+ * allocator_set_colours()).
+ *
+ * The caps to the frames and page tables are kept in our cap slots, and not
+ * returned; to free them again, allocate the region inside an
+ * allocator_mark() scope. If we fail part way through, everything we
+ * allocated is freed again, which also unmaps the pages already mapped, and
+ * the region is left as it was.
+ *
+ * Returns 0 on success.
+ */
+int
+allocator_alloc_mapped_region(struct allocator *allocator, seL4_CPtr vspace,
+                              seL4_Word vaddr, seL4_Word bytes,
+                              seL4_CapRights rights)
+{
+    const struct page_size *page;
+    struct cap_range frames;
+    seL4_Word end = vaddr + bytes;
+    seL4_Word limit;
+    seL4_Word bigger;
+    unsigned long first_size = 0;
+    unsigned long size;
+    int num_pages;
+    int created;
+    int error = 0;
+    int mark;
+    int i;
+
+    assert(!(vaddr & ((1UL << seL4_PageBits) - 1)));
+    assert(!(bytes & ((1UL << seL4_PageBits) - 1)));
+
+    /* Everything is allocated in a scope of its own, so that it can all be
+     * freed again if we fail. */
+    mark = allocator_mark(allocator);
+    if (mark < 0) {
+        return -1;
+    }
+
+    while (vaddr < end && !error) {
+        /* Use the biggest page that is aligned and fits. */
+        for (size = first_size; size < NUM_PAGE_SIZES - 1; size++) {
+            if (!(vaddr & ((1UL << page_sizes[size].size_bits) - 1))
+                    && end - vaddr >= (1UL << page_sizes[size].size_bits)) {
+                break;
+            }
+        }
+        page = &page_sizes[size];
+
+        /* Keep using pages this size until we get to where a bigger one
+         * would be aligned, if it would fit there. */
+        limit = end;
+        if (size > first_size) {
+            bigger = 1UL << page_sizes[size - 1].size_bits;
+            limit = (vaddr + bigger - 1) & ~(bigger - 1);
+            if (limit >= end || end - limit < bigger) {
+                limit = end;
+            }
+        }
+        num_pages = (limit - vaddr) >> page->size_bits;
+        if (num_pages > MAPPING_BATCH) {
+            num_pages = MAPPING_BATCH;
+        }
+
+        created = alloc_frames(allocator, page, num_pages, &frames);
+        if (!created) {
+            if (size == NUM_PAGE_SIZES - 1) {
+                error = -1;
+                break;
+            }
+            /* We are out of memory for pages this big; stick to smaller
+             * ones from now on. */
+            first_size = size + 1;
+            continue;
+        }
+
+        for (i = 0; i < created && !error; i++) {
+            error = map_page(allocator, vspace, frames.first + i, vaddr,
+                             rights, page->needs_table);
+            vaddr += 1UL << page->size_bits;
+        }
+    }
+
+    if (error) {
+        allocator_release(allocator, mark);
+    } else {
+        journal_commit(allocator, mark);
+    }
+    return error;
+}
+
+#endif /* CONFIG_ARCH_ARM || CONFIG_ARCH_IA32 */
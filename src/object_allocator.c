@@ -14,6 +14,15 @@
  * Given an untyped item allocator, allocates a kernel object
  * of the given type.
  *
+ * On stable kernels the allocator may be configured to carve objects out of
+ * a shared arena at increasing offsets (see allocator_enable_bump_allocation),
+ * saving the untyped item (and cap slot) each object would otherwise need.
+ * Objects are also carved out of an arena, on any kernel, once the allocator
+ * has run out of records for splitting untyped items.
+ *
+ * Objects that must be physically contiguous, such as DMA buffers, can be
+ * created together out of a single untyped item.
+ *
  * This is a convenience wrapper around the seL4 API; nothing in here is
  * particularly deep.
  */
@@ -34,36 +43,425 @@
 
 #include <vka/object.h>
 
+#include "kernel.h"
+
+/*
+ * Carve an object of 'size_bits' bits out of the allocator's current arena.
+ *
+ * Returns 0 on success, or non-zero if there is no arena or it has no room.
+ */
+static int
+arena_retype(struct allocator *allocator, seL4_Word item_type,
+             seL4_Word item_size, unsigned long size_bits,
+             struct cslot_path *dest)
+{
+    seL4_Word offset;
+    int error;
+
+    /* Objects must be aligned to their size within the arena. */
+    offset = allocator->bump_arena.watermark;
+    offset = (offset + (1UL << size_bits) - 1) & ~((1UL << size_bits) - 1);
+    if (!allocator->bump_arena.cap
+            || offset + (1UL << size_bits) > (1UL << allocator->bump_arena.size_bits)) {
+        return -1;
+    }
+
+#ifdef CONFIG_KERNEL_STABLE
+    /* The offset given to the kernel is in bytes. */
+    error = kernel_untyped_retype(allocator, allocator->bump_arena.cap,
+                                  item_type, item_size, offset, dest, 1);
+#else
+    /* The kernel aligns the object after the previous one itself. */
+    error = kernel_untyped_retype(allocator, allocator->bump_arena.cap,
+                                  item_type, item_size, 0, dest, 1);
+#endif
+    if (error) {
+        return error;
+    }
+
+    allocator->bump_arena.watermark = offset + (1UL << size_bits);
+    return 0;
+}
+
+/*
+ * Start carving objects out of the untyped item 'cap' of 'size_bits' bits.
+ * Whatever is left of the old arena is lost until the allocator is reset.
+ */
+static void
+arena_start(struct allocator *allocator, seL4_CPtr cap, unsigned long size_bits)
+{
+    allocator->bump_arena.cap = cap;
+    allocator->bump_arena.size_bits = size_bits;
+    allocator->bump_arena.watermark = 0;
+}
+
+#ifdef CONFIG_KERNEL_STABLE
+/*
+ * Carve an object of 'size_bits' bits out of the allocator's bump arena,
+ * starting a new arena if the current one is exhausted.
+ *
+ * Returns 0 on success, or non-zero if no arena is available.
+ */
+static int
+bump_retype(struct allocator *allocator, seL4_Word item_type,
+            seL4_Word item_size, unsigned long size_bits,
+            struct cslot_path *dest)
+{
+    seL4_CPtr arena;
+
+    if (!arena_retype(allocator, item_type, item_size, size_bits, dest)) {
+        return 0;
+    }
+
+    arena = allocator_alloc_untyped(allocator, allocator->bump_arena_bits);
+    if (!arena) {
+        return -1;
+    }
+    arena_start(allocator, arena, allocator->bump_arena_bits);
+    return arena_retype(allocator, item_type, item_size, size_bits, dest);
+}
+#endif
+
+/*
+ * Carve an object of 'size_bits' bits out of an arena when we have run out
+ * of records for splitting untyped items. Each new arena is the smallest
+ * free item that is big enough, which we can take without splitting it.
+ *
+ * Returns 0 on success, or non-zero if there is no such item.
+ */
+static int
+fallback_retype(struct allocator *allocator, seL4_Word item_type,
+                seL4_Word item_size, unsigned long size_bits,
+                struct cslot_path *dest)
+{
+    unsigned long arena_bits;
+    seL4_CPtr arena;
+
+    if (!arena_retype(allocator, item_type, item_size, size_bits, dest)) {
+        return 0;
+    }
+
+    for (arena_bits = size_bits; arena_bits <= MAX_UNTYPED_SIZE; arena_bits++) {
+        arena = allocator_alloc_untyped(allocator, arena_bits);
+        if (arena) {
+            arena_start(allocator, arena, arena_bits);
+            return arena_retype(allocator, item_type, item_size, size_bits,
+                                dest);
+        }
+    }
+    return -1;
+}
+
+/*
+ * Create a single object of the given type in the (empty) cap slot 'dest' of
+ * the allocator's CNode.
+ *
+ * If 'untyped' is non-NULL, it is set to the untyped item backing the object,
+ * which may be passed to allocator_free_untyped() to free the object again.
+ * Objects carved out of a bump arena have no untyped item of their own, in
+ * which case it is set to zero.
+ *
+ * Returns 0 on success.
+ */
+int
+allocator_retype_kobject_at(struct allocator *allocator,
+                            seL4_Word item_type, seL4_Word item_size,
+                            seL4_CPtr dest, seL4_CPtr *untyped)
+{
+    int error;
+
+    unsigned long size_bits;
+    seL4_CPtr untyped_memory;
+    struct cslot_path dest_path;
+
+    size_bits = vka_get_object_size(item_type, item_size);
+    allocator_cslot_path(allocator, dest, &dest_path);
+    if (untyped) {
+        *untyped = 0;
+    }
+
+#ifdef CONFIG_KERNEL_STABLE
+    /* Small objects come straight out of the bump arena, if we have one. */
+    if (size_bits < allocator->bump_arena_bits
+            && !bump_retype(allocator, item_type, item_size, size_bits, &dest_path)) {
+        return 0;
+    }
+#endif
+
+    /* Allocate an untyped memory item of the right size. If we have no
+     * records left to split anything with, share one with other objects
+     * instead. */
+    untyped_memory = allocator_alloc_untyped(allocator, size_bits);
+    if (!untyped_memory) {
+        if (allocator->free_split < 0) {
+            return fallback_retype(allocator, item_type, item_size, size_bits,
+                                   &dest_path);
+        }
+        return -1;
+    }
+
+    /* Allocate an object. */
+    error = kernel_untyped_retype(allocator, untyped_memory, item_type, item_size,
+                                  0, &dest_path, 1);
+    if (error) {
+        allocator_free_untyped(allocator, untyped_memory, size_bits);
+        return error;
+    }
+
+    if (untyped) {
+        *untyped = untyped_memory;
+    }
+    return 0;
+}
+
 /*
  * Allocate a single object of the given type.
  */
 seL4_CPtr
 allocator_alloc_kobject(struct allocator *allocator,
                         seL4_Word item_type, seL4_Word item_size)
+{
+    seL4_CPtr slot;
+    int error;
+
+    /* Allocate a slot to put the object in. */
+    slot = allocator_alloc_cslot(allocator);
+    if (!slot) {
+        return 0;
+    }
+
+    /* Allocate an object. */
+    error = allocator_retype_kobject_at(allocator, item_type, item_size, slot,
+                                        NULL);
+    if (error) {
+        allocator_free_cslot(allocator, slot);
+        return 0;
+    }
+
+    return slot;
+}
+
+#ifdef CONFIG_LIB_SEL4_TWINKLE_CACHE_COLOURING
+/*
+ * Allocate a single object of the given type, such as a frame, out of memory
+ * of the colours allowed by allocator_set_colours().
+ */
+seL4_CPtr
+allocator_alloc_coloured_kobject(struct allocator *allocator,
+                                 seL4_Word item_type, seL4_Word item_size)
 {
     unsigned long size_bits;
+    seL4_CPtr slot;
     seL4_CPtr untyped_memory;
-    struct cap_range cap_range;
-    int result;
-    UNUSED_NDEBUG(result);
-    /* Allocate an untyped memory item of the right size. */
+    struct cslot_path dest_path;
+    int error;
+
+    /* Allocate a slot to put the object in. */
+    slot = allocator_alloc_cslot(allocator);
+    if (!slot) {
+        return 0;
+    }
+
+    /* Allocate coloured memory of the right size. */
     size_bits = vka_get_object_size(item_type, item_size);
-    untyped_memory = allocator_alloc_untyped( allocator, size_bits);
+    untyped_memory = allocator_alloc_coloured_untyped(allocator, size_bits);
     if (!untyped_memory) {
+        allocator_free_cslot(allocator, slot);
         return 0;
     }
 
     /* Allocate an object. */
-    result = allocator_retype_untyped_memory(allocator, untyped_memory,
-                                             item_type, item_size, 1, &cap_range);
+    allocator_cslot_path(allocator, slot, &dest_path);
+    error = kernel_untyped_retype(allocator, untyped_memory, item_type,
+                                  item_size, 0, &dest_path, 1);
+    if (error) {
+        allocator_free_untyped(allocator, untyped_memory, size_bits);
+        allocator_free_cslot(allocator, slot);
+        return 0;
+    }
+
+    return slot;
+}
+#endif
+
+/*
+ * Allocate 'num_items' objects of the given type into contiguous cap slots,
+ * taking the untyped item for each batch from 'alloc_untyped'.
+ */
+static int
+alloc_kobjects(struct allocator *allocator,
+               seL4_Word item_type, seL4_Word item_size,
+               int num_items, struct cap_range *result,
+               seL4_CPtr (*alloc_untyped)(struct allocator *, unsigned long))
+{
+    unsigned long size_bits;
+    unsigned long batch_bits;
+    seL4_CPtr first_slot;
+    seL4_CPtr untyped_memory;
+    struct cslot_path dest_path;
+    int created;
+
+    result->first = 0;
+    result->count = 0;
+    if (num_items <= 0) {
+        return 0;
+    }
+
+    /* Reserve slots for everything up front, so the objects are contiguous. */
+    first_slot = allocator_alloc_cslots(allocator, num_items);
+    if (!first_slot) {
+        return 0;
+    }
+
+    size_bits = vka_get_object_size(item_type, item_size);
+    created = 0;
+    while (created < num_items) {
+        /* Find the biggest batch we still need that fits in an untyped. */
+        batch_bits = 0;
+        while ((2 << batch_bits) <= num_items - created
+                && size_bits + batch_bits < MAX_UNTYPED_SIZE) {
+            batch_bits++;
+        }
+
+        /* Shrink the batch until we find memory for it. */
+        while (1) {
+            untyped_memory = alloc_untyped(allocator, size_bits + batch_bits);
+            if (untyped_memory || batch_bits == 0) {
+                break;
+            }
+            batch_bits--;
+        }
+        if (!untyped_memory) {
+            break;
+        }
+
+        allocator_cslot_path(allocator, first_slot + created, &dest_path);
+        if (kernel_untyped_retype(allocator, untyped_memory, item_type, item_size,
+                                  0, &dest_path, 1 << batch_bits)) {
+            allocator_free_untyped(allocator, untyped_memory,
+                                   size_bits + batch_bits);
+            break;
+        }
+        created += 1 << batch_bits;
+    }
 
-    /* We should have gotten either zero items (if we ran out of caps), or one
-     * item (if everything went well). If we get more than one, we
-     * miscalculated our sizes. */
-    assert((result == 0) || (result == 1));
+    /* Give back the slots we did not fill, including those of a batch that
+     * failed. */
+    if (created < num_items) {
+        allocator_free_cslots(allocator, first_slot + created,
+                              num_items - created);
+    }
+
+    if (created) {
+        result->first = first_slot;
+        result->count = created;
+    }
+    return created;
+}
+
+/*
+ * Allocate 'num_items' objects of the given type into contiguous cap slots.
+ *
+ * Objects are created a power-of-two sized batch at a time, each batch from
+ * a single untyped item sized to hold it exactly; if memory is fragmented we
+ * fall back to smaller batches.
+ *
+ * Returns the number of objects created, which will be less than
+ * 'num_items' if we ran out of memory. 'result' is set to the range of caps
+ * holding them.
+ */
+int
+allocator_alloc_kobjects(struct allocator *allocator,
+                         seL4_Word item_type, seL4_Word item_size,
+                         int num_items, struct cap_range *result)
+{
+    return alloc_kobjects(allocator, item_type, item_size, num_items, result,
+                          allocator_alloc_untyped);
+}
 
-    /* Return the first item (or zero if none were allocated. */
-    return cap_range.first;
+#ifdef CONFIG_LIB_SEL4_TWINKLE_CACHE_COLOURING
+/*
+ * As allocator_alloc_kobjects(), but out of memory of the colours allowed by
+ * allocator_set_colours(). Batches are only as big as a run of pages of
+ * those colours allows.
+ */
+int
+allocator_alloc_coloured_kobjects(struct allocator *allocator,
+                                  seL4_Word item_type, seL4_Word item_size,
+                                  int num_items, struct cap_range *result)
+{
+    return alloc_kobjects(allocator, item_type, item_size, num_items, result,
+                          allocator_alloc_coloured_untyped);
 }
+#endif
+
+/*
+ * Allocate 'num_items' objects of the given type that are physically
+ * contiguous, such as the frames of a DMA buffer, into contiguous cap slots.
+ * The first object is aligned to at least 2^align_bits bytes.
+ *
+ * All the objects are created from a single untyped item, which '*untyped' is
+ * set to; allocator_untyped_paddr() gives its physical address, and
+ * allocator_free_untyped() frees all of the objects at once. 'result' is set to
+ * the range of caps holding them.
+ *
+ * Returns 0 on success.
+ */
+int
+allocator_alloc_contiguous_kobjects(struct allocator *allocator,
+                                    seL4_Word item_type, seL4_Word item_size,
+                                    int num_items, unsigned long align_bits,
+                                    struct cap_range *result, seL4_CPtr *untyped)
+{
+    unsigned long size_bits;
+    unsigned long untyped_bits;
+    seL4_CPtr first_slot;
+    seL4_CPtr untyped_memory;
+    struct cslot_path dest_path;
+    int error;
+
+    result->first = 0;
+    result->count = 0;
+    *untyped = 0;
+    if (num_items <= 0) {
+        return -1;
+    }
+
+    /* Untyped items are aligned to their size, so find one big enough to
+     * hold everything with the alignment we want. */
+    size_bits = vka_get_object_size(item_type, item_size);
+    untyped_bits = size_bits;
+    while ((1UL << (untyped_bits - size_bits)) < num_items) {
+        untyped_bits++;
+    }
+    if (untyped_bits < align_bits) {
+        untyped_bits = align_bits;
+    }
+    if (untyped_bits > MAX_UNTYPED_SIZE) {
+        return -1;
+    }
 
+    first_slot = allocator_alloc_cslots(allocator, num_items);
+    if (!first_slot) {
+        return -1;
+    }
+    untyped_memory = allocator_alloc_untyped(allocator, untyped_bits);
+    if (!untyped_memory) {
+        allocator_free_cslots(allocator, first_slot, num_items);
+        return -1;
+    }
+
+    allocator_cslot_path(allocator, first_slot, &dest_path);
+    error = kernel_untyped_retype(allocator, untyped_memory, item_type, item_size,
+                                  0, &dest_path, num_items);
+    if (error) {
+        allocator_free_untyped(allocator, untyped_memory, untyped_bits);
+        allocator_free_cslots(allocator, first_slot, num_items);
+        return error;
+    }
 
+    result->first = first_slot;
+    result->count = num_items;
+    *untyped = untyped_memory;
+    return 0;
+}
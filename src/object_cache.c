@@ -0,0 +1,157 @@
+/*
+ * Copyright 2014, NICTA
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(NICTA_BSD)
+ */
+
+/*
+ * Kernel object caches.
+ *
+ * An object cache holds ready-made objects of one type (TCBs, endpoints,
+ * frames, CNodes of a given size, ...), so that handing one out is just a
+ * matter of popping it off a stack. Caches are refilled a batch at a time
+ * with a single call to allocator_alloc_kobjects(); callers that want to
+ * keep retypes off their critical path should call object_cache_refill()
+ * from somewhere less sensitive whenever object_cache_needs_refill() says
+ * so. A cache only refills on its own once it is completely empty.
+ */
+
+#ifndef UNUSED_NDEBUG
+# ifdef NDEBUG
+#  define UNUSED_NDEBUG(x)  ((void)x)
+# else
+#  define UNUSED_NDEBUG(x)
+# endif
+#endif
+
+#include <assert.h>
+
+#include <sel4/sel4.h>
+
+#include <twinkle/allocator.h>
+#include <twinkle/object_allocator.h>
+#include <twinkle/object_cache.h>
+
+#include "kernel.h"
+
+/*
+ * Initialise an empty cache of objects of the given type.
+ */
+void
+object_cache_init(struct object_cache *cache, struct allocator *allocator,
+                  seL4_Word item_type, seL4_Word item_size,
+                  int low_watermark, int batch)
+{
+    assert(batch > 0);
+    assert(low_watermark + batch <= OBJECT_CACHE_SIZE);
+
+    cache->allocator = allocator;
+    cache->item_type = item_type;
+    cache->item_size = item_size;
+    cache->low_watermark = low_watermark;
+    cache->batch = batch;
+    cache->num_objects = 0;
+}
+
+/*
+ * Set up and fill 'num_caches' caches, one for each entry in 'profile'.
+ *
+ * Returns the number of caches that could be filled completely.
+ */
+int
+object_cache_prewarm(struct object_cache *caches, struct allocator *allocator,
+                     const struct object_cache_profile *profile, int num_caches)
+{
+    int filled = 0;
+    int i;
+
+    for (i = 0; i < num_caches; i++) {
+        object_cache_init(&caches[i], allocator,
+                          profile[i].item_type, profile[i].item_size,
+                          profile[i].low_watermark, profile[i].batch);
+        if (object_cache_refill(&caches[i])) {
+            filled++;
+        }
+    }
+
+    return filled;
+}
+
+/*
+ * Determine whether the cache has dropped below its low watermark.
+ */
+int
+object_cache_needs_refill(struct object_cache *cache)
+{
+    return cache->num_objects < cache->low_watermark;
+}
+
+/*
+ * Top the cache up to its low watermark plus one batch.
+ *
+ * Returns non-zero if the cache is now full.
+ */
+int
+object_cache_refill(struct object_cache *cache)
+{
+    struct cap_range objects;
+    int wanted;
+    int i;
+
+    wanted = cache->low_watermark + cache->batch - cache->num_objects;
+    while (wanted > 0) {
+        if (!allocator_alloc_kobjects(cache->allocator, cache->item_type,
+                                      cache->item_size, wanted, &objects)) {
+            return 0;
+        }
+        for (i = 0; i < objects.count; i++) {
+            cache->objects[cache->num_objects++] = objects.first + i;
+        }
+        wanted -= objects.count;
+    }
+
+    return 1;
+}
+
+/*
+ * Take an object from the cache.
+ */
+seL4_CPtr
+object_cache_alloc(struct object_cache *cache)
+{
+    if (!cache->num_objects && !object_cache_refill(cache)
+            && !cache->num_objects) {
+        return 0;
+    }
+
+    return cache->objects[--cache->num_objects];
+}
+
+/*
+ * Return an object to the cache.
+ *
+ * The object is recycled back to its initial state first. If the cache is
+ * already full the object is deleted instead; its memory is reclaimed when
+ * the allocator is reset.
+ */
+void
+object_cache_free(struct object_cache *cache, seL4_CPtr object)
+{
+    int error;
+    UNUSED_NDEBUG(error);
+
+    if (cache->num_objects == OBJECT_CACHE_SIZE) {
+        error = kernel_delete(cache->allocator, object);
+        assert(!error);
+        allocator_free_cslot(cache->allocator, object);
+        return;
+    }
+
+    error = kernel_recycle(cache->allocator, object);
+    assert(!error);
+    cache->objects[cache->num_objects++] = object;
+}
@@ -0,0 +1,776 @@
+/*
+ * Copyright 2014, NICTA
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(NICTA_BSD)
+ */
+
+/*
+ * Saving and restoring allocator state.
+ *
+ * allocator_serialize() writes out everything an allocator knows about the
+ * memory and cap slots it manages, and allocator_restore() loads it into a
+ * fresh allocator on the same CSpace. This lets a component that restarts
+ * without its CSpace being torn down carry on where it left off, rather than
+ * rebuilding its allocator and splitting all of its memory up again.
+ *
+ * The state is written as a sequence of words: a header giving the format
+ * version, the word size, the length, a checksum and the configuration options
+ * that change what is in struct allocator, followed by the allocator's
+ * fields. Only split records that are in use, and the part of the
+ * slot bitmap we use, are written.
+ */
+
+#ifndef UNUSED_NDEBUG
+# ifdef NDEBUG
+#  define UNUSED_NDEBUG(x)  ((void)x)
+# else
+#  define UNUSED_NDEBUG(x)
+# endif
+#endif
+
+#include <assert.h>
+#include <string.h>
+
+#include <autoconf.h>
+#include <sel4/sel4.h>
+
+#include <twinkle/allocator.h>
+
+#include "journal.h"
+#include "trace.h"
+
+#define SERIAL_MAGIC 0x54574b4cUL /* "TWKL" */
+#define SERIAL_HEADER_WORDS 6
+
+/* Configuration options recorded in the header. State saved with different
+ * options has different fields, or comes from a different kernel, and isn't
+ * loaded. */
+#define SERIAL_LAYOUT_STABLE    (1UL << 0)
+#define SERIAL_LAYOUT_STATS     (1UL << 1)
+#define SERIAL_LAYOUT_TRACE     (1UL << 2)
+#define SERIAL_LAYOUT_COLOURING (1UL << 3)
+
+#ifdef CONFIG_KERNEL_STABLE
+# define SERIAL_LAYOUT_STABLE_BIT SERIAL_LAYOUT_STABLE
+#else
+# define SERIAL_LAYOUT_STABLE_BIT 0
+#endif
+#ifdef CONFIG_LIB_SEL4_TWINKLE_STATS
+# define SERIAL_LAYOUT_STATS_BIT SERIAL_LAYOUT_STATS
+#else
+# define SERIAL_LAYOUT_STATS_BIT 0
+#endif
+#ifdef CONFIG_LIB_SEL4_TWINKLE_TRACE
+# define SERIAL_LAYOUT_TRACE_BIT SERIAL_LAYOUT_TRACE
+#else
+# define SERIAL_LAYOUT_TRACE_BIT 0
+#endif
+#ifdef CONFIG_LIB_SEL4_TWINKLE_CACHE_COLOURING
+# define SERIAL_LAYOUT_COLOURING_BIT SERIAL_LAYOUT_COLOURING
+#else
+# define SERIAL_LAYOUT_COLOURING_BIT 0
+#endif
+
+#define SERIAL_LAYOUT \
+    (SERIAL_LAYOUT_STABLE_BIT | SERIAL_LAYOUT_STATS_BIT \
+     | SERIAL_LAYOUT_TRACE_BIT | SERIAL_LAYOUT_COLOURING_BIT)
+
+/* A word we write for -1. */
+#define SERIAL_NONE (~(seL4_Word)0)
+
+/* Words written for each initial item and each split, and where the fields
+ * we check against each other are among them. */
+#define ITEM_WORDS 7
+#define ITEM_SIZE_BITS 1
+#define ITEM_IS_FREE 3
+#define ITEM_NEXT_FREE 6
+
+#define SPLIT_WORDS 14
+#define SPLIT_INDEX 0
+#define SPLIT_PARENT_SPLIT 2
+#define SPLIT_SIZE_BITS 5
+#define SPLIT_COUNT 6
+#define SPLIT_FREE 8
+#define SPLIT_IN_SMALL_REGION 11
+#define SPLIT_NEXT 12
+#define SPLIT_PREV 13
+
+/*
+ * Words being written to, or read from, a buffer of 'max' words. When
+ * writing, we keep counting past the end of the buffer, so that we can tell
+ * the caller how big it needs to be. When reading, running off the end sets
+ * 'error'.
+ */
+struct serial {
+    seL4_Word *words;
+    unsigned long pos;
+    unsigned long max;
+    int error;
+};
+
+static void
+put(struct serial *s, seL4_Word word)
+{
+    if (s->pos < s->max) {
+        s->words[s->pos] = word;
+    }
+    s->pos++;
+}
+
+static void
+put_int(struct serial *s, int value)
+{
+    put(s, value < 0 ? SERIAL_NONE : (seL4_Word)value);
+}
+
+static seL4_Word
+get(struct serial *s)
+{
+    if (s->pos >= s->max) {
+        s->error = 1;
+        return 0;
+    }
+    return s->words[s->pos++];
+}
+
+/*
+ * Read an index below 'limit', or -1.
+ */
+static int
+get_index(struct serial *s, unsigned long limit)
+{
+    seL4_Word word = get(s);
+
+    if (word == SERIAL_NONE) {
+        return -1;
+    }
+    if (word >= limit) {
+        s->error = 1;
+        return -1;
+    }
+    return word;
+}
+
+/*
+ * Checksum the 'n' words at 'words'.
+ */
+static seL4_Word
+checksum(const seL4_Word *words, unsigned long n)
+{
+    seL4_Word sum = SERIAL_MAGIC;
+    unsigned long i;
+
+    for (i = 0; i < n; i++) {
+        sum = ((sum << 5) | (sum >> (sizeof(seL4_Word) * 8 - 5))) ^ words[i];
+    }
+    return sum;
+}
+
+/*
+ * Find the split with index 'index' among the 'num_splits' written at
+ * position 'pos' of 's'.
+ *
+ * Returns its words, or NULL if there is none.
+ */
+static const seL4_Word *
+find_split(struct serial *s, unsigned long pos, unsigned long num_splits,
+           seL4_Word index)
+{
+    unsigned long i;
+
+    for (i = 0; i < num_splits; i++) {
+        if (s->words[pos + i * SPLIT_WORDS + SPLIT_INDEX] == index) {
+            return &s->words[pos + i * SPLIT_WORDS];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Check the pool of splits of 'size_bits' bits starting at 'head', among the
+ * 'num_splits' written at position 'pos' of 's': every split on it must have
+ * free children of that size, in a small region if 'small' is set, and its
+ * links must agree with each other.
+ *
+ * Returns the number of splits on it, or -1 if it is damaged.
+ */
+static long
+check_pool(struct serial *s, unsigned long pos, unsigned long num_splits,
+           int head, unsigned long size_bits, int small)
+{
+    const seL4_Word *split;
+    seL4_Word prev = SERIAL_NONE;
+    seL4_Word next;
+    long n = 0;
+
+    for (next = head < 0 ? SERIAL_NONE : (seL4_Word)head;
+            next != SERIAL_NONE; next = split[SPLIT_NEXT]) {
+        split = find_split(s, pos, num_splits, next);
+        if (!split || n++ == num_splits
+                || split[SPLIT_PREV] != prev
+                || split[SPLIT_SIZE_BITS] != size_bits
+                || !split[SPLIT_IN_SMALL_REGION] != !small
+                || !split[SPLIT_FREE]) {
+            return -1;
+        }
+        prev = next;
+    }
+    return n;
+}
+
+/*
+ * Check the free list of initial items of 'size_bits' bits starting at
+ * 'head', among the 'num_items' written at position 'pos' of 's'.
+ *
+ * Returns the number of items on it, or -1 if it is damaged.
+ */
+static long
+check_free_items(struct serial *s, unsigned long pos, unsigned long num_items,
+                 int head, unsigned long size_bits)
+{
+    const seL4_Word *item;
+    seL4_Word next;
+    long n = 0;
+
+    for (next = head < 0 ? SERIAL_NONE : (seL4_Word)head;
+            next != SERIAL_NONE; next = item[ITEM_NEXT_FREE]) {
+        if (next >= num_items) {
+            return -1;
+        }
+        item = &s->words[pos + next * ITEM_WORDS];
+        if (n++ == num_items || !item[ITEM_IS_FREE]
+                || item[ITEM_SIZE_BITS] != size_bits) {
+            return -1;
+        }
+    }
+    return n;
+}
+
+/*
+ * Write out the state of 'allocator' to the 'size' bytes at 'buffer', which
+ * must be word aligned.
+ *
+ * Allocators with outstanding marks or a reset under way, and lazy child
+ * allocators (whose state depends on their parent's), can't be saved.
+ *
+ * Returns the number of bytes needed, which are only written if that is no
+ * more than 'size', or -1 if the allocator can't be saved.
+ */
+long
+allocator_serialize(struct allocator *allocator, void *buffer,
+                    unsigned long size)
+{
+    struct untyped_split *split;
+    struct serial s;
+    unsigned long i;
+    int num_splits = 0;
+
+    assert(!((seL4_Word)buffer & (sizeof(seL4_Word) - 1)));
+
+    if (allocator->num_marks || allocator->parent
+            || allocator->cspace_growing || allocator->reset_next >= 0) {
+        return -1;
+    }
+
+    s.words = buffer;
+    s.pos = SERIAL_HEADER_WORDS;
+    s.max = size / sizeof(seL4_Word);
+    s.error = 0;
+
+    /* Cap slots. */
+    put(&s, allocator->root_cnode);
+    put(&s, allocator->root_cnode_depth);
+    put(&s, allocator->root_cnode_offset);
+    put(&s, allocator->cslots.first);
+    put(&s, allocator->cslots.count);
+    put(&s, allocator->num_cslots);
+    for (i = 0; i < CSLOT_BITMAP_WORDS(allocator->num_cslots); i++) {
+        put(&s, allocator->cslot_free[i]);
+    }
+    put(&s, allocator->cspace_dir);
+    put(&s, allocator->cspace_dir_depth);
+    put(&s, allocator->cspace_dir_slots.first);
+    put(&s, allocator->cspace_dir_slots.count);
+    put(&s, allocator->cspace_cnode_bits);
+    put(&s, allocator->num_cspace_extensions);
+    for (i = 0; i < allocator->num_cspace_extensions; i++) {
+        put(&s, allocator->cspace_extensions[i]);
+    }
+
+    /* Initial items. */
+    put(&s, allocator->num_init_untyped_items);
+    for (i = 0; i < allocator->num_init_untyped_items; i++) {
+        put(&s, allocator->init_untyped_items[i].cap);
+        put(&s, allocator->init_untyped_items[i].size_bits);
+        put(&s, allocator->init_untyped_items[i].paddr);
+        put(&s, allocator->init_untyped_items[i].is_free);
+        put(&s, allocator->init_untyped_items[i].is_split);
+        put(&s, allocator->init_untyped_items[i].is_borrowed);
+        put_int(&s, allocator->init_untyped_items[i].next_free);
+    }
+
+    /* Splits. */
+    for (i = 0; i < allocator->max_splits; i++) {
+        if (allocator->splits[i].parent) {
+            num_splits++;
+        }
+    }
+    put(&s, num_splits);
+    for (i = 0; i < allocator->max_splits; i++) {
+        split = &allocator->splits[i];
+        if (!split->parent) {
+            continue;
+        }
+        put(&s, i);
+        put(&s, split->parent);
+        put_int(&s, split->parent_split);
+        put(&s, split->parent_index);
+        put(&s, split->first);
+        put(&s, split->size_bits);
+        put(&s, split->count);
+        put(&s, split->paddr);
+        put(&s, split->free);
+        put(&s, split->split);
+        put(&s, split->deleted);
+        put(&s, split->in_small_region);
+        put_int(&s, split->next);
+        put_int(&s, split->prev);
+    }
+
+    /* Pools and policy. */
+    for (i = 0; i < NUM_UNTYPED_SIZES; i++) {
+        put_int(&s, allocator->init_untyped_free[i]);
+        put_int(&s, allocator->untyped_pools[i]);
+        put_int(&s, allocator->small_pools[i]);
+        put(&s, allocator->pool_targets[i]);
+    }
+    put(&s, allocator->placement.small_bits);
+    put(&s, allocator->placement.small_region_bits);
+    put(&s, allocator->placement.reserve_bits);
+#ifdef CONFIG_LIB_SEL4_TWINKLE_CACHE_COLOURING
+    put(&s, allocator->colours);
+#endif
+
+#ifdef CONFIG_KERNEL_STABLE
+    put(&s, allocator->bump_arena_bits);
+#endif
+    put(&s, allocator->bump_arena.cap);
+    put(&s, allocator->bump_arena.size_bits);
+    put(&s, allocator->bump_arena.watermark);
+
+    /* Fill in the header, if everything fitted. */
+    if (s.pos <= s.max) {
+        s.words[0] = SERIAL_MAGIC;
+        s.words[1] = ALLOCATOR_SERIAL_VERSION;
+        s.words[2] = sizeof(seL4_Word);
+        s.words[3] = s.pos;
+        s.words[4] = checksum(s.words + SERIAL_HEADER_WORDS,
+                              s.pos - SERIAL_HEADER_WORDS);
+        s.words[5] = SERIAL_LAYOUT;
+    }
+
+    return s.pos * sizeof(seL4_Word);
+}
+
+/*
+ * Read the state following the header in 's' into 'allocator', or, if 'apply'
+ * is zero, just check that it would fit.
+ *
+ * Returns 0 on success, or -1 if the state is damaged or doesn't fit.
+ */
+static int
+load(struct allocator *allocator, struct serial *s, int apply)
+{
+    struct init_untyped_item item;
+    struct untyped_split split;
+    struct allocator_placement placement;
+    struct cap_range dir_slots;
+    const seL4_Word *parent;
+    seL4_CPtr dir_cnode;
+    unsigned long dir_depth;
+    unsigned long cnode_bits;
+    unsigned long items_pos;
+    unsigned long splits_pos;
+    unsigned long mask;
+    long num_free_items = 0;
+    long num_free_splits = 0;
+    long listed_items = 0;
+    long listed_splits = 0;
+    long listed;
+    int heads[3];
+    struct {
+        seL4_CPtr cap;
+        unsigned long size_bits;
+        seL4_Word watermark;
+    } arena;
+    unsigned long sizes_available = 0;
+    unsigned long small_sizes_available = 0;
+    unsigned long num_cslots;
+    unsigned long num_items;
+    unsigned long num_splits;
+    unsigned long index;
+    unsigned long i;
+    seL4_Word word;
+    int n;
+
+    /* It must be for the slots we were created with. */
+    if (get(s) != allocator->root_cnode
+            || get(s) != allocator->root_cnode_depth
+            || get(s) != allocator->root_cnode_offset
+            || get(s) != allocator->cslots.first
+            || get(s) != allocator->cslots.count) {
+        return -1;
+    }
+
+    /* Cap slots. */
+    num_cslots = get(s);
+    if (num_cslots < allocator->cslots.count
+            || num_cslots > allocator->max_cslots) {
+        return -1;
+    }
+    if (apply) {
+        allocator->num_cslots = num_cslots;
+        allocator->num_slots_used = num_cslots;
+        memset(allocator->cslot_free, 0,
+               CSLOT_BITMAP_WORDS(allocator->max_cslots) * sizeof(seL4_Word));
+        memset(allocator->cslot_free_summary, 0,
+               CSLOT_SUMMARY_WORDS(allocator->max_cslots) * sizeof(seL4_Word));
+    }
+    for (i = 0; i * CSLOT_WORD_BITS < num_cslots; i++) {
+        word = get(s);
+
+        /* There must be no free slots past the end. */
+        if ((i + 1) * CSLOT_WORD_BITS > num_cslots
+                && (word >> (num_cslots % CSLOT_WORD_BITS))) {
+            return -1;
+        }
+        if (!apply || !word) {
+            continue;
+        }
+        allocator->cslot_free[i] = word;
+        allocator->cslot_free_summary[i / CSLOT_WORD_BITS] |=
+            (seL4_Word)1 << (i % CSLOT_WORD_BITS);
+        allocator->num_slots_used -= __builtin_popcountl(word);
+    }
+    dir_cnode = get(s);
+    dir_depth = get(s);
+    dir_slots.first = get(s);
+    dir_slots.count = get(s);
+    cnode_bits = get(s);
+    if (cnode_bits && (cnode_bits >= seL4_WordBits
+                       || cnode_bits + seL4_SlotBits < MIN_UNTYPED_SIZE
+                       || cnode_bits + seL4_SlotBits > MAX_UNTYPED_SIZE)) {
+        return -1;
+    }
+    if (apply) {
+        allocator->cspace_dir = dir_cnode;
+        allocator->cspace_dir_depth = dir_depth;
+        allocator->cspace_dir_slots = dir_slots;
+        allocator->cspace_cnode_bits = cnode_bits;
+    }
+    n = get_index(s, MAX_CSPACE_EXTENSIONS + 1);
+    if (n < 0 || n > dir_slots.count || (n && !cnode_bits)
+            || num_cslots != allocator->cslots.count
+            + ((unsigned long)n << cnode_bits)) {
+        return -1;
+    }
+    for (i = 0; i < (unsigned long)n; i++) {
+        word = get(s);
+        if (apply) {
+            allocator->cspace_extensions[i] = word;
+        }
+    }
+    if (apply) {
+        allocator->num_cspace_extensions = n;
+    }
+
+    /* Initial items. */
+    num_items = get(s);
+    if (num_items > allocator->max_init_untyped_items
+            || num_items > (s->max - s->pos) / ITEM_WORDS) {
+        return -1;
+    }
+    items_pos = s->pos;
+    for (i = 0; i < num_items; i++) {
+        item.cap = get(s);
+        item.size_bits = get(s);
+        item.paddr = get(s);
+        item.is_free = get(s);
+        item.is_split = get(s);
+        item.is_borrowed = get(s);
+        item.is_stale = 0;
+        item.next_free = get_index(s, num_items);
+        if (item.size_bits < MIN_UNTYPED_SIZE
+                || item.size_bits > MAX_UNTYPED_SIZE
+                || (item.is_free && item.is_split)) {
+            return -1;
+        }
+        if (item.is_free) {
+            num_free_items++;
+        }
+        if (apply) {
+            allocator->init_untyped_items[i] = item;
+        }
+    }
+    if (apply) {
+        allocator->num_init_untyped_items = num_items;
+    }
+
+    /* Splits. */
+    if (apply) {
+        for (i = 0; i < allocator->max_splits; i++) {
+            allocator->splits[i].parent = 0;
+        }
+    }
+    num_splits = get(s);
+    if (num_splits > allocator->max_splits
+            || num_splits > (s->max - s->pos) / SPLIT_WORDS) {
+        return -1;
+    }
+    splits_pos = s->pos;
+    for (i = 0; i < num_splits; i++) {
+        index = get(s);
+        split.parent = get(s);
+        split.parent_split = get_index(s, allocator->max_splits);
+        split.parent_index = get(s);
+        split.first = get(s);
+        split.size_bits = get(s);
+        split.count = get(s);
+        split.paddr = get(s);
+        split.free = get(s);
+        split.split = get(s);
+        split.deleted = get(s);
+        split.in_small_region = get(s);
+        split.next = get_index(s, allocator->max_splits);
+        split.prev = get_index(s, allocator->max_splits);
+        if (index >= allocator->max_splits || !split.parent
+                || split.size_bits < MIN_UNTYPED_SIZE
+                || split.size_bits > MAX_UNTYPED_SIZE
+                || split.count < 1
+                || split.count > (1UL << MAX_SPLIT_FANOUT_BITS)) {
+            return -1;
+        }
+
+        /* Each index is used once, and the children are all accounted
+         * for. */
+        if (find_split(s, splits_pos, num_splits, index)
+                != &s->words[splits_pos + i * SPLIT_WORDS]) {
+            return -1;
+        }
+        mask = (1UL << split.count) - 1;
+        if (((split.free | split.split | split.deleted) & ~mask)
+                || (split.free & split.split)
+                || (split.deleted & ~split.split)) {
+            return -1;
+        }
+        if (split.free) {
+            num_free_splits++;
+        }
+
+        /* The item we were split from must be there. */
+        if (split.parent_split < 0) {
+            if (split.parent_index >= num_items) {
+                return -1;
+            }
+        } else {
+            parent = find_split(s, splits_pos, num_splits, split.parent_split);
+            if (!parent || split.parent_index >= parent[SPLIT_COUNT]) {
+                return -1;
+            }
+        }
+
+        /* Following parents must get us to an initial item, each parent
+         * being bigger than its child. */
+        parent = &s->words[splits_pos + i * SPLIT_WORDS];
+        for (n = 0; parent[SPLIT_PARENT_SPLIT] != SERIAL_NONE; n++) {
+            word = parent[SPLIT_SIZE_BITS];
+            parent = find_split(s, splits_pos, num_splits,
+                                parent[SPLIT_PARENT_SPLIT]);
+            if (!parent || n == NUM_UNTYPED_SIZES
+                    || parent[SPLIT_SIZE_BITS] <= word) {
+                return -1;
+            }
+        }
+        if (apply) {
+            allocator->splits[index] = split;
+        }
+    }
+    if (apply) {
+        allocator->free_split = -1;
+        for (n = 0; n < SPLIT_HASH_BUCKETS; n++) {
+            allocator->split_hash[n] = -1;
+        }
+        for (n = allocator->max_splits - 1; n >= 0; n--) {
+            split = allocator->splits[n];
+            if (!split.parent) {
+                allocator->splits[n].next = allocator->free_split;
+                allocator->free_split = n;
+                continue;
+            }
+            allocator->splits[n].hash_next =
+                allocator->split_hash[SPLIT_HASH(split.first)];
+            allocator->split_hash[SPLIT_HASH(split.first)] = n;
+        }
+    }
+
+    /* Pools and policy. */
+    for (i = 0; i < NUM_UNTYPED_SIZES; i++) {
+        heads[0] = get_index(s, num_items);
+        heads[1] = get_index(s, allocator->max_splits);
+        heads[2] = get_index(s, allocator->max_splits);
+        if (s->error) {
+            return -1;
+        }
+
+        /* Following the lists must get us to every free item and split
+         * once, without going round in circles. */
+        listed = check_free_items(s, items_pos, num_items, heads[0],
+                                  i + MIN_UNTYPED_SIZE);
+        if (listed < 0) {
+            return -1;
+        }
+        listed_items += listed;
+        for (n = 1; n <= 2; n++) {
+            listed = check_pool(s, splits_pos, num_splits, heads[n],
+                                i + MIN_UNTYPED_SIZE, n == 2);
+            if (listed < 0) {
+                return -1;
+            }
+            listed_splits += listed;
+        }
+        if (heads[0] >= 0 || heads[1] >= 0) {
+            sizes_available |= 1UL << i;
+        }
+        if (heads[2] >= 0) {
+            small_sizes_available |= 1UL << i;
+        }
+        if (apply) {
+            allocator->init_untyped_free[i] = heads[0];
+            allocator->untyped_pools[i] = heads[1];
+            allocator->small_pools[i] = heads[2];
+        }
+        word = get(s);
+        if (apply) {
+            allocator->pool_targets[i] = word;
+        }
+    }
+    placement.small_bits = get(s);
+    placement.small_region_bits = get(s);
+    placement.reserve_bits = get(s);
+    if (apply) {
+        allocator->untyped_sizes_available = sizes_available;
+        allocator->small_sizes_available = small_sizes_available;
+        allocator->placement = placement;
+    }
+#ifdef CONFIG_LIB_SEL4_TWINKLE_CACHE_COLOURING
+    word = get(s);
+    if (!(word & ALL_CACHE_COLOURS) || (word & ~ALL_CACHE_COLOURS)) {
+        return -1;
+    }
+    if (apply) {
+        allocator->colours = word;
+    }
+#endif
+
+#ifdef CONFIG_KERNEL_STABLE
+    word = get(s);
+    if (word > MAX_UNTYPED_SIZE) {
+        return -1;
+    }
+    if (apply) {
+        allocator->bump_arena_bits = word;
+    }
+#endif
+    arena.cap = get(s);
+    arena.size_bits = get(s);
+    arena.watermark = get(s);
+    if (arena.size_bits > MAX_UNTYPED_SIZE) {
+        return -1;
+    }
+    if (apply) {
+        allocator->bump_arena.cap = arena.cap;
+        allocator->bump_arena.size_bits = arena.size_bits;
+        allocator->bump_arena.watermark = arena.watermark;
+    }
+
+    /* We should have used up exactly what was written. */
+    if (s->error || s->pos != s->max
+            || listed_items != num_free_items
+            || listed_splits != num_free_splits) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Load state written by allocator_serialize() from the 'size' bytes at
+ * 'buffer', which must be word aligned, into 'allocator'.
+ *
+ * 'allocator' must have just been created on the same CNode and slots as
+ * the allocator that was saved, with at least as much storage for initial
+ * items and splits as that allocator was using, and with the same
+ * configuration. The caps the saved allocator held must still be in place;
+ * no kernel objects are created or checked.
+ *
+ * Statistics and the trace start again from nothing.
+ *
+ * Returns 0 on success, or -1 if the state is damaged, from a different
+ * version, or doesn't fit this allocator, in which case the allocator is
+ * left as it was.
+ */
+int
+allocator_restore(struct allocator *allocator, const void *buffer,
+                  unsigned long size)
+{
+    const seL4_Word *header = buffer;
+    struct serial s;
+    int error;
+    UNUSED_NDEBUG(error);
+
+    assert(!((seL4_Word)buffer & (sizeof(seL4_Word) - 1)));
+
+    if (allocator->num_marks || allocator->parent
+            || allocator->cspace_growing || allocator->reset_next >= 0) {
+        return -1;
+    }
+
+    /* Check the header. */
+    if (size < SERIAL_HEADER_WORDS * sizeof(seL4_Word)
+            || header[0] != SERIAL_MAGIC
+            || header[1] != ALLOCATOR_SERIAL_VERSION
+            || header[2] != sizeof(seL4_Word)
+            || header[3] < SERIAL_HEADER_WORDS
+            || header[5] != SERIAL_LAYOUT
+            || header[3] > size / sizeof(seL4_Word)
+            || header[4] != checksum(header + SERIAL_HEADER_WORDS,
+                                     header[3] - SERIAL_HEADER_WORDS)) {
+        return -1;
+    }
+
+    /* Check everything before we change anything. */
+    s.words = (seL4_Word *)header;
+    s.pos = SERIAL_HEADER_WORDS;
+    s.max = header[3];
+    s.error = 0;
+    if (load(allocator, &s, 0)) {
+        return -1;
+    }
+
+    s.pos = SERIAL_HEADER_WORDS;
+    error = load(allocator, &s, 1);
+    assert(!error);
+
+    journal_clear(allocator);
+#ifdef CONFIG_LIB_SEL4_TWINKLE_STATS
+    memset(&allocator->counters, 0, sizeof(allocator->counters));
+    allocator->counters.slots_high_water = allocator->num_slots_used;
+#endif
+    TRACE_CLEAR(allocator);
+
+    return 0;
+}
@@ -0,0 +1,98 @@
+/*
+ * Copyright 2014, NICTA
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(NICTA_BSD)
+ */
+
+/*
+ * Allocator statistics.
+ *
+ * The amount of free memory and slots is always available. Counters of pool
+ * hits, kernel invocations and so on are only kept if
+ * CONFIG_LIB_SEL4_TWINKLE_STATS is set, as maintaining them costs a little on
+ * every allocation.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <sel4/sel4.h>
+
+#include <twinkle/allocator.h>
+
+/*
+ * Take a snapshot of the allocator's state.
+ */
+void
+allocator_get_stats(struct allocator *allocator, struct allocator_stats *stats)
+{
+    struct untyped_split *split;
+    unsigned long size_bits;
+    int i;
+
+    memset(stats, 0, sizeof(*stats));
+
+    /* Initial items. */
+    for (i = 0; i < allocator->num_init_untyped_items; i++) {
+        size_bits = allocator->init_untyped_items[i].size_bits;
+        stats->bytes_total += 1UL << size_bits;
+        if (allocator->init_untyped_items[i].is_free) {
+            stats->free_items[size_bits - MIN_UNTYPED_SIZE]++;
+            stats->bytes_free += 1UL << size_bits;
+        }
+    }
+
+    /* Free children of items we have split. */
+    for (i = 0; i < allocator->max_splits; i++) {
+        split = &allocator->splits[i];
+        if (!split->parent) {
+            continue;
+        }
+        size_bits = split->size_bits;
+        stats->free_items[size_bits - MIN_UNTYPED_SIZE] += __builtin_popcountl(split->free);
+        stats->bytes_free += __builtin_popcountl(split->free) * (1UL << size_bits);
+    }
+
+    stats->slots_total = allocator->num_cslots;
+    stats->slots_used = allocator->num_slots_used;
+
+#ifdef CONFIG_LIB_SEL4_TWINKLE_STATS
+    stats->counters = allocator->counters;
+#endif
+}
+
+/*
+ * Print a summary of the allocator's state.
+ */
+void
+allocator_print_stats(struct allocator *allocator)
+{
+    struct allocator_stats stats;
+    struct allocator_counters *c = &stats.counters;
+    int i;
+
+    allocator_get_stats(allocator, &stats);
+
+    printf("allocator %p:\n", allocator);
+    printf("  memory: %lu of %lu bytes free\n",
+           (unsigned long)stats.bytes_free, (unsigned long)stats.bytes_total);
+    printf("  slots:  %lu of %lu used (high water %lu)\n",
+           stats.slots_used, stats.slots_total, c->slots_high_water);
+    printf("  kernel: %lu retypes, %lu revokes, %lu recycles, %lu deletes, "
+           "%lu maps\n",
+           c->retypes, c->revokes, c->recycles, c->deletes, c->maps);
+    printf("  splits: %lu made, %lu merged, depth %lu last, %lu max\n",
+           c->splits, c->merges, c->last_split_depth, c->max_split_depth);
+    printf("  %5s %10s %10s %10s\n", "bits", "free", "hits", "misses");
+    for (i = 0; i < NUM_UNTYPED_SIZES; i++) {
+        if (!stats.free_items[i] && !c->pool_hits[i] && !c->pool_misses[i]) {
+            continue;
+        }
+        printf("  %5d %10lu %10lu %10lu\n", i + MIN_UNTYPED_SIZE,
+               stats.free_items[i], c->pool_hits[i], c->pool_misses[i]);
+    }
+}
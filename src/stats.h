@@ -0,0 +1,41 @@
+/*
+ * Copyright 2014, NICTA
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(NICTA_BSD)
+ */
+
+/*
+ * Allocator instrumentation.
+ *
+ * These compile away to nothing unless CONFIG_LIB_SEL4_TWINKLE_STATS is set.
+ */
+
+#ifndef TWINKLE_STATS_H
+#define TWINKLE_STATS_H
+
+#include <autoconf.h>
+
+#ifdef CONFIG_LIB_SEL4_TWINKLE_STATS
+# define STATS_ADD(allocator, counter, n) \
+    ((allocator)->counters.counter += (n))
+# define STATS_SET(allocator, counter, n) \
+    ((allocator)->counters.counter = (n))
+# define STATS_MAX(allocator, counter, n) \
+    do { \
+        if ((allocator)->counters.counter < (n)) { \
+            (allocator)->counters.counter = (n); \
+        } \
+    } while (0)
+#else
+# define STATS_ADD(allocator, counter, n) ((void)0)
+# define STATS_SET(allocator, counter, n) ((void)0)
+# define STATS_MAX(allocator, counter, n) ((void)0)
+#endif
+
+#define STATS_INC(allocator, counter) STATS_ADD(allocator, counter, 1)
+
+#endif /* TWINKLE_STATS_H */
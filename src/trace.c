@@ -0,0 +1,280 @@
+/*
+ * Copyright 2014, NICTA
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(NICTA_BSD)
+ */
+
+/*
+ * Allocator call tracing.
+ *
+ * Each allocator keeps a ring of its most recent calls. The allocator itself
+ * is the only writer, but the ring may be read at any time, for instance
+ * from another thread or a debugger, without stopping the allocator: each
+ * entry carries a sequence number which is cleared while the entry is being
+ * written, so readers can tell when an entry has been overwritten under
+ * them and skip it.
+ *
+ * A trace read from one allocator can be replayed against another set up
+ * with the same resources, to reproduce its behaviour or compare the kernel
+ * invocations made by two versions of the allocator.
+ */
+
+#include <autoconf.h>
+
+#ifdef CONFIG_LIB_SEL4_TWINKLE_TRACE
+
+#include <assert.h>
+#include <string.h>
+
+#include <sel4/sel4.h>
+
+#include <twinkle/allocator.h>
+
+#include "trace.h"
+
+#define TRACE_ENTRIES CONFIG_LIB_SEL4_TWINKLE_TRACE_ENTRIES
+
+/*
+ * Forget everything we have traced.
+ */
+void
+trace_clear(struct allocator *allocator)
+{
+    memset(allocator->trace, 0, sizeof(allocator->trace));
+    allocator->trace_head = 0;
+    allocator->trace_syscalls = 0;
+    allocator->trace_start = 0;
+    allocator->trace_depth = 0;
+}
+
+/*
+ * Note that we have entered a public entry point.
+ */
+void
+trace_begin(struct allocator *allocator)
+{
+    if (allocator->trace_depth++ == 0) {
+        allocator->trace_start = allocator->trace_syscalls;
+    }
+}
+
+/*
+ * Note that we are leaving a public entry point, and record the call if it
+ * was not made from inside another.
+ */
+void
+trace_end(struct allocator *allocator, unsigned long op,
+          seL4_Word arg0, seL4_Word arg1, seL4_Word arg2, seL4_Word arg3,
+          seL4_Word result)
+{
+    struct allocator_trace_entry *entry;
+    unsigned long seq;
+
+    assert(allocator->trace_depth > 0);
+    if (--allocator->trace_depth > 0) {
+        return;
+    }
+
+    /* Claim the next entry, and mark it as being written. */
+    seq = __atomic_fetch_add(&allocator->trace_head, 1, __ATOMIC_RELAXED);
+    entry = &allocator->trace[seq % TRACE_ENTRIES];
+    __atomic_store_n(&entry->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    entry->op = op;
+    entry->args[0] = arg0;
+    entry->args[1] = arg1;
+    entry->args[2] = arg2;
+    entry->args[3] = arg3;
+    entry->result = result;
+    entry->syscalls = allocator->trace_syscalls - allocator->trace_start;
+
+    /* Publish it. */
+    __atomic_store_n(&entry->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Copy up to 'max_entries' of the most recent trace entries into 'entries',
+ * oldest first. Entries that are overwritten while we read them are left
+ * out; gaps in their 'seq' numbers show where.
+ *
+ * Returns the number of entries copied.
+ */
+int
+allocator_trace_read(struct allocator *allocator,
+                     struct allocator_trace_entry *entries, int max_entries)
+{
+    struct allocator_trace_entry *entry;
+    unsigned long head;
+    unsigned long seq;
+    int n = 0;
+
+    head = __atomic_load_n(&allocator->trace_head, __ATOMIC_ACQUIRE);
+    seq = head > TRACE_ENTRIES ? head - TRACE_ENTRIES : 0;
+    if (head - seq > max_entries) {
+        seq = head - max_entries;
+    }
+
+    for (; seq < head; seq++) {
+        entry = &allocator->trace[seq % TRACE_ENTRIES];
+        if (__atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE) != seq + 1) {
+            continue;
+        }
+        entries[n] = *entry;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&entry->seq, __ATOMIC_RELAXED) != seq + 1) {
+            continue;
+        }
+        n++;
+    }
+
+    return n;
+}
+
+/*
+ * Work out which cap in the replay corresponds to 'cap' in the trace, given
+ * the first 'n' entries of the trace and their replayed 'results'.
+ *
+ * Caps we know nothing about, such as those allocated before the trace
+ * starts, are assumed to be the same in both.
+ */
+static seL4_CPtr
+replay_cap(const struct allocator_trace_entry *entries,
+           const struct allocator_trace_entry *results, int n, seL4_CPtr cap)
+{
+    const struct allocator_trace_entry *entry;
+    seL4_Word count;
+
+    while (n-- > 0) {
+        entry = &entries[n];
+        switch (entry->op) {
+        case ALLOCATOR_TRACE_ALLOC_UNTYPED:
+        case ALLOCATOR_TRACE_ALLOC_UNTYPED_AT:
+            count = 1;
+            break;
+        case ALLOCATOR_TRACE_RETYPE:
+            count = entry->args[3];
+            break;
+        case ALLOCATOR_TRACE_ALLOC_CSLOTS:
+            count = entry->args[0];
+            break;
+        case ALLOCATOR_TRACE_RESET:
+        case ALLOCATOR_TRACE_RESET_BEGIN:
+        case ALLOCATOR_TRACE_RESET_WARM:
+            /* Nothing allocated before this is still around. */
+            return cap;
+        default:
+            continue;
+        }
+        if (entry->result && cap >= entry->result
+                && cap - entry->result < count) {
+            if (!results[n].result) {
+                return 0;
+            }
+            return results[n].result + (cap - entry->result);
+        }
+    }
+
+    return cap;
+}
+
+/*
+ * Make the calls recorded in 'entries' on 'allocator', which should have been
+ * set up with the same resources as the allocator they were traced on, and
+ * record what each call did in 'results'. Calls on caps that could not be
+ * allocated in the replay are skipped, and recorded with an 'op' of zero.
+ *
+ * Returns the number of calls that behaved differently: that were skipped,
+ * that succeeded in one run and failed in the other, or that made a different
+ * number of kernel invocations.
+ */
+int
+allocator_trace_replay(struct allocator *allocator,
+                       const struct allocator_trace_entry *entries,
+                       int num_entries, struct allocator_trace_entry *results)
+{
+    const struct allocator_trace_entry *entry;
+    struct allocator_trace_entry *result;
+    struct cap_range range;
+    seL4_CPtr cap;
+    unsigned long head;
+    int diverged = 0;
+    int i;
+
+    for (i = 0; i < num_entries; i++) {
+        entry = &entries[i];
+        result = &results[i];
+        head = allocator->trace_head;
+        cap = 0;
+
+        switch (entry->op) {
+        case ALLOCATOR_TRACE_ALLOC_UNTYPED:
+            allocator_alloc_untyped(allocator, entry->args[0]);
+            break;
+        case ALLOCATOR_TRACE_ALLOC_UNTYPED_AT:
+            allocator_alloc_untyped_at(allocator, entry->args[0],
+                                       entry->args[1]);
+            break;
+        case ALLOCATOR_TRACE_FREE_UNTYPED:
+            cap = replay_cap(entries, results, i, entry->args[0]);
+            if (cap) {
+                allocator_free_untyped(allocator, cap, entry->args[1]);
+            }
+            break;
+        case ALLOCATOR_TRACE_RETYPE:
+            cap = replay_cap(entries, results, i, entry->args[0]);
+            if (cap) {
+                allocator_retype_untyped_memory(allocator, cap,
+                                                entry->args[1], entry->args[2],
+                                                entry->args[3], &range);
+            }
+            break;
+        case ALLOCATOR_TRACE_ALLOC_CSLOTS:
+            allocator_alloc_cslots(allocator, entry->args[0]);
+            break;
+        case ALLOCATOR_TRACE_FREE_CSLOTS:
+            cap = replay_cap(entries, results, i, entry->args[0]);
+            if (cap) {
+                allocator_free_cslots(allocator, cap, entry->args[1]);
+            }
+            break;
+        case ALLOCATOR_TRACE_RESET:
+            allocator_reset(allocator);
+            break;
+        case ALLOCATOR_TRACE_RESET_WARM:
+            allocator_reset_warm(allocator);
+            break;
+        case ALLOCATOR_TRACE_MAINTAIN:
+            allocator_maintain(allocator, entry->args[0]);
+            break;
+        case ALLOCATOR_TRACE_RESET_BEGIN:
+            allocator_reset_begin(allocator);
+            break;
+        case ALLOCATOR_TRACE_RESET_CONTINUE:
+            allocator_reset_continue(allocator, entry->args[0]);
+            break;
+        default:
+            break;
+        }
+
+        /* Our own trace has the call we just made, unless we skipped it. */
+        if (allocator->trace_head == head) {
+            memset(result, 0, sizeof(*result));
+            diverged++;
+            continue;
+        }
+        *result = allocator->trace[(allocator->trace_head - 1) % TRACE_ENTRIES];
+        if (!result->result != !entry->result
+                || result->syscalls != entry->syscalls) {
+            diverged++;
+        }
+    }
+
+    return diverged;
+}
+
+#endif /* CONFIG_LIB_SEL4_TWINKLE_TRACE */
@@ -0,0 +1,51 @@
+/*
+ * Copyright 2014, NICTA
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(NICTA_BSD)
+ */
+
+/*
+ * Allocator call tracing.
+ *
+ * Public entry points bracket their work with TRACE_BEGIN() and TRACE_END(),
+ * and every kernel invocation is counted with TRACE_SYSCALL(). These compile
+ * away to nothing unless CONFIG_LIB_SEL4_TWINKLE_TRACE is set.
+ */
+
+#ifndef TWINKLE_TRACE_H
+#define TWINKLE_TRACE_H
+
+#include <autoconf.h>
+#include <sel4/sel4.h>
+
+#include <twinkle/allocator.h>
+
+#ifdef CONFIG_LIB_SEL4_TWINKLE_TRACE
+void
+trace_clear(struct allocator *allocator);
+
+void
+trace_begin(struct allocator *allocator);
+
+void
+trace_end(struct allocator *allocator, unsigned long op,
+          seL4_Word arg0, seL4_Word arg1, seL4_Word arg2, seL4_Word arg3,
+          seL4_Word result);
+
+# define TRACE_CLEAR(allocator) trace_clear(allocator)
+# define TRACE_BEGIN(allocator) trace_begin(allocator)
+# define TRACE_END(allocator, op, arg0, arg1, arg2, arg3, result) \
+    trace_end(allocator, op, arg0, arg1, arg2, arg3, result)
+# define TRACE_SYSCALL(allocator) ((allocator)->trace_syscalls++)
+#else
+# define TRACE_CLEAR(allocator) ((void)0)
+# define TRACE_BEGIN(allocator) ((void)0)
+# define TRACE_END(allocator, op, arg0, arg1, arg2, arg3, result) ((void)0)
+# define TRACE_SYSCALL(allocator) ((void)0)
+#endif
+
+#endif /* TWINKLE_TRACE_H */
@@ -19,6 +19,7 @@
 #include <sel4/sel4.h>
 
 #include <twinkle/allocator.h>
+#include <twinkle/object_allocator.h>
 #include <twinkle/vka.h>
 
 #include <vka/vka.h>
@@ -39,13 +40,17 @@ static inline void twinkle_vka_cspace_free(void *self, seL4_CPtr slot)
 static inline void twinkle_vka_cspace_make_path(void *self, seL4_CPtr slot, cspacepath_t *res)
 {
     struct allocator *allocator = (struct allocator *) self;
+    struct cslot_path path;
+
+    /* Slots may live in a CNode we added to grow the CSpace. */
+    allocator_cslot_path(allocator, slot, &path);
 
     res->capPtr = slot;
     res->capDepth = 32;
     res->root = allocator->root_cnode;
-    res->dest = allocator->root_cnode;
-    res->destDepth = allocator->root_cnode_depth;
-    res->offset = slot;
+    res->dest = path.cnode;
+    res->destDepth = path.depth;
+    res->offset = path.offset;
     res->window = 1;
 }
 
@@ -53,26 +58,51 @@ static inline void twinkle_vka_cspace_make_path(void *self, seL4_CPtr slot, cspa
 static inline int twinkle_vka_utspace_alloc(void *self, const cspacepath_t *dest, seL4_Word type,
                                             seL4_Word size_bits, uint32_t *res)
 {
+    struct allocator *allocator = (struct allocator *) self;
+    seL4_CPtr untyped_memory;
+    int error;
+
+    /* allocate the object straight into the slot we were given */
+    error = allocator_retype_kobject_at(allocator, type, size_bits, dest->capPtr,
+                                        &untyped_memory);
+    if (error) {
+        return error;
+    }
+
+    /* remember the untyped backing the object, so we can free it later */
+    *res = untyped_memory;
+    return 0;
+}
 
+static inline void twinkle_vka_utspace_free(void *self, seL4_Word type, seL4_Word size_bits,
+                                            uint32_t target)
+{
     struct allocator *allocator = (struct allocator *) self;
-    uint32_t ut_size_bits = vka_get_object_size(type, size_bits);
-    /* allocate untyped memory the size we want */
-    seL4_CPtr untyped_memory = allocator_alloc_untyped(allocator, ut_size_bits);
-    if (!untyped_memory) {
-        return -1;
+
+    /* objects carved out of a bump arena can't be freed individually */
+    if (!target) {
+        return;
     }
 
-#ifdef CONFIG_KERNEL_STABLE
-    /* retype into the type we want */
-    return seL4_Untyped_RetypeAtOffset(untyped_memory, type, 0, size_bits, seL4_CapInitThreadCNode,
-                                       allocator->root_cnode, allocator->root_cnode_depth,
-                                       dest->capPtr, 1);
-#else
-    return seL4_Untyped_Retype(untyped_memory, type, size_bits, seL4_CapInitThreadCNode,
-                               allocator->root_cnode, allocator->root_cnode_depth,
-                               dest->capPtr, 1);
-#endif
+    allocator_free_untyped(allocator, target, vka_get_object_size(type, size_bits));
+}
 
+static inline uintptr_t twinkle_vka_utspace_paddr(void *self, uint32_t target, seL4_Word type,
+                                                  seL4_Word size_bits)
+{
+    struct allocator *allocator = (struct allocator *) self;
+    seL4_Word paddr;
+
+    /* we don't know where objects carved out of a bump arena are */
+    if (!target) {
+        return 0;
+    }
+
+    paddr = allocator_untyped_paddr(allocator, target);
+    if (paddr == UNKNOWN_PADDR) {
+        return 0;
+    }
+    return paddr;
 }
 
 
@@ -84,11 +114,8 @@ twinkle_init_vka(vka_t* vka, struct allocator *allocator)
     vka->cspace_make_path = twinkle_vka_cspace_make_path;
     vka->utspace_alloc = twinkle_vka_utspace_alloc;
     vka->cspace_free = twinkle_vka_cspace_free;
-
-    /* twinkle does not implement these functions */
-    vka->utspace_free = dummy_vka_utspace_free;
-    vka->utspace_free = dummy_vka_utspace_free;
-    vka->utspace_paddr = dummy_vka_utspace_paddr;
+    vka->utspace_free = twinkle_vka_utspace_free;
+    vka->utspace_paddr = twinkle_vka_utspace_paddr;
 }
 
 #endif /* CONFIG_LIB_SEL4_VKA */
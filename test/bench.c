@@ -0,0 +1,167 @@
+/*
+ * Copyright 2014, NICTA
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(NICTA_BSD)
+ */
+
+/*
+ * Benchmarks of the allocator against the simulated kernel.
+ *
+ * For each workload we report how fast it runs on the host, how many kernel
+ * invocations and slots it needs per operation, and how fragmented free
+ * memory is at the end. The kernel invocation counts are what matter on
+ * real hardware; the host timings only catch regressions in our own code.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sel4/sel4.h>
+
+#include <twinkle/allocator.h>
+#include <twinkle/object_allocator.h>
+#include <twinkle/bootstrap.h>
+
+#include "mock.h"
+
+#define NUM_OBJECTS 2000
+
+static seL4_CPtr objects[NUM_OBJECTS];
+static unsigned long sizes[NUM_OBJECTS];
+
+static double
+now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Print a line of results for 'ops' operations that started at time 'start'.
+ */
+static void
+report(const char *name, struct allocator *allocator, long ops, double start)
+{
+    struct allocator_stats stats;
+    double elapsed = now() - start;
+    seL4_Word largest = 0;
+    int i;
+
+    allocator_get_stats(allocator, &stats);
+    for (i = 0; i < NUM_UNTYPED_SIZES; i++) {
+        if (stats.free_items[i]) {
+            largest = 1UL << (i + MIN_UNTYPED_SIZE);
+        }
+    }
+    printf("%-10s %10.0f ops/s %6.2f syscalls/op %6.2f slots/object "
+           "%5.1f%% fragmented\n",
+           name, ops / elapsed, (double)mock_counters.syscalls / ops,
+           (double)stats.slots_used / (mock_counters.objects ? mock_counters.objects : 1),
+           stats.bytes_free ? 100.0 * (1 - (double)largest / stats.bytes_free) : 0);
+}
+
+static struct allocator *
+boot(void)
+{
+    int size_bits[] = {26, 24, 22, 20};
+
+    mock_boot(4, size_bits, 30000);
+    return create_first_stage_allocator();
+}
+
+/*
+ * Allocate a batch of mixed objects from a fresh allocator.
+ */
+static void
+bench_boot(void)
+{
+    struct allocator *allocator;
+    double start;
+    int i;
+
+    allocator = boot();
+    start = now();
+    for (i = 0; i < NUM_OBJECTS; i++) {
+        objects[i] = allocator_alloc_kobject(allocator,
+                                             i % 3 ? seL4_EndpointObject
+                                             : seL4_TCBObject, 0);
+    }
+    report("boot", allocator, NUM_OBJECTS, start);
+}
+
+/*
+ * Allocate and free untyped items of random sizes.
+ */
+static void
+bench_churn(void)
+{
+    struct allocator *allocator;
+    double start;
+    long ops = 0;
+    int i, j;
+
+    allocator = boot();
+    memset(objects, 0, sizeof(objects));
+    srand(1);
+    start = now();
+    for (j = 0; j < 20; j++) {
+        for (i = 0; i < NUM_OBJECTS; i++) {
+            if (objects[i]) {
+                allocator_free_untyped(allocator, objects[i], sizes[i]);
+                objects[i] = 0;
+            } else if (rand() % 2) {
+                sizes[i] = 4 + rand() % 12;
+                objects[i] = allocator_alloc_untyped(allocator, sizes[i]);
+            }
+            ops++;
+        }
+    }
+    for (i = 0; i < NUM_OBJECTS; i++) {
+        if (objects[i]) {
+            allocator_free_untyped(allocator, objects[i], sizes[i]);
+            objects[i] = 0;
+        }
+    }
+    report("churn", allocator, ops, start);
+}
+
+/*
+ * Fill the allocator with objects and reset it, over and over.
+ */
+static void
+bench_reset(void)
+{
+    struct allocator *allocator;
+    double start;
+    long ops = 0;
+    int i, j;
+
+    allocator = boot();
+    start = now();
+    for (j = 0; j < 10; j++) {
+        for (i = 0; i < NUM_OBJECTS / 4; i++) {
+            allocator_alloc_kobject(allocator, seL4_EndpointObject, 0);
+            ops++;
+        }
+        allocator_reset(allocator);
+        ops++;
+    }
+    report("reset", allocator, ops, start);
+}
+
+int
+main(void)
+{
+    bench_boot();
+    bench_churn();
+    bench_reset();
+    return 0;
+}
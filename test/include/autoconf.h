@@ -0,0 +1,39 @@
+/*
+ * Copyright 2014, NICTA
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(NICTA_BSD)
+ */
+
+/*
+ * Configuration for host builds. TWINKLE_TEST_STABLE builds for the stable
+ * kernel API, and TWINKLE_TEST_ALL turns on every optional feature.
+ */
+
+#ifndef TEST_AUTOCONF_H
+#define TEST_AUTOCONF_H
+
+#define CONFIG_LIB_SEL4 1
+#define CONFIG_LIB_SEL4_VKA 1
+#define CONFIG_LIB_SEL4_TWINKLE 1
+#define CONFIG_ARCH_ARM 1
+#define CONFIG_ROOT_CNODE_SIZE_BITS 16
+#define CONFIG_LIB_SEL4_TWINKLE_BOOT_SPLITS 1024
+
+#ifdef TWINKLE_TEST_STABLE
+#define CONFIG_KERNEL_STABLE 1
+#endif
+
+#ifdef TWINKLE_TEST_ALL
+#define CONFIG_LIB_SEL4_TWINKLE_STATS 1
+#define CONFIG_LIB_SEL4_TWINKLE_TRACE 1
+#define CONFIG_LIB_SEL4_TWINKLE_TRACE_ENTRIES 64
+#define CONFIG_LIB_SEL4_TWINKLE_CACHE_COLOURING 1
+#define CONFIG_LIB_SEL4_TWINKLE_CACHE_WAY_BITS 16
+#define CONFIG_LIB_SEL4_TWINKLE_SELF_TEST 1
+#endif
+
+#endif /* TEST_AUTOCONF_H */
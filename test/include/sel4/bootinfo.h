@@ -0,0 +1,30 @@
+/*
+ * Copyright 2014, NICTA
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(NICTA_BSD)
+ */
+
+#ifndef TEST_BOOTINFO_H
+#define TEST_BOOTINFO_H
+
+#include <sel4/sel4.h>
+
+typedef struct {
+    seL4_Word start;
+    seL4_Word end;
+} seL4_SlotRegion;
+
+typedef struct {
+    seL4_SlotRegion empty;
+    seL4_SlotRegion untyped;
+    seL4_Word untypedPaddrList[167];
+    uint8_t untypedSizeBitsList[167];
+} seL4_BootInfo;
+
+seL4_BootInfo *seL4_GetBootInfo(void);
+
+#endif /* TEST_BOOTINFO_H */
@@ -0,0 +1,89 @@
+/*
+ * Copyright 2014, NICTA
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(NICTA_BSD)
+ */
+
+/*
+ * The parts of the seL4 API the library uses, implemented by test/mock.c.
+ */
+
+#ifndef TEST_SEL4_H
+#define TEST_SEL4_H
+
+#include <stdint.h>
+
+#include <autoconf.h>
+
+typedef unsigned long seL4_Word;
+typedef seL4_Word seL4_CPtr;
+typedef seL4_Word seL4_CapRights;
+typedef seL4_Word seL4_ARM_VMAttributes;
+
+#define seL4_WordBits 32
+#define seL4_PageBits 12
+#define seL4_SlotBits 4
+#define seL4_TCBBits 9
+#define seL4_EndpointBits 4
+#define seL4_AsyncEndpointBits 4
+#define seL4_PageTableBits 10
+#define seL4_PageDirBits 14
+#define seL4_LargePageBits 16
+#define seL4_SectionBits 20
+#define seL4_SuperSectionBits 24
+
+#define seL4_CapInitThreadCNode 2
+#define seL4_CapInitThreadPD 3
+
+#define seL4_AllRights 7
+#define seL4_ARM_Default_VMAttributes 0
+
+enum {
+    seL4_NoError = 0,
+    seL4_InvalidArgument,
+    seL4_InvalidCapability,
+    seL4_IllegalOperation,
+    seL4_RangeError,
+    seL4_AlignmentError,
+    seL4_FailedLookup,
+    seL4_TruncatedMessage,
+    seL4_DeleteFirst,
+    seL4_RevokeFirst,
+    seL4_NotEnoughMemory
+};
+
+enum {
+    seL4_UntypedObject = 1,
+    seL4_TCBObject,
+    seL4_EndpointObject,
+    seL4_AsyncEndpointObject,
+    seL4_CapTableObject,
+    seL4_ARM_SmallPageObject,
+    seL4_ARM_LargePageObject,
+    seL4_ARM_SectionObject,
+    seL4_ARM_SuperSectionObject,
+    seL4_ARM_PageTableObject,
+    seL4_ARM_PageDirectoryObject
+};
+
+int seL4_Untyped_Retype(seL4_CPtr service, int type, int size_bits,
+                        seL4_CPtr root, int node_index, int node_depth,
+                        int node_offset, int num_objects);
+int seL4_Untyped_RetypeAtOffset(seL4_CPtr service, int type, int offset,
+                                int size_bits, seL4_CPtr root, int node_index,
+                                int node_depth, int node_offset,
+                                int num_objects);
+int seL4_CNode_Recycle(seL4_CPtr service, seL4_Word index, uint8_t depth);
+int seL4_CNode_Revoke(seL4_CPtr service, seL4_Word index, uint8_t depth);
+int seL4_CNode_Delete(seL4_CPtr service, seL4_Word index, uint8_t depth);
+int seL4_ARM_Page_Map(seL4_CPtr page, seL4_CPtr pd, seL4_Word vaddr,
+                      seL4_CapRights rights, seL4_ARM_VMAttributes attr);
+int seL4_ARM_PageTable_Map(seL4_CPtr pt, seL4_CPtr pd, seL4_Word vaddr,
+                           seL4_ARM_VMAttributes attr);
+void seL4_Yield(void);
+
+#endif /* TEST_SEL4_H */
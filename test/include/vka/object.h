@@ -0,0 +1,47 @@
+/*
+ * Copyright 2014, NICTA
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(NICTA_BSD)
+ */
+
+#ifndef TEST_VKA_OBJECT_H
+#define TEST_VKA_OBJECT_H
+
+#include <sel4/sel4.h>
+
+static inline seL4_Word
+vka_get_object_size(seL4_Word type, seL4_Word size)
+{
+    switch (type) {
+    case seL4_UntypedObject:
+        return size;
+    case seL4_TCBObject:
+        return seL4_TCBBits;
+    case seL4_EndpointObject:
+        return seL4_EndpointBits;
+    case seL4_AsyncEndpointObject:
+        return seL4_AsyncEndpointBits;
+    case seL4_CapTableObject:
+        return seL4_SlotBits + size;
+    case seL4_ARM_SmallPageObject:
+        return seL4_PageBits;
+    case seL4_ARM_LargePageObject:
+        return seL4_LargePageBits;
+    case seL4_ARM_SectionObject:
+        return seL4_SectionBits;
+    case seL4_ARM_SuperSectionObject:
+        return seL4_SuperSectionBits;
+    case seL4_ARM_PageTableObject:
+        return seL4_PageTableBits;
+    case seL4_ARM_PageDirectoryObject:
+        return seL4_PageDirBits;
+    default:
+        return 0;
+    }
+}
+
+#endif /* TEST_VKA_OBJECT_H */
@@ -0,0 +1,54 @@
+/*
+ * Copyright 2014, NICTA
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(NICTA_BSD)
+ */
+
+#ifndef TEST_VKA_H
+#define TEST_VKA_H
+
+#include <stdint.h>
+
+#include <sel4/sel4.h>
+
+typedef struct {
+    seL4_CPtr capPtr;
+    seL4_Word capDepth;
+    seL4_CPtr root;
+    seL4_CPtr dest;
+    seL4_Word destDepth;
+    seL4_Word offset;
+    seL4_Word window;
+} cspacepath_t;
+
+typedef struct {
+    void *data;
+    int (*cspace_alloc)(void *data, seL4_CPtr *res);
+    void (*cspace_make_path)(void *data, seL4_CPtr slot, cspacepath_t *res);
+    int (*utspace_alloc)(void *data, const cspacepath_t *dest, seL4_Word type,
+                         seL4_Word size_bits, uint32_t *res);
+    void (*cspace_free)(void *data, seL4_CPtr slot);
+    void (*utspace_free)(void *data, seL4_Word type, seL4_Word size_bits,
+                         uint32_t target);
+    uintptr_t (*utspace_paddr)(void *data, uint32_t target, seL4_Word type,
+                               seL4_Word size_bits);
+} vka_t;
+
+static inline void
+dummy_vka_utspace_free(void *data, seL4_Word type, seL4_Word size_bits,
+                       uint32_t target)
+{
+}
+
+static inline uintptr_t
+dummy_vka_utspace_paddr(void *data, uint32_t target, seL4_Word type,
+                        seL4_Word size_bits)
+{
+    return 0;
+}
+
+#endif /* TEST_VKA_H */
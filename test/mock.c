@@ -0,0 +1,373 @@
+/*
+ * Copyright 2014, NICTA
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(NICTA_BSD)
+ */
+
+/*
+ * A simulated seL4 kernel; see mock.h.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <sel4/sel4.h>
+#include <sel4/bootinfo.h>
+#include <vka/object.h>
+
+#include "mock.h"
+
+#define ARRAY_SIZE(x) ((int)(sizeof(x) / sizeof((x)[0])))
+
+struct mock_counters mock_counters;
+
+static struct mock_cap caps[MOCK_NUM_CAPS];
+static seL4_BootInfo bootinfo;
+
+/* Caps about to be destroyed by a revoke. */
+static char doomed[MOCK_NUM_CAPS];
+
+/* Which 1 MiB sections of the address space have page tables. */
+static char page_tables[1 << 12];
+
+/* Invocations of each kind to let through before failing one, or -1, and
+ * the error to fail it with. */
+static int fail_after[MOCK_NUM_OPS];
+static int fail_error[MOCK_NUM_OPS];
+
+/*
+ * Make the invocation 'op' fail with 'error' after letting 'after' more of
+ * them through.
+ */
+void
+mock_fail(enum mock_op op, int after, int error)
+{
+    fail_after[op] = after;
+    fail_error[op] = error;
+}
+
+/*
+ * Count an invocation of 'op', returning the error to fail it with, if any.
+ */
+static int
+invoke(enum mock_op op)
+{
+    mock_counters.syscalls++;
+    if (fail_after[op] < 0) {
+        return 0;
+    }
+    if (fail_after[op]-- > 0) {
+        return 0;
+    }
+    return fail_error[op];
+}
+
+/*
+ * Set up a fresh kernel with 'num_untyped' untyped items of the given sizes,
+ * followed by 'num_empty' empty slots.
+ */
+void
+mock_boot(int num_untyped, const int *size_bits, int num_empty)
+{
+    seL4_Word paddr = 0x10000000;
+    struct mock_cap *cap;
+    int i;
+
+    memset(caps, 0, sizeof(caps));
+    memset(page_tables, 0, sizeof(page_tables));
+    memset(&mock_counters, 0, sizeof(mock_counters));
+    memset(&bootinfo, 0, sizeof(bootinfo));
+    for (i = 0; i < MOCK_NUM_OPS; i++) {
+        fail_after[i] = -1;
+    }
+
+    bootinfo.untyped.start = MOCK_FIRST_UNTYPED;
+    bootinfo.untyped.end = MOCK_FIRST_UNTYPED + num_untyped;
+    for (i = 0; i < num_untyped; i++) {
+        paddr = (paddr + (1UL << size_bits[i]) - 1)
+                & ~((1UL << size_bits[i]) - 1);
+        cap = &caps[MOCK_FIRST_UNTYPED + i];
+        cap->type = seL4_UntypedObject;
+        cap->size_bits = size_bits[i];
+        cap->paddr = paddr;
+        cap->parent = -1;
+        /* Bootinfo can only describe so many; the rest can still be
+         * handed to allocator_create() directly. */
+        if (i < ARRAY_SIZE(bootinfo.untypedSizeBitsList)) {
+            bootinfo.untypedSizeBitsList[i] = size_bits[i];
+            bootinfo.untypedPaddrList[i] = paddr;
+        }
+        paddr += 1UL << size_bits[i];
+    }
+    bootinfo.empty.start = bootinfo.untyped.end;
+    bootinfo.empty.end = bootinfo.empty.start + num_empty;
+}
+
+seL4_BootInfo *
+seL4_GetBootInfo(void)
+{
+    return &bootinfo;
+}
+
+struct mock_cap *
+mock_cap(seL4_CPtr slot)
+{
+    return slot < MOCK_NUM_CAPS ? &caps[slot] : NULL;
+}
+
+/*
+ * Count the slots holding caps, other than the boot untyped items.
+ */
+long
+mock_used_slots(void)
+{
+    long count = 0;
+    long i;
+
+    for (i = bootinfo.untyped.end; i < MOCK_NUM_CAPS; i++) {
+        if (caps[i].type) {
+            count++;
+        }
+    }
+    return count;
+}
+
+/*
+ * Empty slot 'slot', unmapping whatever is in it.
+ */
+static void
+clear_cap(long slot)
+{
+    if (caps[slot].type == seL4_ARM_PageTableObject && caps[slot].mapped > 0) {
+        page_tables[caps[slot].vaddr >> seL4_SectionBits] = 0;
+    }
+    memset(&caps[slot], 0, sizeof(caps[slot]));
+}
+
+/*
+ * Empty slot 'slot', handing its children to its parent.
+ */
+static void
+delete_cap(long slot)
+{
+    long i;
+
+    if (caps[slot].num_children) {
+        for (i = 0; i < MOCK_NUM_CAPS; i++) {
+            if (caps[i].type && caps[i].parent == slot) {
+                caps[i].parent = caps[slot].parent;
+            }
+        }
+    }
+    if (caps[slot].parent >= 0) {
+        caps[caps[slot].parent].num_children--;
+        caps[caps[slot].parent].num_children += caps[slot].num_children;
+    }
+    clear_cap(slot);
+}
+
+/*
+ * Return non-zero if the cap in 'slot' was derived from 'ancestor'.
+ */
+static int
+is_descendant(long slot, long ancestor)
+{
+    long parent;
+
+    for (parent = caps[slot].parent; parent >= 0;
+            parent = caps[parent].parent) {
+        if (parent == ancestor) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int
+retype(seL4_CPtr service, int type, long offset, int size, int node_index,
+       int node_offset, int num_objects, int at_offset)
+{
+    struct mock_cap *untyped;
+    unsigned long object_bits;
+    seL4_Word watermark;
+    long base;
+    int error;
+    int i;
+
+    error = invoke(MOCK_RETYPE);
+    mock_counters.retypes++;
+    if (error) {
+        return error;
+    }
+    if (service >= MOCK_NUM_CAPS || caps[service].type != seL4_UntypedObject) {
+        return seL4_InvalidCapability;
+    }
+    if (type == seL4_UntypedObject && size < 4) {
+        return seL4_InvalidArgument;
+    }
+    untyped = &caps[service];
+    object_bits = vka_get_object_size(type, size);
+
+    /* Slots of CNodes other than our root follow on from the CNode's own
+     * slot. */
+    base = node_offset;
+    if (node_index != seL4_CapInitThreadCNode) {
+        base += node_index;
+    }
+    for (i = 0; i < num_objects; i++) {
+        if (base + i < MOCK_FIRST_UNTYPED || base + i >= MOCK_NUM_CAPS
+                || caps[base + i].type) {
+            return seL4_DeleteFirst;
+        }
+    }
+
+    if (at_offset) {
+        watermark = offset;
+    } else {
+        watermark = untyped->num_children ? untyped->watermark : 0;
+    }
+    watermark = (watermark + (1UL << object_bits) - 1)
+                & ~((1UL << object_bits) - 1);
+    if (watermark + ((seL4_Word)num_objects << object_bits)
+            > (1UL << untyped->size_bits)) {
+        return seL4_NotEnoughMemory;
+    }
+
+    for (i = 0; i < num_objects; i++) {
+        memset(&caps[base + i], 0, sizeof(caps[base + i]));
+        caps[base + i].type = type;
+        caps[base + i].size_bits = object_bits;
+        caps[base + i].paddr = untyped->paddr + watermark
+                               + ((seL4_Word)i << object_bits);
+        caps[base + i].parent = service;
+    }
+    untyped->num_children += num_objects;
+    untyped->watermark = watermark + ((seL4_Word)num_objects << object_bits);
+    mock_counters.objects += num_objects;
+    return 0;
+}
+
+int
+seL4_Untyped_Retype(seL4_CPtr service, int type, int size_bits,
+                    seL4_CPtr root, int node_index, int node_depth,
+                    int node_offset, int num_objects)
+{
+    return retype(service, type, 0, size_bits, node_index, node_offset,
+                  num_objects, 0);
+}
+
+int
+seL4_Untyped_RetypeAtOffset(seL4_CPtr service, int type, int offset,
+                            int size_bits, seL4_CPtr root, int node_index,
+                            int node_depth, int node_offset, int num_objects)
+{
+    return retype(service, type, offset, size_bits, node_index, node_offset,
+                  num_objects, 1);
+}
+
+int
+seL4_CNode_Revoke(seL4_CPtr service, seL4_Word index, uint8_t depth)
+{
+    long i;
+    int error;
+
+    error = invoke(MOCK_REVOKE);
+    if (error) {
+        return error;
+    }
+    if (index >= MOCK_NUM_CAPS || !caps[index].type) {
+        return seL4_FailedLookup;
+    }
+
+    /* Children come after their parents in the derivation tree, so mark
+     * everything first and then empty the slots. */
+    if (caps[index].num_children) {
+        for (i = 0; i < MOCK_NUM_CAPS; i++) {
+            doomed[i] = caps[i].type && is_descendant(i, index);
+        }
+        for (i = 0; i < MOCK_NUM_CAPS; i++) {
+            if (doomed[i]) {
+                clear_cap(i);
+            }
+        }
+    }
+    caps[index].num_children = 0;
+    caps[index].watermark = 0;
+    return 0;
+}
+
+int
+seL4_CNode_Recycle(seL4_CPtr service, seL4_Word index, uint8_t depth)
+{
+    return seL4_CNode_Revoke(service, index, depth);
+}
+
+int
+seL4_CNode_Delete(seL4_CPtr service, seL4_Word index, uint8_t depth)
+{
+    int error;
+
+    error = invoke(MOCK_DELETE);
+    if (error) {
+        return error;
+    }
+    if (index < MOCK_NUM_CAPS && caps[index].type) {
+        delete_cap(index);
+    }
+    return 0;
+}
+
+int
+seL4_ARM_Page_Map(seL4_CPtr page, seL4_CPtr pd, seL4_Word vaddr,
+                  seL4_CapRights rights, seL4_ARM_VMAttributes attr)
+{
+    int error;
+
+    error = invoke(MOCK_PAGE_MAP);
+    mock_counters.maps++;
+    if (error) {
+        return error;
+    }
+    if (page >= MOCK_NUM_CAPS || !caps[page].type) {
+        return seL4_InvalidCapability;
+    }
+    if (caps[page].size_bits < seL4_SectionBits
+            && !page_tables[vaddr >> seL4_SectionBits]) {
+        return seL4_FailedLookup;
+    }
+    caps[page].mapped = 1;
+    caps[page].vaddr = vaddr;
+    return 0;
+}
+
+int
+seL4_ARM_PageTable_Map(seL4_CPtr pt, seL4_CPtr pd, seL4_Word vaddr,
+                       seL4_ARM_VMAttributes attr)
+{
+    int error;
+
+    error = invoke(MOCK_PAGE_TABLE_MAP);
+    mock_counters.maps++;
+    if (error) {
+        return error;
+    }
+    if (pt >= MOCK_NUM_CAPS || caps[pt].type != seL4_ARM_PageTableObject) {
+        return seL4_InvalidCapability;
+    }
+    if (page_tables[vaddr >> seL4_SectionBits]) {
+        return seL4_DeleteFirst;
+    }
+    page_tables[vaddr >> seL4_SectionBits] = 1;
+    caps[pt].mapped = 1;
+    caps[pt].vaddr = vaddr;
+    return 0;
+}
+
+void
+seL4_Yield(void)
+{
+}
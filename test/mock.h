@@ -0,0 +1,77 @@
+/*
+ * Copyright 2014, NICTA
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(NICTA_BSD)
+ */
+
+/*
+ * A simulated seL4 kernel for running the library on a host.
+ *
+ * The CSpace is a single flat array of cap slots. Untyped items hand out
+ * memory from a watermark, which goes back to the start once they have no
+ * children left, and revoking or recycling a cap destroys everything derived
+ * from it. Every invocation is counted, and any of them can be made to fail.
+ */
+
+#ifndef TEST_MOCK_H
+#define TEST_MOCK_H
+
+#include <sel4/sel4.h>
+
+/* Number of cap slots in the simulated CSpace. */
+#define MOCK_NUM_CAPS 65536
+
+/* First slot after the boot untyped items. */
+#define MOCK_FIRST_UNTYPED 16
+
+/* What is in a cap slot. An empty slot has a 'type' of zero. */
+struct mock_cap {
+    int type;
+    unsigned long size_bits;
+    seL4_Word paddr;
+    /* The cap this one was derived from, or -1. */
+    long parent;
+    unsigned long num_children;
+    /* For untyped items, the offset of the first free byte. */
+    seL4_Word watermark;
+    /* Whether the frame or page table is mapped, and where. */
+    int mapped;
+    seL4_Word vaddr;
+};
+
+/* Invocations that can be made to fail with mock_fail(). */
+enum mock_op {
+    MOCK_RETYPE,
+    MOCK_REVOKE,
+    MOCK_DELETE,
+    MOCK_PAGE_MAP,
+    MOCK_PAGE_TABLE_MAP,
+    MOCK_NUM_OPS
+};
+
+struct mock_counters {
+    unsigned long syscalls;
+    unsigned long retypes;
+    unsigned long objects;
+    unsigned long maps;
+};
+
+extern struct mock_counters mock_counters;
+
+void
+mock_boot(int num_untyped, const int *size_bits, int num_empty);
+
+struct mock_cap *
+mock_cap(seL4_CPtr slot);
+
+long
+mock_used_slots(void);
+
+void
+mock_fail(enum mock_op op, int after, int error);
+
+#endif /* TEST_MOCK_H */
@@ -0,0 +1,1223 @@
+/*
+ * Copyright 2014, NICTA
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(NICTA_BSD)
+ */
+
+/*
+ * Checks of the allocator against the simulated kernel.
+ *
+ * Each test boots a fresh kernel. Failed checks are reported and counted,
+ * and the program exits non-zero if there were any.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <sel4/sel4.h>
+#include <sel4/bootinfo.h>
+
+#include <twinkle/allocator.h>
+#include <twinkle/object_allocator.h>
+#include <twinkle/bootstrap.h>
+#include <twinkle/magazine.h>
+#include <twinkle/mapping.h>
+#include <twinkle/object_cache.h>
+
+#include "mock.h"
+
+static int failures;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", \
+                    __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+/*
+ * Boot a kernel with the given untyped items and empty slots, and create the
+ * first-stage allocator on it.
+ */
+static struct allocator *
+boot(int num_untyped, const int *size_bits, int num_empty)
+{
+    mock_boot(num_untyped, size_bits, num_empty);
+    return create_first_stage_allocator();
+}
+
+/*
+ * Freeing everything that was split up lets a whole item be allocated again.
+ */
+static void
+test_split_merge(void)
+{
+    static seL4_CPtr items[256];
+    struct allocator *allocator;
+    int sizes[] = {22};
+    seL4_CPtr cap;
+    int i;
+
+    allocator = boot(1, sizes, 4000);
+    for (i = 0; i < 256; i++) {
+        items[i] = allocator_alloc_untyped(allocator, 12);
+        CHECK(items[i]);
+    }
+    CHECK(!allocator_alloc_untyped(allocator, 22));
+    for (i = 0; i < 256; i++) {
+        allocator_free_untyped(allocator, items[i], 12);
+    }
+
+    cap = allocator_alloc_untyped(allocator, 22);
+    CHECK(cap == MOCK_FIRST_UNTYPED);
+    allocator_free_untyped(allocator, cap, 22);
+    CHECK(allocator->num_slots_used == 0);
+}
+
+/*
+ * Splitting a big item down to a small allocation uses no more slots than
+ * halving it would, plus one wide split at the bottom.
+ */
+static void
+test_split_down(void)
+{
+    struct allocator *allocator;
+    int sizes[] = {28};
+    unsigned long retypes;
+
+    allocator = boot(1, sizes, 4000);
+    retypes = mock_counters.retypes;
+    CHECK(allocator_alloc_untyped(allocator, 4));
+    CHECK(allocator->num_slots_used == 56);
+    CHECK(mock_counters.retypes - retypes == 11);
+
+    /* Short of slots, we halve instead. */
+    allocator = boot(1, sizes, 200);
+    retypes = mock_counters.retypes;
+    CHECK(allocator_alloc_untyped(allocator, 4));
+    CHECK(allocator->num_slots_used == 2 * (28 - 4));
+    CHECK(mock_counters.retypes - retypes == 28 - 4);
+}
+
+/*
+ * Items can be allocated at a given physical address, through the splits
+ * already covering it.
+ */
+static void
+test_alloc_at(void)
+{
+    struct allocator *allocator;
+    int sizes[] = {22};
+    seL4_Word base;
+    seL4_CPtr cap;
+
+    allocator = boot(1, sizes, 4000);
+    base = mock_cap(MOCK_FIRST_UNTYPED)->paddr;
+    CHECK(allocator_alloc_untyped(allocator, 12));
+
+    cap = allocator_alloc_untyped_at(allocator, base + 0x200000, 12);
+    CHECK(cap && mock_cap(cap)->paddr == base + 0x200000);
+    CHECK(allocator_untyped_paddr(allocator, cap) == base + 0x200000);
+    CHECK(!allocator_alloc_untyped_at(allocator, base + 0x200000, 12));
+    CHECK(!allocator_alloc_untyped_at(allocator, base + 0x400000, 12));
+}
+
+/*
+ * Splits whose caps were deleted to free up slots are still merged once
+ * everything split from them is free.
+ */
+static void
+test_merge_reclaimed(void)
+{
+    static seL4_CPtr items[4096];
+    struct allocator *allocator;
+    int sizes[] = {24};
+    int n;
+
+    allocator = boot(1, sizes, 400);
+    for (n = 0; n < 4096; n++) {
+        items[n] = allocator_alloc_untyped(allocator, 12);
+        if (!items[n]) {
+            break;
+        }
+    }
+    CHECK(n > 300);
+    while (n-- > 0) {
+        allocator_free_untyped(allocator, items[n], 12);
+    }
+
+    CHECK(allocator_alloc_untyped(allocator, 24) == MOCK_FIRST_UNTYPED);
+    CHECK(allocator->num_slots_used == 0);
+    CHECK(mock_used_slots() == 0);
+}
+
+/* The bit for items of 'size_bits' bits in the allocator's size bitmaps. */
+#define SIZE_BIT(size_bits) (1UL << ((size_bits) - MIN_UNTYPED_SIZE))
+
+/*
+ * Free initial items are found by size without splitting anything, and the
+ * sizes available are tracked as they come and go.
+ */
+static void
+test_size_index(void)
+{
+    struct allocator *allocator;
+    unsigned long retypes;
+    int sizes[100];
+    seL4_CPtr cap;
+    int i;
+
+    for (i = 0; i < 99; i++) {
+        sizes[i] = i % 2 ? 14 : 12;
+    }
+    sizes[99] = 20;
+    allocator = boot(100, sizes, 4000);
+    CHECK(allocator->untyped_sizes_available
+          == (SIZE_BIT(12) | SIZE_BIT(14) | SIZE_BIT(20)));
+
+    retypes = mock_counters.retypes;
+    CHECK(allocator_alloc_untyped(allocator, 20) == MOCK_FIRST_UNTYPED + 99);
+    cap = allocator_alloc_untyped(allocator, 14);
+    CHECK(cap && mock_cap(cap)->size_bits == 14);
+    CHECK(mock_counters.retypes == retypes);
+    CHECK(!(allocator->untyped_sizes_available & SIZE_BIT(20)));
+
+    allocator_free_untyped(allocator, MOCK_FIRST_UNTYPED + 99, 20);
+    CHECK(allocator->untyped_sizes_available & SIZE_BIT(20));
+}
+
+/*
+ * Memory split up at boot serves allocations of the sizes asked for without
+ * any further kernel invocations.
+ */
+static void
+test_presplit(void)
+{
+    static const struct untyped_profile profile[] = {
+        {12, 40},
+        {16, 10},
+    };
+    struct allocator_stats stats;
+    struct allocator *allocator;
+    int sizes[] = {22};
+    unsigned long syscalls;
+    int i;
+
+    mock_boot(1, sizes, 4000);
+    allocator = create_first_stage_allocator_presplit(profile, 2);
+    allocator_get_stats(allocator, &stats);
+    CHECK(stats.free_items[12 - MIN_UNTYPED_SIZE] >= 40);
+    CHECK(stats.free_items[16 - MIN_UNTYPED_SIZE] >= 10);
+
+    syscalls = mock_counters.syscalls;
+    for (i = 0; i < 40; i++) {
+        CHECK(allocator_alloc_untyped(allocator, 12));
+    }
+    for (i = 0; i < 10; i++) {
+        CHECK(allocator_alloc_untyped(allocator, 16));
+    }
+    CHECK(mock_counters.syscalls == syscalls);
+}
+
+/*
+ * Idle-time maintenance tops the pools up to their targets a bounded amount
+ * at a time, after which allocations of those sizes need no splitting.
+ */
+static void
+test_maintain(void)
+{
+    static const struct untyped_profile targets[] = {
+        {12, 64},
+    };
+    struct allocator_stats stats;
+    struct allocator *allocator;
+    int sizes[] = {22};
+    unsigned long missing;
+    unsigned long syscalls;
+    int calls = 0;
+    int i;
+
+    allocator = boot(1, sizes, 4000);
+    allocator_set_pool_targets(allocator, targets, 1);
+    do {
+        missing = allocator_maintain(allocator, 1);
+        calls++;
+    } while (missing && calls < 100);
+    CHECK(!missing);
+    CHECK(calls > 1);
+    allocator_get_stats(allocator, &stats);
+    CHECK(stats.free_items[12 - MIN_UNTYPED_SIZE] >= 64);
+
+    syscalls = mock_counters.syscalls;
+    for (i = 0; i < 64; i++) {
+        CHECK(allocator_alloc_untyped(allocator, 12));
+    }
+    CHECK(mock_counters.syscalls == syscalls);
+
+    /* Once the pools are short again, there is more to do. */
+    CHECK(allocator_maintain(allocator, 0) > 0);
+}
+
+/*
+ * Allocators can be created with more items than the default storage
+ * holds, and children can take all of them. Slot ranges too big for the
+ * storage given are refused.
+ */
+static void
+test_create_storage(void)
+{
+    static struct untyped_item items[300];
+    static struct init_untyped_item item_storage[300];
+    static struct init_untyped_item child_items[300];
+    static struct untyped_split splits[16];
+    static struct untyped_split child_splits[16];
+    static seL4_Word cslot_words[CSLOT_STORAGE_WORDS(2000)];
+    static seL4_Word child_cslot_words[CSLOT_STORAGE_WORDS(2000)];
+    static struct journal_entry journal[16];
+    static struct journal_entry child_journal[16];
+    static struct default_allocator small;
+    static struct allocator parent, child;
+    struct allocator_storage storage;
+    struct allocator_stats stats;
+    int sizes[300];
+    int i;
+
+    for (i = 0; i < 300; i++) {
+        sizes[i] = 12;
+        items[i].cap = MOCK_FIRST_UNTYPED + i;
+        items[i].size_bits = 12;
+    }
+    mock_boot(300, sizes, 4000);
+
+    CHECK(allocator_create(&small, seL4_CapInitThreadCNode, seL4_WordBits, 0,
+                           MOCK_FIRST_UNTYPED + 300, 2000, items, 20) == 0);
+    CHECK(small.allocator.num_init_untyped_items == 20);
+
+    storage.items = item_storage;
+    storage.max_items = 300;
+    storage.splits = splits;
+    storage.max_splits = 16;
+    storage.cslot_words = cslot_words;
+    storage.max_cslots = 1000;
+    storage.journal = journal;
+    storage.max_journal_entries = 16;
+    CHECK(allocator_create_with_storage(&parent, seL4_CapInitThreadCNode,
+                                        seL4_WordBits, 0,
+                                        MOCK_FIRST_UNTYPED + 300, 2000,
+                                        items, 300, &storage) == -1);
+    storage.max_cslots = 2000;
+    CHECK(allocator_create_with_storage(&parent, seL4_CapInitThreadCNode,
+                                        seL4_WordBits, 0,
+                                        MOCK_FIRST_UNTYPED + 300, 2000,
+                                        items, 300, &storage) == 0);
+    CHECK(parent.num_init_untyped_items == 300);
+    CHECK(parent.num_cslots == 2000);
+
+    storage.items = child_items;
+    storage.splits = child_splits;
+    storage.cslot_words = child_cslot_words;
+    storage.journal = child_journal;
+    CHECK(allocator_create_child_with_storage(&parent, &child,
+                                              seL4_CapInitThreadCNode,
+                                              seL4_WordBits, 0,
+                                              MOCK_FIRST_UNTYPED + 2300, 2000,
+                                              &storage) == 0);
+    CHECK(child.num_init_untyped_items == 300);
+    allocator_get_stats(&child, &stats);
+    CHECK(stats.bytes_free == 300 << 12);
+
+    /* The first-stage allocator takes every free slot of the root CNode. */
+    CHECK(boot(1, sizes, 60000)->num_cslots == 60000);
+}
+
+/*
+ * A lazy child takes nothing from its parent up front, borrows a chunk at a
+ * time up to its quota, and gives it all back when destroyed.
+ */
+static void
+test_lazy_child(void)
+{
+    static struct default_allocator child;
+    struct allocator_stats before, stats;
+    struct allocator *parent;
+    int sizes[] = {22};
+
+    parent = boot(1, sizes, 4000);
+    allocator_get_stats(parent, &before);
+    CHECK(allocator_create_lazy_child(parent, &child, seL4_CapInitThreadCNode,
+                                      seL4_WordBits, 0,
+                                      MOCK_FIRST_UNTYPED + 5000, 1000,
+                                      16, 2 << 16) == 0);
+    allocator_get_stats(parent, &stats);
+    CHECK(stats.bytes_free == before.bytes_free);
+
+    CHECK(allocator_alloc_untyped(&child.allocator, 12));
+    allocator_get_stats(parent, &stats);
+    CHECK(stats.bytes_free == before.bytes_free - (1 << 16));
+    CHECK(child.allocator.borrowed == 1 << 16);
+
+    CHECK(allocator_alloc_untyped(&child.allocator, 16));
+    CHECK(!allocator_alloc_untyped(&child.allocator, 16));
+    CHECK(child.allocator.borrowed == 2 << 16);
+
+    allocator_destroy(&child.allocator);
+    allocator_get_stats(parent, &stats);
+    CHECK(stats.bytes_free == before.bytes_free);
+}
+
+/*
+ * An allocator allowed to grow its CSpace creates CNodes out of its own memory
+ * when it runs short of slots, and hands out slots in them.
+ */
+static void
+test_cspace_growth(void)
+{
+    struct allocator *allocator;
+    int sizes[] = {22};
+    seL4_CPtr slot;
+    int grown = 0;
+    int i;
+
+    allocator = boot(1, sizes, 100);
+    allocator_enable_cspace_growth(allocator, seL4_CapInitThreadCNode,
+                                   seL4_WordBits, 200, 16, 8);
+    for (i = 0; i < 1000; i++) {
+        slot = allocator_alloc_kobject(allocator, seL4_EndpointObject, 0);
+        CHECK(slot && mock_cap(slot)->type == seL4_EndpointObject);
+        if (slot >= 200 << 8) {
+            grown++;
+        }
+    }
+    CHECK(allocator->num_cspace_extensions > 0);
+    CHECK(mock_cap(200)->type == seL4_CapTableObject);
+    CHECK(grown > 900);
+    CHECK(allocator->num_cslots
+          == 100 + ((unsigned long)allocator->num_cspace_extensions << 8));
+}
+
+/*
+ * Running out of split records doesn't stop small objects being allocated:
+ * they are carved out of whole free items instead.
+ */
+static void
+test_split_exhaustion(void)
+{
+    static struct init_untyped_item items[1];
+    static struct untyped_split splits[DEFAULT_UNTYPED_SPLITS];
+    static seL4_Word cslot_words[CSLOT_STORAGE_WORDS(60000)];
+    static struct journal_entry journal[16];
+    static struct allocator allocator;
+    struct allocator_storage storage;
+    struct untyped_item item;
+    int sizes[1] = {20};
+    long count = 0;
+
+    mock_boot(1, sizes, 60000);
+    item.cap = MOCK_FIRST_UNTYPED;
+    item.size_bits = 20;
+    storage.items = items;
+    storage.max_items = 1;
+    storage.splits = splits;
+    storage.max_splits = DEFAULT_UNTYPED_SPLITS;
+    storage.cslot_words = cslot_words;
+    storage.max_cslots = 60000;
+    storage.journal = journal;
+    storage.max_journal_entries = 16;
+    CHECK(allocator_create_with_storage(&allocator, seL4_CapInitThreadCNode,
+                                        seL4_WordBits, 0,
+                                        MOCK_FIRST_UNTYPED + 1, 60000,
+                                        &item, 1, &storage) == 0);
+
+    while (allocator_alloc_kobject(&allocator, seL4_EndpointObject, 0)) {
+        count++;
+    }
+    CHECK(allocator.free_split < 0);
+    CHECK(count > 50000);
+}
+
+#ifdef CONFIG_KERNEL_STABLE
+/*
+ * With bump allocation, small objects are packed into one arena at
+ * increasing offsets, each costing one retype and no untyped item.
+ */
+static void
+test_bump_allocation(void)
+{
+    struct allocator *allocator;
+    int sizes[] = {22};
+    struct mock_cap *first, *cap;
+    unsigned long retypes;
+    seL4_CPtr slot;
+    int i;
+
+    allocator = boot(1, sizes, 4000);
+    allocator_enable_bump_allocation(allocator, 16);
+    slot = allocator_alloc_kobject(allocator, seL4_EndpointObject, 0);
+    CHECK(slot);
+    first = mock_cap(slot);
+
+    retypes = mock_counters.retypes;
+    for (i = 1; i < 100; i++) {
+        slot = allocator_alloc_kobject(allocator, seL4_EndpointObject, 0);
+        CHECK(slot);
+        cap = mock_cap(slot);
+        CHECK(cap->parent == first->parent);
+        CHECK(cap->paddr == first->paddr + i * (1UL << cap->size_bits));
+    }
+    CHECK(mock_counters.retypes - retypes == 99);
+    CHECK(mock_cap(first->parent)->size_bits == 16);
+}
+#endif
+
+/*
+ * Releasing a mark frees everything allocated since, including the objects
+ * and the slots they are in.
+ */
+static void
+test_journal_release(void)
+{
+    struct allocator *allocator;
+    int sizes[] = {22};
+    unsigned long slots_used;
+    long mock_used;
+    int mark;
+    int i;
+
+    allocator = boot(1, sizes, 4000);
+    CHECK(allocator_alloc_kobject(allocator, seL4_EndpointObject, 0));
+    slots_used = allocator->num_slots_used;
+    mock_used = mock_used_slots();
+
+    mark = allocator_mark(allocator);
+    CHECK(mark >= 0);
+    CHECK(allocator_alloc_untyped(allocator, 12));
+    for (i = 0; i < 10; i++) {
+        CHECK(allocator_alloc_kobject(allocator, seL4_EndpointObject, 0));
+    }
+    CHECK(allocator_alloc_cslots(allocator, 5));
+    allocator_release(allocator, mark);
+
+    CHECK(allocator->num_slots_used <= slots_used + 32);
+    CHECK(allocator->num_marks == 0);
+    /* Only the split items we keep for next time remain. */
+    CHECK(mock_used_slots() - mock_used
+          == (long)(allocator->num_slots_used - slots_used));
+}
+
+/*
+ * A full journal is compacted rather than refusing allocations, so a scope
+ * can hold more than half as many objects as there are entries, and can
+ * allocate and free as often as it likes.
+ */
+static void
+test_journal_compact(void)
+{
+    struct allocator *allocator;
+    int sizes[] = {22};
+    unsigned long slots_used;
+    long mock_used;
+    seL4_CPtr cap, slot;
+    int mark;
+    int i;
+
+    allocator = boot(1, sizes, 4000);
+    slots_used = allocator->num_slots_used;
+    mock_used = mock_used_slots();
+
+    mark = allocator_mark(allocator);
+    for (i = 0; i < 1000; i++) {
+        cap = allocator_alloc_untyped(allocator, 12);
+        slot = allocator_alloc_cslot(allocator);
+        CHECK(cap && slot);
+        allocator_free_cslot(allocator, slot);
+        allocator_free_untyped(allocator, cap, 12);
+    }
+    for (i = 0; i < 200; i++) {
+        CHECK(allocator_alloc_kobject(allocator, seL4_EndpointObject, 0));
+    }
+    CHECK(allocator->journal_len <= MAX_JOURNAL_ENTRIES);
+    allocator_release(allocator, mark);
+
+    CHECK(allocator->num_marks == 0);
+    /* Only the split items we keep for next time remain. */
+    CHECK(mock_used_slots() - mock_used
+          == (long)(allocator->num_slots_used - slots_used));
+}
+
+/*
+ * Slots filled by allocator_retype_untyped_memory() are released with the
+ * untyped item they came from.
+ */
+static void
+test_journal_retype(void)
+{
+    struct allocator *allocator;
+    struct cap_range range;
+    int sizes[] = {12};
+    unsigned long slots_used;
+    seL4_CPtr untyped;
+    int mark;
+
+    allocator = boot(1, sizes, 4000);
+    slots_used = allocator->num_slots_used;
+
+    mark = allocator_mark(allocator);
+    untyped = allocator_alloc_untyped(allocator, 12);
+    CHECK(untyped);
+    CHECK(allocator_retype_untyped_memory(allocator, untyped,
+                                          seL4_EndpointObject, 0, 4,
+                                          &range) == 4);
+    CHECK(range.count == 4 && mock_cap(range.first)->type
+          == seL4_EndpointObject);
+    allocator_release(allocator, mark);
+
+    CHECK(allocator->num_slots_used == slots_used);
+    CHECK(mock_used_slots() == 0);
+}
+
+/*
+ * A batch of objects lands in contiguous slots, carved out of one untyped
+ * item per power-of-two part of the batch.
+ */
+static void
+test_kobjects_batch(void)
+{
+    struct allocator *allocator;
+    struct cap_range range;
+    int sizes[] = {22};
+    struct mock_cap *cap;
+    long parents[3];
+    int num_parents = 0;
+    int i;
+
+    allocator = boot(1, sizes, 4000);
+    CHECK(allocator_alloc_kobjects(allocator, seL4_EndpointObject, 0, 100,
+                                   &range) == 100);
+    CHECK(range.count == 100);
+    for (i = 0; i < 100; i++) {
+        cap = mock_cap(range.first + i);
+        CHECK(cap->type == seL4_EndpointObject);
+        if (!num_parents || parents[num_parents - 1] != cap->parent) {
+            CHECK(num_parents < 3);
+            if (num_parents < 3) {
+                parents[num_parents++] = cap->parent;
+            }
+        }
+    }
+
+    /* 64 + 32 + 4 */
+    CHECK(num_parents == 3);
+    CHECK(mock_cap(parents[0])->num_children == 64);
+    CHECK(mock_cap(parents[1])->num_children == 32);
+    CHECK(mock_cap(parents[2])->num_children == 4);
+}
+
+/*
+ * A batch of objects that fails to be created gives back its memory and
+ * slots.
+ */
+static void
+test_kobjects_failure(void)
+{
+    struct allocator *allocator;
+    struct cap_range range;
+    int sizes[] = {8};
+    unsigned long slots_used;
+
+    allocator = boot(1, sizes, 4000);
+    slots_used = allocator->num_slots_used;
+    mock_fail(MOCK_RETYPE, 0, seL4_NotEnoughMemory);
+    CHECK(allocator_alloc_kobjects(allocator, seL4_EndpointObject, 0, 16,
+                                   &range) == 0);
+    CHECK(range.count == 0);
+    CHECK(allocator->num_slots_used == slots_used);
+
+    mock_fail(MOCK_RETYPE, -1, 0);
+    CHECK(allocator_alloc_kobjects(allocator, seL4_EndpointObject, 0, 16,
+                                   &range) == 16);
+}
+
+/*
+ * A magazine refills a batch at a time, serves the rest of the batch without
+ * touching the shared allocator, and gives everything back when drained.
+ */
+static void
+test_magazine(void)
+{
+    static struct allocator_magazine magazine;
+    struct allocator_stats start, refilled, stats;
+    struct allocator_lock lock;
+    struct allocator *allocator;
+    int sizes[] = {22};
+    seL4_CPtr untyped[MAGAZINE_SIZE / 2];
+    seL4_CPtr slots[MAGAZINE_SIZE / 2];
+    int i;
+
+    allocator = boot(1, sizes, 4000);
+    allocator_get_stats(allocator, &start);
+    allocator_lock_init(&lock);
+    magazine_init(&magazine, allocator, &lock);
+
+    /* The first allocations take a whole batch from the shared allocator. */
+    untyped[0] = magazine_alloc_untyped(&magazine, 12);
+    slots[0] = magazine_alloc_cslot(&magazine);
+    CHECK(untyped[0] && slots[0]);
+    allocator_get_stats(allocator, &refilled);
+    CHECK(refilled.bytes_free == start.bytes_free - (MAGAZINE_SIZE / 2 << 12));
+
+    /* The rest of the batch doesn't touch it. */
+    for (i = 1; i < MAGAZINE_SIZE / 2; i++) {
+        untyped[i] = magazine_alloc_untyped(&magazine, 12);
+        slots[i] = magazine_alloc_cslot(&magazine);
+        CHECK(untyped[i] && slots[i]);
+    }
+    CHECK(magazine.num_untyped[12 - MIN_UNTYPED_SIZE] == 0);
+    CHECK(magazine.num_cslots == 0);
+    allocator_get_stats(allocator, &stats);
+    CHECK(stats.bytes_free == refilled.bytes_free);
+    CHECK(stats.slots_used == refilled.slots_used);
+
+    /* Freed slots are cached until the magazine is drained. */
+    for (i = 0; i < MAGAZINE_SIZE / 2; i++) {
+        magazine_free_cslot(&magazine, slots[i]);
+        magazine_free_untyped(&magazine, untyped[i], 12);
+    }
+    CHECK(magazine.num_cslots == MAGAZINE_SIZE / 2);
+    magazine_drain(&magazine);
+    CHECK(magazine.num_cslots == 0);
+    allocator_get_stats(allocator, &stats);
+    CHECK(stats.slots_used == refilled.slots_used - MAGAZINE_SIZE / 2);
+}
+
+/*
+ * Prewarmed object caches hand out ready-made objects without any retypes,
+ * and take freed ones back.
+ */
+static void
+test_object_cache(void)
+{
+    static const struct object_cache_profile profile[] = {
+        {seL4_EndpointObject, 0, 4, 8},
+        {seL4_ARM_SmallPageObject, 0, 2, 4},
+    };
+    static struct object_cache caches[2];
+    struct allocator *allocator;
+    int sizes[] = {22};
+    unsigned long retypes;
+    seL4_CPtr objects[10];
+    int i;
+
+    allocator = boot(1, sizes, 4000);
+    CHECK(object_cache_prewarm(caches, allocator, profile, 2) == 2);
+    CHECK(caches[0].num_objects == 12);
+    CHECK(caches[1].num_objects == 6);
+
+    retypes = mock_counters.retypes;
+    for (i = 0; i < 10; i++) {
+        objects[i] = object_cache_alloc(&caches[0]);
+        CHECK(objects[i]
+              && mock_cap(objects[i])->type == seL4_EndpointObject);
+    }
+    CHECK(mock_cap(object_cache_alloc(&caches[1]))->type
+          == seL4_ARM_SmallPageObject);
+    CHECK(mock_counters.retypes == retypes);
+    CHECK(object_cache_needs_refill(&caches[0]));
+    CHECK(!object_cache_needs_refill(&caches[1]));
+
+    for (i = 0; i < 10; i++) {
+        object_cache_free(&caches[0], objects[i]);
+    }
+    CHECK(caches[0].num_objects == 12);
+    CHECK(mock_cap(object_cache_alloc(&caches[0]))->type
+          == seL4_EndpointObject);
+    CHECK(mock_counters.retypes == retypes);
+}
+
+/*
+ * A reset destroys everything, in one go or a bounded amount at a time.
+ */
+static void
+test_reset(void)
+{
+    struct allocator *allocator;
+    int sizes[] = {20, 20, 20, 20};
+    unsigned long syscalls;
+    seL4_CPtr fresh;
+    int left;
+    int i;
+
+    allocator = boot(4, sizes, 4000);
+    for (i = 0; i < 3; i++) {
+        CHECK(allocator_alloc_untyped(allocator, 20));
+    }
+    for (i = 0; i < 100; i++) {
+        CHECK(allocator_alloc_kobject(allocator, seL4_EndpointObject, 0));
+    }
+    allocator_reset(allocator);
+    CHECK(allocator->num_slots_used == 0);
+    CHECK(mock_used_slots() == 0);
+
+    for (i = 0; i < 3; i++) {
+        CHECK(allocator_alloc_untyped(allocator, 20));
+    }
+    for (i = 0; i < 100; i++) {
+        CHECK(allocator_alloc_kobject(allocator, seL4_EndpointObject, 0));
+    }
+    allocator_reset_begin(allocator);
+    fresh = 0;
+    do {
+        syscalls = mock_counters.syscalls;
+        left = allocator_reset_continue(allocator, 1);
+        CHECK(mock_counters.syscalls - syscalls <= 1);
+        if (!fresh) {
+            fresh = allocator_alloc_kobject(allocator, seL4_EndpointObject, 0);
+        }
+    } while (left);
+    CHECK(fresh && mock_cap(fresh)->type == seL4_EndpointObject);
+    CHECK(allocator->num_slots_used == (unsigned long)mock_used_slots());
+}
+
+/*
+ * A warm reset destroys every object but keeps the splits, so doing the
+ * same allocations again splits nothing.
+ */
+static void
+test_reset_warm(void)
+{
+    struct allocator *allocator;
+    int sizes[] = {22};
+    unsigned long retypes;
+    unsigned long splits_used = 0;
+    int round;
+    int i;
+
+    allocator = boot(1, sizes, 4000);
+    for (round = 0; round < 2; round++) {
+        retypes = mock_counters.retypes;
+        for (i = 0; i < 10; i++) {
+            CHECK(allocator_alloc_untyped(allocator, 12));
+        }
+        for (i = 0; i < 100; i++) {
+            CHECK(allocator_alloc_kobject(allocator, seL4_EndpointObject, 0));
+        }
+        if (round) {
+            /* One retype per endpoint, and no splits. */
+            CHECK(mock_counters.retypes - retypes == 100);
+        }
+
+        allocator_reset_warm(allocator);
+        CHECK(allocator->num_slots_used == (unsigned long)mock_used_slots());
+        if (round) {
+            CHECK(allocator->num_slots_used == splits_used);
+        }
+        splits_used = allocator->num_slots_used;
+    }
+}
+
+/*
+ * Saved state can be restored without any kernel invocations, and damaged
+ * state is refused.
+ */
+static void
+test_serialize(void)
+{
+    static seL4_Word buffer[4096];
+    struct allocator_stats before, after;
+    struct allocator *allocator;
+    int sizes[] = {22, 20};
+    unsigned long syscalls;
+    long size;
+    int i;
+
+    allocator = boot(2, sizes, 4000);
+    for (i = 0; i < 50; i++) {
+        CHECK(allocator_alloc_untyped(allocator, 12));
+    }
+    size = allocator_serialize(allocator, buffer, 8);
+    CHECK(size > 0 && size <= (long)sizeof(buffer));
+    CHECK(allocator_serialize(allocator, buffer, sizeof(buffer)) == size);
+    allocator_get_stats(allocator, &before);
+
+    syscalls = mock_counters.syscalls;
+    allocator = create_first_stage_allocator_restore(buffer, size);
+    CHECK(mock_counters.syscalls == syscalls);
+    allocator_get_stats(allocator, &after);
+    CHECK(before.bytes_free == after.bytes_free);
+    CHECK(before.slots_used == after.slots_used);
+    for (i = 0; i < 50; i++) {
+        CHECK(allocator_alloc_untyped(allocator, 12));
+    }
+
+    buffer[20] ^= 1;
+    CHECK(allocator_restore(allocator, buffer, size) == -1);
+}
+
+/*
+ * Recompute the checksum of the saved state in 'words', as
+ * allocator_serialize() does, after damaging it.
+ */
+static void
+reseal(seL4_Word *words)
+{
+    seL4_Word sum = 0x54574b4cUL;
+    unsigned long i;
+
+    for (i = 6; i < words[3]; i++) {
+        sum = ((sum << 5) | (sum >> (sizeof(seL4_Word) * 8 - 5))) ^ words[i];
+    }
+    words[4] = sum;
+}
+
+/*
+ * Restore 'words' into a freshly created allocator for the booted kernel.
+ */
+static int
+restore_fresh(const seL4_Word *words)
+{
+    static struct init_untyped_item items[64];
+    static struct untyped_split splits[1024];
+    static seL4_Word cslot_words[CSLOT_STORAGE_WORDS(MAX_CSLOTS)];
+    static struct journal_entry journal[MAX_JOURNAL_ENTRIES];
+    static struct allocator allocator;
+    seL4_BootInfo *bootinfo = seL4_GetBootInfo();
+    struct allocator_storage storage;
+
+    storage.items = items;
+    storage.max_items = 64;
+    storage.splits = splits;
+    storage.max_splits = 1024;
+    storage.cslot_words = cslot_words;
+    storage.max_cslots = MAX_CSLOTS;
+    storage.journal = journal;
+    storage.max_journal_entries = MAX_JOURNAL_ENTRIES;
+    allocator_create_with_storage(&allocator, seL4_CapInitThreadCNode,
+                                  seL4_WordBits, 0, bootinfo->empty.start,
+                                  bootinfo->empty.end - bootinfo->empty.start,
+                                  NULL, 0, &storage);
+    return allocator_restore(&allocator, words, words[3] * sizeof(seL4_Word));
+}
+
+/*
+ * Saved state that is damaged, but has a good checksum, is refused before it
+ * can do any harm.
+ */
+static void
+test_serialize_damaged(void)
+{
+    static seL4_Word image[4096];
+    static seL4_Word words[4096];
+    static const seL4_Word values[] = {0, 1, 2, 15, 16, 17, 63, 200, ~0UL};
+    struct allocator *allocator;
+    int sizes[] = {22, 20};
+    unsigned long items, splits, split;
+    unsigned long i, j;
+
+    allocator = boot(2, sizes, 4000);
+    for (i = 0; i < 50; i++) {
+        CHECK(allocator_alloc_untyped(allocator, 12));
+    }
+    CHECK(allocator_serialize(allocator, image, sizeof(image)) > 0);
+    CHECK(restore_fresh(image) == 0);
+
+    /* Find our way around: the header, where our slots are, the slot
+     * bitmap, and the CSpace growth fields come first. */
+    i = 6 + 6 + (allocator->num_cslots + CSLOT_WORD_BITS - 1) / CSLOT_WORD_BITS;
+    items = i + 7;
+    splits = items + image[items - 1] * 7 + 1;
+    CHECK(image[splits - 1] > 0);
+
+    /* State saved with other options. */
+    memcpy(words, image, image[3] * sizeof(seL4_Word));
+    words[5] ^= 1;
+    CHECK(restore_fresh(words) == -1);
+
+    /* The CNode size is used as a shift count. */
+    memcpy(words, image, image[3] * sizeof(seL4_Word));
+    words[i + 4] = 200;
+    reseal(words);
+    CHECK(restore_fresh(words) == -1);
+
+    for (split = splits; split < splits + image[splits - 1] * 14;
+            split += 14) {
+        /* Children that aren't there. */
+        memcpy(words, image, image[3] * sizeof(seL4_Word));
+        words[split + 8] |= 1UL << words[split + 6];
+        reseal(words);
+        CHECK(restore_fresh(words) == -1);
+
+        /* A parent that isn't there. */
+        memcpy(words, image, image[3] * sizeof(seL4_Word));
+        words[split + 3] = words[split + 2] == ~0UL ? image[items - 1] : 16;
+        reseal(words);
+        CHECK(restore_fresh(words) == -1);
+
+        /* A split that is its own parent. */
+        memcpy(words, image, image[3] * sizeof(seL4_Word));
+        words[split + 2] = words[split];
+        words[split + 3] = 0;
+        reseal(words);
+        CHECK(restore_fresh(words) == -1);
+
+        /* A pool that goes round in circles. */
+        if (words[split + 8]) {
+            memcpy(words, image, image[3] * sizeof(seL4_Word));
+            words[split + 12] = words[split];
+            reseal(words);
+            CHECK(restore_fresh(words) == -1);
+        }
+    }
+
+    /* Whatever we do to any one word, restoring must not crash. */
+    for (i = 5; i < image[3]; i++) {
+        for (j = 0; j < sizeof(values) / sizeof(values[0]); j++) {
+            memcpy(words, image, image[3] * sizeof(seL4_Word));
+            words[i] = values[j];
+            reseal(words);
+            restore_fresh(words);
+        }
+    }
+}
+
+#ifdef CONFIG_LIB_SEL4_TWINKLE_TRACE
+/*
+ * A trace replayed on an allocator set up the same way behaves the same, and
+ * one replayed with less memory doesn't.
+ */
+static void
+test_trace_replay(void)
+{
+    static struct allocator_trace_entry entries[CONFIG_LIB_SEL4_TWINKLE_TRACE_ENTRIES];
+    static struct allocator_trace_entry results[CONFIG_LIB_SEL4_TWINKLE_TRACE_ENTRIES];
+    const struct allocator_trace_entry *ours;
+    struct allocator *allocator;
+    int sizes[] = {22, 20};
+    seL4_CPtr cap, slots;
+    int booting;
+    int n;
+    int i;
+
+    /* Leave out whatever creating the allocator did. */
+    allocator = boot(2, sizes, 4000);
+    booting = allocator_trace_read(allocator, entries,
+                                   CONFIG_LIB_SEL4_TWINKLE_TRACE_ENTRIES);
+    for (i = 0; i < 6; i++) {
+        cap = allocator_alloc_untyped(allocator, 12 + i);
+        CHECK(cap);
+        if (i % 3 == 0) {
+            allocator_free_untyped(allocator, cap, 12 + i);
+        }
+    }
+    slots = allocator_alloc_cslots(allocator, 8);
+    CHECK(slots);
+    allocator_free_cslots(allocator, slots + 2, 4);
+    CHECK(allocator_alloc_untyped(allocator, 21));
+    n = allocator_trace_read(allocator, entries,
+                             CONFIG_LIB_SEL4_TWINKLE_TRACE_ENTRIES) - booting;
+    ours = &entries[booting];
+    CHECK(n == 11);
+    CHECK(ours[0].op == ALLOCATOR_TRACE_ALLOC_UNTYPED && ours[0].args[0] == 12);
+    CHECK(ours[n - 1].op == ALLOCATOR_TRACE_ALLOC_UNTYPED && ours[n - 1].result);
+
+    allocator = boot(2, sizes, 4000);
+    CHECK(allocator_trace_replay(allocator, ours, n, results) == 0);
+    for (i = 0; i < n; i++) {
+        CHECK(results[i].op == ours[i].op);
+        CHECK(results[i].result == ours[i].result);
+    }
+
+    /* Without the 4 MiB item, the last allocation can't be made. */
+    sizes[0] = 20;
+    allocator = boot(2, sizes, 4000);
+    CHECK(allocator_trace_replay(allocator, ours, n, results) > 0);
+    CHECK(!results[n - 1].result);
+}
+#endif
+
+/*
+ * Mapping a region uses the biggest pages that fit.
+ */
+static void
+test_mapped_region(void)
+{
+    struct allocator *allocator;
+    int sizes[] = {26, 22};
+    struct mock_cap *cap;
+    int pages[32] = {0};
+    int tables = 0;
+    seL4_CPtr i;
+
+    allocator = boot(2, sizes, 4000);
+    CHECK(allocator_alloc_mapped_region(allocator, seL4_CapInitThreadPD,
+                                        0x00fe0000, 0x2023000,
+                                        seL4_AllRights) == 0);
+    for (i = 0; i < MOCK_NUM_CAPS; i++) {
+        cap = mock_cap(i);
+        if (cap->type == seL4_ARM_PageTableObject) {
+            tables++;
+        } else if (cap->mapped) {
+            pages[cap->size_bits]++;
+        }
+    }
+    CHECK(pages[16] == 2);
+    CHECK(pages[24] == 2);
+    CHECK(pages[12] == 3);
+    CHECK(tables == 2);
+}
+
+#ifdef CONFIG_LIB_SEL4_TWINKLE_CACHE_COLOURING
+/*
+ * Coloured allocations only use memory of the allowed colours, and fail
+ * rather than use any other.
+ */
+static void
+test_colours(void)
+{
+    struct allocator *allocator;
+    int sizes[] = {22};
+    seL4_CPtr cap;
+    int i;
+
+    allocator = boot(1, sizes, 4000);
+    allocator_set_colours(allocator, 1UL << 3);
+    for (i = 0; i < 10; i++) {
+        cap = allocator_alloc_coloured_untyped(allocator, 12);
+        CHECK(cap);
+        CHECK(CACHE_COLOUR(allocator_untyped_paddr(allocator, cap)) == 3);
+    }
+    cap = allocator_alloc_coloured_kobject(allocator, seL4_ARM_SmallPageObject,
+                                           0);
+    CHECK(cap && CACHE_COLOUR(mock_cap(cap)->paddr) == 3);
+
+    /* Two pages always have two colours. */
+    CHECK(!allocator_alloc_coloured_untyped(allocator, 13));
+}
+#endif
+
+#ifdef CONFIG_LIB_SEL4_TWINKLE_CACHE_COLOURING
+/*
+ * Coloured regions are mapped a run of pages of the allowed colours at a
+ * time, so they aren't limited by the size of the journal.
+ */
+static void
+test_mapped_region_coloured(void)
+{
+    struct allocator *allocator;
+    int sizes[] = {23};
+    struct mock_cap *cap;
+    int frames = 0;
+    seL4_CPtr i;
+
+    allocator = boot(1, sizes, 4000);
+    allocator_set_colours(allocator, 0xff);
+    CHECK(allocator_alloc_mapped_region(allocator, seL4_CapInitThreadPD,
+                                        0x01000000, 2 << 20,
+                                        seL4_AllRights) == 0);
+    for (i = 0; i < MOCK_NUM_CAPS; i++) {
+        cap = mock_cap(i);
+        if (cap->mapped && cap->type != seL4_ARM_PageTableObject) {
+            CHECK(CACHE_COLOUR(cap->paddr) < 8);
+            frames++;
+        }
+    }
+    CHECK(frames == 512);
+}
+#endif
+
+/*
+ * A region that can't be mapped in full is unmapped and freed again, whether
+ * mapping a page or a page table fails.
+ */
+static void
+test_mapped_region_failure(void)
+{
+    struct allocator *allocator;
+    int sizes[] = {26, 22};
+    unsigned long slots_used;
+    long mock_used;
+    seL4_CPtr i;
+    int mapped;
+    int op;
+
+    for (op = MOCK_PAGE_MAP; op <= MOCK_PAGE_TABLE_MAP; op++) {
+        allocator = boot(2, sizes, 4000);
+        slots_used = allocator->num_slots_used;
+        mock_used = mock_used_slots();
+        mock_fail(op, op == MOCK_PAGE_MAP ? 5 : 1, seL4_InvalidArgument);
+        CHECK(allocator_alloc_mapped_region(allocator, seL4_CapInitThreadPD,
+                                            0x00fe0000, 0x2023000,
+                                            seL4_AllRights) != 0);
+        mapped = 0;
+        for (i = 0; i < MOCK_NUM_CAPS; i++) {
+            if (mock_cap(i)->mapped) {
+                mapped++;
+            }
+        }
+        CHECK(mapped == 0);
+        /* Only the split items we keep for next time remain. */
+        CHECK(mock_used_slots() - mock_used
+              == (long)(allocator->num_slots_used - slots_used));
+        for (i = 0; i < MOCK_NUM_CAPS; i++) {
+            CHECK(!mock_cap(i)->type
+                  || mock_cap(i)->type == seL4_UntypedObject);
+        }
+        CHECK(allocator->num_marks == 0);
+
+        /* Everything is there to try again. */
+        mock_fail(op, -1, 0);
+        CHECK(allocator_alloc_mapped_region(allocator, seL4_CapInitThreadPD,
+                                            0x00fe0000, 0x2023000,
+                                            seL4_AllRights) == 0);
+    }
+}
+
+int
+main(void)
+{
+    test_split_merge();
+    test_split_down();
+    test_alloc_at();
+    test_merge_reclaimed();
+    test_size_index();
+    test_presplit();
+    test_maintain();
+    test_create_storage();
+    test_lazy_child();
+    test_cspace_growth();
+    test_split_exhaustion();
+#ifdef CONFIG_KERNEL_STABLE
+    test_bump_allocation();
+#endif
+    test_journal_release();
+    test_journal_compact();
+    test_journal_retype();
+    test_kobjects_batch();
+    test_kobjects_failure();
+    test_magazine();
+    test_object_cache();
+    test_reset();
+    test_reset_warm();
+    test_serialize();
+    test_serialize_damaged();
+#ifdef CONFIG_LIB_SEL4_TWINKLE_TRACE
+    test_trace_replay();
+#endif
+    test_mapped_region();
+    test_mapped_region_failure();
+#ifdef CONFIG_LIB_SEL4_TWINKLE_CACHE_COLOURING
+    test_colours();
+    test_mapped_region_coloured();
+#endif
+
+    if (failures) {
+        printf("%d checks failed\n", failures);
+        return 1;
+    }
+    printf("all checks passed\n");
+    return 0;
+}